@@ -35,8 +35,11 @@ int main(int argc, char* argv[]) {
 		print_error_message_and_exit("Failed to open the message channel");
 	}
 	
-	char buf[MAX_MSG_LEN + 1];
-	ssize_t bytes_read = read(fd, buf, MAX_MSG_LEN);
+	char* buf = malloc(MAX_MSG_LEN_LIMIT); // the channel's limit may have been raised, so we make room for the longest possible message
+	if (buf == NULL) {
+		print_error_message_and_exit("Failed to allocate the message buffer");
+	}
+	ssize_t bytes_read = read(fd, buf, MAX_MSG_LEN_LIMIT);
 	if (bytes_read == -1) {
 		print_error_message_and_exit("Failed to read the message");
 	}
@@ -49,6 +52,7 @@ int main(int argc, char* argv[]) {
 	if (bytes_written == -1 || bytes_written != bytes_read) {
 		print_error_message_and_exit("Failed to print the message");
 	}
+	free(buf);
 
 	exit(0); // success 
 }
@@ -1,6 +1,7 @@
 #include "message_slot.h"
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
@@ -19,9 +20,36 @@ void print_error_message_and_exit(const char* s) {
 }
 
 
+// deliver all the (channel id, message) pairs of the command line with a single syscall
+void send_batch(int fd, int n_messages, char* pairs[]) {
+	struct msg_slot_batch_entry* entries = calloc(n_messages, sizeof(struct msg_slot_batch_entry));
+	if (entries == NULL) {
+		print_error_message_and_exit("Failed to allocate the batch");
+	}
+	for (int i = 0; i < n_messages; i++) {
+		entries[i].channel_id = atoi(pairs[2 * i]);
+		entries[i].length = strlen(pairs[2 * i + 1]);
+		entries[i].buffer = (unsigned long long) (uintptr_t) pairs[2 * i + 1];
+	}
+	struct msg_slot_batch batch = {
+		.count = n_messages,
+		.entries = (unsigned long long) (uintptr_t) entries,
+	};
+	int n_sent = ioctl(fd, MSG_SLOT_WRITE_BATCH, &batch);
+	if (n_sent == -1) {
+		print_error_message_and_exit("Failed to write the messages");
+	}
+	if (n_sent != n_messages) {
+		fprintf(stderr, "Only %d of %d messages were written\n", n_sent, n_messages);
+		exit(1);
+	}
+	free(entries);
+}
+
+
 int main(int argc, char* argv[]) {
-	if (argc != 4) {
-		printf("You must pass 3 arguments\n");
+	if (argc < 4 || argc % 2 != 0) {
+		printf("You must pass a file path and at least one pair of a channel id and a message\n");
 		exit(1);
 	}
 
@@ -29,16 +57,25 @@ int main(int argc, char* argv[]) {
 	if (fd == -1) {
 		print_error_message_and_exit("Failed to open the file");
 	}
-	
-	unsigned int channel_id = atoi(argv[2]);
-	if (ioctl(fd, MSG_SLOT_CHANNEL, channel_id) == -1) {
-		print_error_message_and_exit("Failed to open the message channel");
-	}
-	
-	size_t message_len = strlen(argv[3]);
-	ssize_t bytes_written = write(fd, argv[3], message_len); // write the message to the device file
-	if (bytes_written == -1 || bytes_written != message_len) {
-		print_error_message_and_exit("Failed to write the message");
+
+	int n_messages = (argc - 2) / 2;
+	if (n_messages > 1) {
+		if (n_messages > MAX_BATCH_LEN) {
+			fprintf(stderr, "At most %d messages can be sent at once\n", MAX_BATCH_LEN);
+			exit(1);
+		}
+		send_batch(fd, n_messages, argv + 2);
+	} else {
+		unsigned int channel_id = atoi(argv[2]);
+		if (ioctl(fd, MSG_SLOT_CHANNEL, channel_id) == -1) {
+			print_error_message_and_exit("Failed to open the message channel");
+		}
+
+		size_t message_len = strlen(argv[3]);
+		ssize_t bytes_written = write(fd, argv[3], message_len); // write the message to the device file
+		if (bytes_written == -1 || bytes_written != message_len) {
+			print_error_message_and_exit("Failed to write the message");
+		}
 	}
 
 	if (close(fd) == -1) {
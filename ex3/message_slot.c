@@ -4,37 +4,108 @@
 #define MODULE
 
 #include "message_slot.h"
+#include "message_slot_store.h"
 
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/eventfd.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/version.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/compat.h>
+#include <linux/rcupdate.h>
+
+#define CREATE_TRACE_POINTS
+#include "message_slot_trace.h"
 
 MODULE_LICENSE("GPL");
 
+module_param(max_msg_len, uint, 0444);
+MODULE_PARM_DESC(max_msg_len, "The maximal message length of a new channel, at most MAX_MSG_LEN_LIMIT (default MAX_MSG_LEN)");
+module_param(max_total_bytes, ullong, 0644);
+MODULE_PARM_DESC(max_total_bytes, "The memory all the slots may hold before writes fail with ENOMEM, or 0 for no cap (default 0)");
+
+static unsigned int idle_channel_timeout = 0;
+module_param(idle_channel_timeout, uint, 0444);
+MODULE_PARM_DESC(idle_channel_timeout, "The seconds after which a channel nobody has touched is deleted with its messages, or 0 to keep channels forever (default 0)");
+
+static const char* const message_slot_counter_names[N_MESSAGE_SLOT_COUNTERS] = {
+	"messages_written",
+	"bytes_written",
+	"messages_read",
+	"bytes_read",
+	"overwrites",
+	"would_blocks",
+	"alloc_failures",
+};
+
 struct message_slot_list {
 	struct message_slot_node* head;
 };
 
-struct message_slot_node {
-	struct message_slot_node* next;
-	struct message_channel_node* head_message_channel_node;
-	unsigned int minor_num;
+// the ring of a shared channel, which lives as long as the channel or one of its mappings references it.
+// the sizes are kept apart from the shared header, since userspace may scribble over it
+struct message_channel_shm {
+	struct kref kref;
+	struct msg_slot_shm_header* header;
+	unsigned long size;
+	unsigned int nr_entries;
+	unsigned int entry_size;
+	struct eventfd_ctx* eventfd;
+	struct rcu_head rcu; // blocked readers and writers check the ring without the slot's lock, so it's freed only after a grace period
 };
 
-struct message_channel_node {
-	struct message_channel_node* next;
+// the state of an open file descriptor, stored in file->private_data
+struct message_slot_file {
+	struct message_slot_node* message_slot_node;
 	unsigned int channel_id;
-	size_t message_len;
-	char* message;
+	unsigned long last_read_seq; // the message_seq of the last message read through this file descriptor
+	wait_queue_head_t poll_wait_queue; // the pollers of the file descriptor wait here, since its channel may change or go away before they do
+	wait_queue_entry_t poll_relay; // passes the wake-ups of polled_channel on to poll_wait_queue
+	struct message_channel_node* polled_channel; // the channel poll_relay sits on, held by a reference, or NULL; protected by the slot's lock
 };
 
 struct message_slot_list* message_slot_list;
+static DEFINE_MUTEX(message_slot_list_lock); // protects message_slot_list and the open_count of its slots
+
+static void expire_idle_channels(struct work_struct* work);
+static DECLARE_DELAYED_WORK(expire_work, expire_idle_channels);
+static int relay_channel_wake_up(struct wait_queue_entry* wait, unsigned int mode, int sync, void* key);
+static struct message_channel_node* unwatch_polled_channel(struct message_slot_file* message_slot_file);
+static void put_message_channel_node(struct message_channel_node* message_channel_node);
+
+
+static struct message_slot_file* get_message_slot_file(struct file* file) {
+	return (struct message_slot_file*) file->private_data;
+}
 
 
 static void associate_channel_id_with_fd(struct file* file, unsigned int channel_id) {
-	file->private_data = (void*) (unsigned long) channel_id; // the casting to unsigned long and only then to void* used to avoid warnings in complilation
+	struct message_slot_file* message_slot_file = get_message_slot_file(file);
+	struct message_slot_node* message_slot_node = message_slot_file->message_slot_node;
+	struct message_channel_node* unpolled_channel;
+	mutex_lock(&message_slot_node->lock);
+	message_slot_file->channel_id = channel_id;
+	message_slot_file->last_read_seq = 0; // a message already waiting on the new channel is a new one for this file descriptor
+	unpolled_channel = unwatch_polled_channel(message_slot_file);
+	mutex_unlock(&message_slot_node->lock);
+	if (unpolled_channel != NULL) {
+		put_message_channel_node(unpolled_channel);
+	}
+	wake_up_interruptible(&message_slot_file->poll_wait_queue); // the pollers poll again, which moves the relay to the new channel
 }
 
 
@@ -50,176 +121,996 @@ static struct message_slot_node* find_message_slot_node_by_minor_num(unsigned in
 }
 
 
-static int create_message_slot_node(unsigned int minor_num) {
+static struct message_slot_node* create_message_slot_node(unsigned int minor_num) {
 	struct message_slot_node* new_message_slot_node = kmalloc(sizeof(struct message_slot_node), GFP_KERNEL);
 	if (new_message_slot_node == NULL) {
-		return -1;
+		return NULL;
 	}
 	new_message_slot_node->head_message_channel_node = NULL;
 	new_message_slot_node->minor_num = minor_num;
+	new_message_slot_node->open_count = 0;
+	init_message_slot_stats(&new_message_slot_node->stats);
+	mutex_init(&new_message_slot_node->lock);
 	// insert the new node as the head of the list
 	new_message_slot_node->next = message_slot_list->head;
 	message_slot_list->head = new_message_slot_node;
-	return SUCCESS;
+	return new_message_slot_node;
+}
+
+
+static void free_message_channel_shm(struct rcu_head* rcu) {
+	struct message_channel_shm* shm = container_of(rcu, struct message_channel_shm, rcu);
+	vfree(shm->header);
+	uncharge_memory(shm->size);
+	kfree(shm);
+}
+
+
+static void release_message_channel_shm(struct kref* kref) {
+	struct message_channel_shm* shm = container_of(kref, struct message_channel_shm, kref);
+	if (shm->eventfd != NULL) {
+		eventfd_ctx_put(shm->eventfd);
+	}
+	call_rcu(&shm->rcu, free_message_channel_shm);
+}
+
+
+static void put_message_channel_shm(struct message_channel_shm* shm) {
+	kref_put(&shm->kref, release_message_channel_shm);
+}
+
+
+static void release_message_channel_node(struct kref* kref) {
+	struct message_channel_node* message_channel_node = container_of(kref, struct message_channel_node, kref);
+	if (message_channel_node->shm != NULL) {
+		put_message_channel_shm(message_channel_node->shm); // existing mappings keep the ring alive
+	}
+	destroy_message_channel_node(message_channel_node);
+}
+
+
+static void get_message_channel_node(struct message_channel_node* message_channel_node) {
+	kref_get(&message_channel_node->kref);
+}
+
+
+static void put_message_channel_node(struct message_channel_node* message_channel_node) {
+	kref_put(&message_channel_node->kref, release_message_channel_node);
+}
+
+
+// remove the channel from the slot; its memory is reclaimed once its blocked readers, writers and pollers let go of it.
+// requires the slot's lock, and the caller drops the reference of the channel list after releasing the lock
+static void delete_message_channel_node(struct message_slot_node* message_slot_node, struct message_channel_node* message_channel_node) {
+	unlink_message_channel_node(message_slot_node, message_channel_node);
+	wake_up_interruptible(&message_channel_node->wait_queue); // blocked readers and writers look the channel id up again
+}
+
+
+// whether deleting the channel would lose anything but its statistics
+static int does_message_channel_hold_state(struct message_channel_node* message_channel_node) {
+	return message_channel_node->count > 0 || message_channel_node->is_queue_mode || message_channel_node->shm != NULL || message_channel_node->max_msg_len != max_msg_len;
+}
+
+
+static int is_message_channel_stateless(struct message_channel_node* message_channel_node) {
+	return !does_message_channel_hold_state(message_channel_node);
+}
+
+
+// a mapped shared channel is never idle, since its messages go through the ring without touching last_access
+static int is_message_channel_idle(struct message_channel_node* message_channel_node) {
+	if (message_channel_node->shm != NULL && kref_read(&message_channel_node->shm->kref) > 1) { // the channel holds one reference and every mapping another
+		return 0;
+	}
+	return time_after(jiffies, message_channel_node->last_access + (unsigned long) idle_channel_timeout * HZ);
+}
+
+
+// delete the channels of the slot which nobody sleeps on or polls, and which is_reapable picks; requires the slot's lock
+static void reap_message_channel_nodes(struct message_slot_node* message_slot_node, int (*is_reapable)(struct message_channel_node*)) {
+	struct message_channel_node* next_message_channel_node;
+	struct message_channel_node* message_channel_node = message_slot_node->head_message_channel_node;
+	while (message_channel_node != NULL) {
+		next_message_channel_node = message_channel_node->next;
+		if (kref_read(&message_channel_node->kref) == 1 && is_reapable(message_channel_node)) {
+			delete_message_channel_node(message_slot_node, message_channel_node);
+			put_message_channel_node(message_channel_node); // the last reference, which is safe to drop under the lock
+		}
+		message_channel_node = next_message_channel_node;
+	}
+}
+
+
+// free the slot if no file descriptor is open on it and it has no channels left, since messages outlive the file descriptors of their slot.
+// requires the lock of the slot list, which keeps the slot from being opened meanwhile
+static void reclaim_message_slot_node_if_unused(struct message_slot_node* message_slot_node) {
+	struct message_slot_node** link = &message_slot_list->head;
+	if (message_slot_node->open_count > 0 || message_slot_node->head_message_channel_node != NULL) {
+		return;
+	}
+	while (*link != message_slot_node) {
+		link = &(*link)->next;
+	}
+	*link = message_slot_node->next;
+	mutex_destroy(&message_slot_node->lock);
+	kfree(message_slot_node);
 }
 
 
 static int device_open(struct inode* inode, struct file* file) {
 	unsigned int minor_num = iminor(inode);
-	struct message_slot_node* message_slot_node = find_message_slot_node_by_minor_num(minor_num);
+	struct message_slot_node* message_slot_node;
+	struct message_slot_file* message_slot_file = kmalloc(sizeof(struct message_slot_file), GFP_KERNEL);
+	if (message_slot_file == NULL) {
+		return -ENOMEM;
+	}
+
+	mutex_lock(&message_slot_list_lock);
+	message_slot_node = find_message_slot_node_by_minor_num(minor_num);
 	if (message_slot_node == NULL) {
-		if (create_message_slot_node(minor_num) == -1) {
-			return -ENOMEM;
-		}
+		message_slot_node = create_message_slot_node(minor_num);
+	}
+	if (message_slot_node != NULL) {
+		message_slot_node->open_count += 1;
 	}
+	mutex_unlock(&message_slot_list_lock);
+	if (message_slot_node == NULL) {
+		kfree(message_slot_file);
+		return -ENOMEM;
+	}
+
+	message_slot_file->message_slot_node = message_slot_node;
+	message_slot_file->channel_id = 0; // no channel has been set yet
+	message_slot_file->last_read_seq = 0;
+	init_waitqueue_head(&message_slot_file->poll_wait_queue);
+	init_waitqueue_func_entry(&message_slot_file->poll_relay, relay_channel_wake_up);
+	message_slot_file->polled_channel = NULL;
+	file->private_data = message_slot_file;
+	return SUCCESS;
+}
+
+
+// the last release of the slot also lets go of its channels which hold nothing worth keeping, and then of the slot itself
+static int device_release(struct inode* inode, struct file* file) {
+	struct message_slot_file* message_slot_file = get_message_slot_file(file);
+	struct message_slot_node* message_slot_node = message_slot_file->message_slot_node;
+	struct message_channel_node* unpolled_channel;
+	mutex_lock(&message_slot_node->lock);
+	unpolled_channel = unwatch_polled_channel(message_slot_file); // the pollers of the file have already been removed from poll_wait_queue
+	mutex_unlock(&message_slot_node->lock);
+	if (unpolled_channel != NULL) {
+		put_message_channel_node(unpolled_channel);
+	}
+	kfree(message_slot_file);
+
+	mutex_lock(&message_slot_list_lock);
+	message_slot_node->open_count -= 1;
+	if (message_slot_node->open_count == 0) {
+		mutex_lock(&message_slot_node->lock);
+		reap_message_channel_nodes(message_slot_node, is_message_channel_stateless);
+		mutex_unlock(&message_slot_node->lock);
+		reclaim_message_slot_node_if_unused(message_slot_node);
+	}
+	mutex_unlock(&message_slot_list_lock);
 	return SUCCESS;
 }
 
+
 static unsigned int get_channel_id_of_file(struct file* file) {
-	return (unsigned int) (unsigned long) file->private_data; // the casting to unsigned long and only then to unsigned int used to avoid warnings in complilation
+	return get_message_slot_file(file)->channel_id;
 }
 
 
-static ssize_t put_message_in_user_buffer(struct message_channel_node* message_channel_node, char __user* buffer, size_t length) {
-	int i;
-	for (i = 0; i < length && i < message_channel_node->message_len; ++i) {
-		if (put_user(message_channel_node->message[i], buffer + i) < 0) { // put_user failed
-			return -1;
-		}
+static int is_message_channel_shared(struct message_channel_node* message_channel_node) {
+	return READ_ONCE(message_channel_node->shm) != NULL;
+}
+
+
+static unsigned int get_shm_count(struct message_channel_shm* shm) {
+	return smp_load_acquire(&shm->header->tail) - smp_load_acquire(&shm->header->head);
+}
+
+
+// a shared channel is checked through its ring, so this also sees messages published from userspace.
+// blocked readers and writers call it without the slot's lock, while the ring may be replaced, so it's only read under rcu_read_lock
+static int is_message_channel_empty(struct message_channel_node* message_channel_node) {
+	int is_empty;
+	struct message_channel_shm* shm;
+	rcu_read_lock();
+	shm = rcu_dereference(message_channel_node->shm);
+	is_empty = shm != NULL ? get_shm_count(shm) == 0 : is_message_ring_empty(message_channel_node);
+	rcu_read_unlock();
+	return is_empty;
+}
+
+
+static int is_message_channel_full(struct message_channel_node* message_channel_node) {
+	int is_full;
+	struct message_channel_shm* shm;
+	rcu_read_lock();
+	shm = rcu_dereference(message_channel_node->shm);
+	is_full = shm != NULL ? get_shm_count(shm) >= shm->nr_entries : is_message_ring_full(message_channel_node);
+	rcu_read_unlock();
+	return is_full;
+}
+
+
+// whether a write to a full channel has to wait for (or fail on) a reader instead of discarding the oldest message.
+// a write to a full shared ring fails by itself, since only userspace is woken up by its consumer
+static int does_message_channel_hold_writers(struct message_channel_node* message_channel_node) {
+	return !is_message_channel_shared(message_channel_node) && message_channel_node->is_queue_mode && message_channel_node->overflow_policy != MSG_SLOT_OVERFLOW_DROP_OLDEST;
+}
+
+
+static struct msg_slot_shm_entry* get_shm_entry(struct message_channel_shm* shm, unsigned int index) {
+	char* entries = (char*) (shm->header + 1);
+	return (struct msg_slot_shm_entry*) (entries + (index & (shm->nr_entries - 1)) * MSG_SLOT_SHM_ENTRY_STRIDE(shm->entry_size));
+}
+
+
+// publish a message to the shared ring as its producer; requires the slot's lock
+static int publish_shm_message(struct message_channel_shm* shm, const char* data, size_t len) {
+	struct msg_slot_shm_entry* entry;
+	unsigned int tail = READ_ONCE(shm->header->tail);
+	if (len > shm->entry_size) {
+		return -EMSGSIZE;
+	}
+	if (tail - smp_load_acquire(&shm->header->head) >= shm->nr_entries) { // the ring is full and we can't discard a message userspace may be reading
+		return -ENOBUFS;
 	}
-	return i;
+	entry = get_shm_entry(shm, tail);
+	memcpy(entry->data, data, len);
+	WRITE_ONCE(entry->len, len);
+	smp_store_release(&shm->header->tail, tail + 1);
+	if (shm->eventfd != NULL) {
+		WRITE_ONCE(shm->header->consumer_waiting, 0);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(shm->eventfd);
+#else
+		eventfd_signal(shm->eventfd, 1);
+#endif
+	}
+	return SUCCESS;
 }
 
 
-static struct message_channel_node* find_message_channel_node_by_channel_id(struct message_slot_node* message_slot_node, unsigned int channel_id) {
-	struct message_channel_node* message_channel_node = message_slot_node->head_message_channel_node;
-	while (message_channel_node != NULL) {
-		if (message_channel_node->channel_id == channel_id) {
-			return message_channel_node;
-		}
-		message_channel_node = message_channel_node->next;
+// consume the oldest message of the shared ring as its consumer; requires the slot's lock
+static ssize_t consume_shm_message(struct message_channel_shm* shm, struct iov_iter* to) {
+	struct msg_slot_shm_entry* entry;
+	size_t len;
+	unsigned int head = READ_ONCE(shm->header->head);
+	if (head == smp_load_acquire(&shm->header->tail)) {
+		return -EWOULDBLOCK;
 	}
-	return NULL; // such message_channel_node doesn't exist
+	entry = get_shm_entry(shm, head);
+	len = min_t(size_t, READ_ONCE(entry->len), shm->entry_size); // the length was written by userspace, so it can't be trusted
+	if (iov_iter_count(to) < len) {
+		return -ENOSPC;
+	}
+	if (copy_to_iter(entry->data, len, to) != len) {
+		return -EFAULT;
+	}
+	smp_store_release(&shm->header->head, head + 1);
+	return len;
 }
 
 
-// a process which has already opened
-// the device file attempts to read from it
-static ssize_t device_read(struct file* file, char __user* buffer, size_t length, loff_t* offset) {
-	unsigned int minor_num;
-	int bytes_read;
-	struct message_slot_node* message_slot_node;
+static int is_nonblocking_iocb(struct kiocb* iocb) {
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+
+// if the channel is empty, the process sleeps until a message is written to it (unless the file is non-blocking).
+// on a shared channel only write() wakes up the process, so consumers of messages published from userspace should wait on the eventfd.
+// in queue mode the oldest message is read and consumed, in mailbox mode the last message is read and kept
+static ssize_t read_message_from_channel(struct kiocb* iocb, struct iov_iter* to, unsigned long* message_seq) {
+	ssize_t bytes_read;
+	size_t message_len;
+	struct file* file = iocb->ki_filp;
+	struct message_slot_file* message_slot_file = get_message_slot_file(file);
+	struct message_slot_node* message_slot_node = message_slot_file->message_slot_node;
 	struct message_channel_node* message_channel_node;
+	struct message* message;
 	unsigned int channel_id = get_channel_id_of_file(file);
 	if (channel_id == 0) { // no channel has been set on the file descriptor
 		return -EINVAL;
 	}
-	
-	minor_num = iminor(file_inode(file));
-	message_slot_node = find_message_slot_node_by_minor_num(minor_num);
-	message_channel_node = find_message_channel_node_by_channel_id(message_slot_node, channel_id);
-	if (message_channel_node == NULL || message_channel_node->message_len == 0) { // no message exists on the channel
-		return -EWOULDBLOCK;
+
+	mutex_lock(&message_slot_node->lock);
+	while (1) {
+		int rc;
+		// the channel is looked up again after sleeping, since it may have been deleted meanwhile
+		message_channel_node = get_or_create_message_channel_node(message_slot_node, channel_id);
+		if (message_channel_node == NULL) { // creation failed
+			mutex_unlock(&message_slot_node->lock);
+			return -ENOMEM;
+		}
+		if (!is_message_channel_empty(message_channel_node)) {
+			break;
+		}
+		// no message exists on the channel
+		if (is_nonblocking_iocb(iocb)) {
+			count_event(&message_channel_node->stats, WOULD_BLOCKS, 1);
+			mutex_unlock(&message_slot_node->lock);
+			return -EWOULDBLOCK;
+		}
+		get_message_channel_node(message_channel_node); // keeps the wait queue alive even if the channel is deleted while we sleep
+		mutex_unlock(&message_slot_node->lock);
+		rc = wait_event_interruptible(message_channel_node->wait_queue, !is_message_channel_empty(message_channel_node) || READ_ONCE(message_channel_node->is_deleted));
+		put_message_channel_node(message_channel_node);
+		if (rc) { // interrupted by a signal
+			return -ERESTARTSYS;
+		}
+		mutex_lock(&message_slot_node->lock);
+	}
+
+	// the channel may be deleted as soon as the lock is released, so it's only touched under the lock from here on
+	if (is_message_channel_shared(message_channel_node)) {
+		bytes_read = consume_shm_message(message_channel_node->shm, to);
+		if (bytes_read >= 0) {
+			count_event(&message_channel_node->stats, MESSAGES_READ, 1);
+			count_event(&message_channel_node->stats, BYTES_READ, bytes_read);
+		} else if (bytes_read == -EWOULDBLOCK) { // userspace consumed the message while we were waiting for the lock
+			count_event(&message_channel_node->stats, WOULD_BLOCKS, 1);
+		}
+		mutex_unlock(&message_slot_node->lock);
+		return bytes_read;
 	}
-	
-	if (length < message_channel_node->message_len) { // the provided buffer length is too small to hold the last message written on the channel
+
+	message = get_oldest_message(message_channel_node);
+	message_len = message->len;
+	if (iov_iter_count(to) < message_len) { // the provided buffers are too small to hold the message
+		mutex_unlock(&message_slot_node->lock);
 		return -ENOSPC;
 	}
 
-	bytes_read = put_message_in_user_buffer(message_channel_node, buffer, length);
-	if (bytes_read == -1) { // copy failed
+	bytes_read = copy_to_iter(message->data, message_len, to);
+	if (bytes_read == message_len) {
+		message_slot_file->last_read_seq = message_channel_node->message_seq;
+		*message_seq = message->seq;
+		message->was_read = 1;
+		count_event(&message_channel_node->stats, MESSAGES_READ, 1);
+		count_event(&message_channel_node->stats, BYTES_READ, bytes_read);
+		if (message_channel_node->is_queue_mode) {
+			drop_oldest_message(message_channel_node);
+			wake_up_interruptible(&message_channel_node->wait_queue); // wake up the writers blocked on a full queue
+		}
+	}
+	mutex_unlock(&message_slot_node->lock);
+	if (bytes_read != message_len) { // copy failed
 		return -EFAULT;
 	}
 	return bytes_read;
 }
 
 
-static ssize_t copy_user_buffer_to_message_channel(struct message_channel_node* message_channel_node, const char __user* buffer, size_t length) {
-	int i;
-	char* new_message = kmalloc(length, GFP_KERNEL);
-	for (i = 0; i < length; ++i) {
-		if (get_user(new_message[i], buffer + i) < 0) { // get_user failed
-			return -1; // previouse message isn't changed
+// a process which has already opened
+// the device file attempts to read from it (with read() or readv(), whose buffers are filled in order)
+static ssize_t device_read_iter(struct kiocb* iocb, struct iov_iter* to) {
+	unsigned long message_seq = 0;
+	ssize_t bytes_read = read_message_from_channel(iocb, to, &message_seq);
+	trace_message_slot_read(get_message_slot_file(iocb->ki_filp)->message_slot_node->minor_num, get_channel_id_of_file(iocb->ki_filp), bytes_read, message_seq);
+	return bytes_read;
+}
+
+
+static int deliver_message_to_channel(struct message_slot_node* message_slot_node, unsigned int channel_id, char* new_message, size_t length, int nonblocking, unsigned long* message_seq) {
+	int rc;
+	struct message_channel_node* message_channel_node;
+	mutex_lock(&message_slot_node->lock);
+	while (1) {
+		// the channel is looked up again after sleeping, since it may have been deleted meanwhile
+		message_channel_node = get_or_create_message_channel_node(message_slot_node, channel_id);
+		if (message_channel_node == NULL) { // creation failed
+			mutex_unlock(&message_slot_node->lock);
+			free_message_data(new_message, length);
+			return -ENOMEM;
+		}
+		if (length > message_channel_node->max_msg_len) {
+			mutex_unlock(&message_slot_node->lock);
+			free_message_data(new_message, length);
+			return -EMSGSIZE;
+		}
+		if (!is_message_channel_full(message_channel_node) || !does_message_channel_hold_writers(message_channel_node)) {
+			break;
+		}
+		if (message_channel_node->overflow_policy == MSG_SLOT_OVERFLOW_REJECT) {
+			mutex_unlock(&message_slot_node->lock);
+			free_message_data(new_message, length);
+			return -ENOBUFS;
+		}
+		if (nonblocking) {
+			count_event(&message_channel_node->stats, WOULD_BLOCKS, 1);
+			mutex_unlock(&message_slot_node->lock);
+			free_message_data(new_message, length);
+			return -EWOULDBLOCK;
+		}
+		get_message_channel_node(message_channel_node); // keeps the wait queue alive even if the channel is deleted while we sleep
+		mutex_unlock(&message_slot_node->lock);
+		// the channel may be switched to another mode while we sleep, so the condition is rechecked under the lock
+		rc = wait_event_interruptible(message_channel_node->wait_queue, !is_message_channel_full(message_channel_node) || !does_message_channel_hold_writers(message_channel_node) || READ_ONCE(message_channel_node->is_deleted));
+		put_message_channel_node(message_channel_node);
+		if (rc) {
+			free_message_data(new_message, length);
+			return -ERESTARTSYS;
 		}
+		mutex_lock(&message_slot_node->lock);
+	}
+
+	// the channel may be deleted as soon as the lock is released, so it's only touched under the lock from here on
+	if (is_message_channel_shared(message_channel_node)) {
+		rc = publish_shm_message(message_channel_node->shm, new_message, length);
+		if (rc != SUCCESS) {
+			mutex_unlock(&message_slot_node->lock);
+			free_message_data(new_message, length);
+			return rc;
+		}
+		free_message_data(new_message, length);
+	} else {
+		push_message(message_channel_node, new_message, length);
+		*message_seq = message_channel_node->message_seq;
+	}
+	count_event(&message_channel_node->stats, MESSAGES_WRITTEN, 1);
+	count_event(&message_channel_node->stats, BYTES_WRITTEN, length);
+	wake_up_interruptible(&message_channel_node->wait_queue); // wake up the blocked readers and the pollers of the channel
+	mutex_unlock(&message_slot_node->lock);
+	return SUCCESS;
+}
+
+
+// the longest message the channel takes right now, so that a message it would reject isn't allocated (and charged) and copied first.
+// the limit may still change before the message is delivered, which is why deliver_message_to_channel checks it again
+static unsigned int get_max_msg_len_of_channel(struct message_slot_node* message_slot_node, unsigned int channel_id) {
+	unsigned int channel_max_msg_len;
+	struct message_channel_node* message_channel_node;
+	mutex_lock(&message_slot_node->lock);
+	message_channel_node = find_message_channel_node_by_channel_id(message_slot_node, channel_id);
+	channel_max_msg_len = message_channel_node != NULL ? message_channel_node->max_msg_len : max_msg_len; // a new channel starts with the default
+	mutex_unlock(&message_slot_node->lock);
+	return channel_max_msg_len;
+}
+
+
+// deliver a message to a channel of the slot, taking ownership of the message buffer (which is freed on failure)
+static int write_message_to_channel(struct message_slot_node* message_slot_node, unsigned int channel_id, char* new_message, size_t length, int nonblocking) {
+	unsigned long message_seq = 0;
+	int rc = deliver_message_to_channel(message_slot_node, channel_id, new_message, length, nonblocking, &message_seq);
+	trace_message_slot_write(message_slot_node->minor_num, channel_id, rc == SUCCESS ? (long) length : rc, message_seq);
+	return rc;
+}
+
+
+// a processs which has already opened
+// the device file attempts to write to it (with write() or writev(), whose buffers are gathered into a single message)
+static ssize_t device_write_iter(struct kiocb* iocb, struct iov_iter* from) {
+	int rc;
+	char* new_message;
+	struct file* file = iocb->ki_filp;
+	size_t length = iov_iter_count(from);
+	unsigned int channel_id = get_channel_id_of_file(file);
+	if (channel_id == 0) { // no channel has been set on the file descriptor
+		return -EINVAL;
+	}
+
+	if (length == 0 || length > MAX_MSG_LEN_LIMIT || length > get_max_msg_len_of_channel(get_message_slot_file(file)->message_slot_node, channel_id)) {
+		return -EMSGSIZE;
+	}
+
+	// copy the message to a new kernel buffer before taking the slot's lock, so the lock isn't held during the copy
+	new_message = alloc_message_data(length);
+	if (new_message == NULL) {
+		count_event(&get_message_slot_file(file)->message_slot_node->stats, ALLOC_FAILURES, 1);
+		return -ENOMEM;
+	}
+	if (!copy_from_iter_full(new_message, length, from)) { // copying failed
+		free_message_data(new_message, length);
+		return -EFAULT; // previouse message isn't changed
+	}
+
+	rc = write_message_to_channel(get_message_slot_file(file)->message_slot_node, channel_id, new_message, length, is_nonblocking_iocb(iocb));
+	if (rc != SUCCESS) {
+		return rc;
 	}
-	kfree(message_channel_node->message);
-	message_channel_node->message = new_message;
-	message_channel_node->message_len = length;
 	return length;
 }
 
 
-static struct message_channel_node* create_message_channel_node(struct message_slot_node* message_slot_node, unsigned int channel_id) {
-	struct message_channel_node* new_message_channel_node = kmalloc(sizeof(struct message_channel_node), GFP_KERNEL);
-	if (new_message_channel_node == NULL) {
-		return NULL;
+// pollers sleep on the wait queue of the file descriptor rather than on the one of its channel, so the file only has to keep
+// the channel it was last polled on alive, until the channel id is changed or the file is released
+static int relay_channel_wake_up(struct wait_queue_entry* wait, unsigned int mode, int sync, void* key) {
+	struct message_slot_file* message_slot_file = container_of(wait, struct message_slot_file, poll_relay);
+	__wake_up(&message_slot_file->poll_wait_queue, mode, 1, key);
+	return 0;
+}
+
+
+// stop relaying the wake-ups of the polled channel, and return it so that the caller drops its reference after releasing the lock;
+// requires the slot's lock
+static struct message_channel_node* unwatch_polled_channel(struct message_slot_file* message_slot_file) {
+	struct message_channel_node* message_channel_node = message_slot_file->polled_channel;
+	if (message_channel_node != NULL) {
+		remove_wait_queue(&message_channel_node->wait_queue, &message_slot_file->poll_relay);
+		message_slot_file->polled_channel = NULL;
 	}
-	new_message_channel_node->channel_id = channel_id;
-	new_message_channel_node->message_len = 0;
-	new_message_channel_node->message = kmalloc(MAX_MSG_LEN, GFP_KERNEL);
-	if (new_message_channel_node->message == NULL) {
-		return NULL;
+	return message_channel_node;
+}
+
+
+// relay the wake-ups of the channel instead of the ones of the previously polled channel, which is returned as in unwatch_polled_channel;
+// requires the slot's lock, which also serializes the pollers of the file
+static struct message_channel_node* watch_polled_channel(struct message_slot_file* message_slot_file, struct message_channel_node* message_channel_node) {
+	struct message_channel_node* unpolled_channel = unwatch_polled_channel(message_slot_file);
+	get_message_channel_node(message_channel_node);
+	message_slot_file->polled_channel = message_channel_node;
+	add_wait_queue(&message_channel_node->wait_queue, &message_slot_file->poll_relay);
+	return unpolled_channel;
+}
+
+
+// the file descriptor is readable when its channel holds a message it hasn't read yet (in queue mode, any message),
+// and writable unless a write would have to wait for a reader.
+// a deleted channel is replaced by a new one with the same id on the next poll, which its wake-up triggers
+static __poll_t device_poll(struct file* file, poll_table* wait) {
+	__poll_t mask = 0;
+	struct message_slot_file* message_slot_file = get_message_slot_file(file);
+	struct message_slot_node* message_slot_node = message_slot_file->message_slot_node;
+	struct message_channel_node* message_channel_node;
+	struct message_channel_node* unpolled_channel = NULL;
+	unsigned int channel_id = get_channel_id_of_file(file);
+	if (channel_id == 0) { // no channel has been set on the file descriptor, so there is nothing to wait for
+		return EPOLLOUT | EPOLLWRNORM;
 	}
-	// insert the new node as the head of the list
-	new_message_channel_node->next = message_slot_node->head_message_channel_node;
-	message_slot_node->head_message_channel_node = new_message_channel_node;
-	return new_message_channel_node;
+
+	mutex_lock(&message_slot_node->lock);
+	message_channel_node = get_or_create_message_channel_node(message_slot_node, channel_id);
+	if (message_channel_node == NULL) { // creation failed
+		mutex_unlock(&message_slot_node->lock);
+		return EPOLLERR;
+	}
+
+	// epoll registers its pollers once and later polls without a poll table, so the relay also follows the channel for those already waiting
+	if (message_slot_file->polled_channel != message_channel_node && (!poll_does_not_wait(wait) || waitqueue_active(&message_slot_file->poll_wait_queue))) {
+		unpolled_channel = watch_polled_channel(message_slot_file, message_channel_node);
+	}
+	poll_wait(file, &message_slot_file->poll_wait_queue, wait);
+	if (!is_message_channel_empty(message_channel_node)) {
+		if (message_channel_node->is_queue_mode || is_message_channel_shared(message_channel_node) || message_channel_node->message_seq != message_slot_file->last_read_seq) {
+			mask |= EPOLLIN | EPOLLRDNORM;
+		}
+	}
+	if (!is_message_channel_full(message_channel_node) || (!is_message_channel_shared(message_channel_node) && !does_message_channel_hold_writers(message_channel_node))) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+	mutex_unlock(&message_slot_node->lock);
+	if (unpolled_channel != NULL) {
+		put_message_channel_node(unpolled_channel);
+	}
+	return mask;
 }
 
 
-// a processs which has already opened
-// the device file attempts to write to it
-static ssize_t device_write(struct file* file, const char __user* buffer, size_t length, loff_t* offset) {
-	unsigned int minor_num;
-	int bytes_written;
-	struct message_slot_node* message_slot_node;
+static long set_max_msg_len_of_fd(struct file* file, unsigned int new_max_msg_len) {
+	struct message_slot_node* message_slot_node = get_message_slot_file(file)->message_slot_node;
 	struct message_channel_node* message_channel_node;
 	unsigned int channel_id = get_channel_id_of_file(file);
 	if (channel_id == 0) { // no channel has been set on the file descriptor
 		return -EINVAL;
 	}
-	
-	if (length == 0 || length > MAX_MSG_LEN) {
-		return -EMSGSIZE;
+	if (new_max_msg_len == 0 || new_max_msg_len > MAX_MSG_LEN_LIMIT) {
+		return -EINVAL;
 	}
-	
-	minor_num = iminor(file_inode(file));
-	message_slot_node = find_message_slot_node_by_minor_num(minor_num);
+
+	mutex_lock(&message_slot_node->lock);
+	message_channel_node = get_or_create_message_channel_node(message_slot_node, channel_id);
+	if (message_channel_node == NULL) { // creation failed
+		mutex_unlock(&message_slot_node->lock);
+		return -ENOMEM;
+	}
+	message_channel_node->max_msg_len = new_max_msg_len; // messages which are already on the channel are kept even if they are longer
+	mutex_unlock(&message_slot_node->lock);
+	return SUCCESS;
+}
+
+
+static long set_queue_mode_of_fd(struct file* file, const struct msg_slot_queue_config __user* user_config) {
+	int rc;
+	struct msg_slot_queue_config config;
+	struct message_slot_node* message_slot_node = get_message_slot_file(file)->message_slot_node;
+	struct message_channel_node* message_channel_node;
+	unsigned int channel_id = get_channel_id_of_file(file);
+	if (channel_id == 0) { // no channel has been set on the file descriptor
+		return -EINVAL;
+	}
+	if (copy_from_user(&config, user_config, sizeof(config)) != 0) {
+		return -EFAULT;
+	}
+	if (config.depth > MAX_QUEUE_DEPTH || config.overflow_policy > MSG_SLOT_OVERFLOW_BLOCK) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&message_slot_node->lock);
+	message_channel_node = get_or_create_message_channel_node(message_slot_node, channel_id);
+	if (message_channel_node == NULL) { // creation failed
+		mutex_unlock(&message_slot_node->lock);
+		return -ENOMEM;
+	}
+	rc = set_message_channel_mode(message_channel_node, &config);
+	if (rc == SUCCESS) {
+		wake_up_interruptible(&message_channel_node->wait_queue); // blocked writers may have room now
+	}
+	mutex_unlock(&message_slot_node->lock);
+	return rc;
+}
+
+
+static struct message_channel_shm* create_message_channel_shm(struct msg_slot_shm_config* config) {
+	struct message_channel_shm* shm = kmalloc(sizeof(struct message_channel_shm), GFP_KERNEL);
+	if (shm == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+	shm->eventfd = NULL;
+	if (config->eventfd != -1) {
+		shm->eventfd = eventfd_ctx_fdget(config->eventfd);
+		if (IS_ERR(shm->eventfd)) {
+			long rc = PTR_ERR(shm->eventfd);
+			kfree(shm);
+			return ERR_PTR(rc);
+		}
+	}
+	shm->nr_entries = config->nr_entries;
+	shm->entry_size = config->entry_size;
+	shm->size = PAGE_ALIGN(MSG_SLOT_SHM_SIZE(config->nr_entries, config->entry_size));
+	if (!charge_memory(shm->size, 1)) {
+		shm->header = NULL;
+	} else {
+		shm->header = vmalloc_user(shm->size); // zeroed, and suitable for remap_vmalloc_range
+		if (shm->header == NULL) {
+			uncharge_memory(shm->size);
+		}
+	}
+	if (shm->header == NULL) {
+		if (shm->eventfd != NULL) {
+			eventfd_ctx_put(shm->eventfd);
+		}
+		kfree(shm);
+		return ERR_PTR(-ENOMEM);
+	}
+	shm->header->nr_entries = config->nr_entries;
+	shm->header->entry_size = config->entry_size;
+	kref_init(&shm->kref); // the reference of the channel
+	return shm;
+}
+
+
+// make the channel set on the file descriptor shared (or private again if nr_entries is 0).
+// the messages held by the channel until now are discarded
+static long setup_shm_of_fd(struct file* file, const struct msg_slot_shm_config __user* user_config) {
+	struct msg_slot_shm_config config;
+	struct message_channel_shm* new_shm = NULL;
+	struct message_channel_shm* old_shm;
+	struct message_slot_node* message_slot_node = get_message_slot_file(file)->message_slot_node;
+	struct message_channel_node* message_channel_node;
+	unsigned int channel_id = get_channel_id_of_file(file);
+	if (channel_id == 0) { // no channel has been set on the file descriptor
+		return -EINVAL;
+	}
+	if (copy_from_user(&config, user_config, sizeof(config)) != 0) {
+		return -EFAULT;
+	}
+	if (config.nr_entries != 0) {
+		if (!is_power_of_2(config.nr_entries) || config.nr_entries > MAX_QUEUE_DEPTH || config.entry_size == 0 || config.entry_size > MAX_MSG_LEN_LIMIT) {
+			return -EINVAL;
+		}
+		if (MSG_SLOT_SHM_SIZE(config.nr_entries, config.entry_size) > MAX_SHM_SIZE) {
+			return -EINVAL;
+		}
+		new_shm = create_message_channel_shm(&config);
+		if (IS_ERR(new_shm)) {
+			if (PTR_ERR(new_shm) == -ENOMEM) {
+				count_event(&message_slot_node->stats, ALLOC_FAILURES, 1);
+			}
+			return PTR_ERR(new_shm);
+		}
+	}
+
+	mutex_lock(&message_slot_node->lock);
+	message_channel_node = get_or_create_message_channel_node(message_slot_node, channel_id);
+	if (message_channel_node == NULL) { // creation failed
+		mutex_unlock(&message_slot_node->lock);
+		if (new_shm != NULL) {
+			put_message_channel_shm(new_shm);
+		}
+		return -ENOMEM;
+	}
+	clear_message_channel_node(message_channel_node);
+	old_shm = message_channel_node->shm;
+	rcu_assign_pointer(message_channel_node->shm, new_shm);
+	wake_up_interruptible(&message_channel_node->wait_queue); // blocked readers, writers and pollers reevaluate the channel
+	mutex_unlock(&message_slot_node->lock);
+
+	if (old_shm != NULL) {
+		put_message_channel_shm(old_shm); // existing mappings keep the old ring alive
+	}
+	return SUCCESS;
+}
+
+
+// the file descriptor keeps its channel id, so the next operation on it starts over with a new channel
+static long delete_channel_of_fd(struct file* file) {
+	struct message_slot_node* message_slot_node = get_message_slot_file(file)->message_slot_node;
+	struct message_channel_node* message_channel_node;
+	unsigned int channel_id = get_channel_id_of_file(file);
+	if (channel_id == 0) { // no channel has been set on the file descriptor
+		return -EINVAL;
+	}
+
+	mutex_lock(&message_slot_node->lock);
 	message_channel_node = find_message_channel_node_by_channel_id(message_slot_node, channel_id);
 	if (message_channel_node == NULL) {
-		message_channel_node = create_message_channel_node(message_slot_node, channel_id);
-		if (message_channel_node == NULL) { // creation failed
-			return -ENOMEM;
-		}
+		mutex_unlock(&message_slot_node->lock);
+		return -ENOENT;
 	}
-	
-	bytes_written = copy_user_buffer_to_message_channel(message_channel_node, buffer, length);
-	if (bytes_written == -1) { // copying failed
+	delete_message_channel_node(message_slot_node, message_channel_node);
+	mutex_unlock(&message_slot_node->lock);
+	put_message_channel_node(message_channel_node);
+	return SUCCESS;
+}
+
+
+// the messages of a shared ring are left to its consumer
+static long clear_channel_of_fd(struct file* file) {
+	struct message_slot_node* message_slot_node = get_message_slot_file(file)->message_slot_node;
+	struct message_channel_node* message_channel_node;
+	unsigned int channel_id = get_channel_id_of_file(file);
+	if (channel_id == 0) { // no channel has been set on the file descriptor
+		return -EINVAL;
+	}
+
+	mutex_lock(&message_slot_node->lock);
+	message_channel_node = find_message_channel_node_by_channel_id(message_slot_node, channel_id);
+	if (message_channel_node != NULL) {
+		clear_message_channel_node(message_channel_node);
+		wake_up_interruptible(&message_channel_node->wait_queue); // blocked writers have room now
+	}
+	mutex_unlock(&message_slot_node->lock);
+	return SUCCESS;
+}
+
+
+// deliver the messages of a batch in order, like write() to each entry's channel, and return the number of delivered messages.
+// the batch stops at the first failed message, whose error is returned only if no message has been delivered
+static long write_batch_of_fd(struct file* file, const struct msg_slot_batch __user* user_batch) {
+	unsigned int i;
+	long rc = SUCCESS;
+	char* new_message;
+	struct msg_slot_batch batch;
+	struct msg_slot_batch_entry* entries;
+	struct message_slot_node* message_slot_node = get_message_slot_file(file)->message_slot_node;
+	if (copy_from_user(&batch, user_batch, sizeof(batch)) != 0) {
 		return -EFAULT;
 	}
-	return bytes_written;
+	if (batch.count == 0 || batch.count > MAX_BATCH_LEN) {
+		return -EINVAL;
+	}
+	entries = kmalloc_array(batch.count, sizeof(struct msg_slot_batch_entry), GFP_KERNEL);
+	if (entries == NULL) {
+		count_event(&message_slot_node->stats, ALLOC_FAILURES, 1);
+		return -ENOMEM;
+	}
+	if (copy_from_user(entries, u64_to_user_ptr(batch.entries), batch.count * sizeof(struct msg_slot_batch_entry)) != 0) {
+		kfree(entries);
+		return -EFAULT;
+	}
+
+	for (i = 0; i < batch.count; ++i) {
+		if (entries[i].channel_id == 0) {
+			rc = -EINVAL;
+			break;
+		}
+		if (entries[i].length == 0 || entries[i].length > MAX_MSG_LEN_LIMIT || entries[i].length > get_max_msg_len_of_channel(message_slot_node, entries[i].channel_id)) {
+			rc = -EMSGSIZE;
+			break;
+		}
+		new_message = alloc_message_data(entries[i].length);
+		if (new_message == NULL) {
+			count_event(&message_slot_node->stats, ALLOC_FAILURES, 1);
+			rc = -ENOMEM;
+			break;
+		}
+		if (copy_from_user(new_message, u64_to_user_ptr(entries[i].buffer), entries[i].length) != 0) {
+			free_message_data(new_message, entries[i].length);
+			rc = -EFAULT;
+			break;
+		}
+		rc = write_message_to_channel(message_slot_node, entries[i].channel_id, new_message, entries[i].length, file->f_flags & O_NONBLOCK);
+		if (rc != SUCCESS) {
+			break;
+		}
+	}
+	kfree(entries);
+	return i > 0 ? i : rc;
 }
 
 
 static long device_ioctl(struct file* file, unsigned int ioctl_command_id, unsigned long ioctl_param) {
-	if (ioctl_command_id != MSG_SLOT_CHANNEL || ioctl_param == 0) {
+	switch (ioctl_command_id) {
+	case MSG_SLOT_CHANNEL:
+		if (ioctl_param == 0) {
+			return -EINVAL;
+		}
+		associate_channel_id_with_fd(file, (unsigned int) ioctl_param);
+		return SUCCESS;
+	case MSG_SLOT_QUEUE_MODE:
+		return set_queue_mode_of_fd(file, (const struct msg_slot_queue_config __user*) ioctl_param);
+	case MSG_SLOT_SET_MAX_MSG_LEN:
+		return set_max_msg_len_of_fd(file, (unsigned int) ioctl_param);
+	case MSG_SLOT_SHM_SETUP:
+		return setup_shm_of_fd(file, (const struct msg_slot_shm_config __user*) ioctl_param);
+	case MSG_SLOT_WRITE_BATCH:
+		return write_batch_of_fd(file, (const struct msg_slot_batch __user*) ioctl_param);
+	case MSG_SLOT_DELETE_CHANNEL:
+		return delete_channel_of_fd(file);
+	case MSG_SLOT_CLEAR_CHANNEL:
+		return clear_channel_of_fd(file);
+	case MSG_SLOT_GET_MEMORY_USAGE:
+		return put_user((unsigned long long) atomic64_read(&memory_usage), (unsigned long long __user*) ioctl_param);
+	default:
 		return -EINVAL;
 	}
-	associate_channel_id_with_fd(file, (unsigned int) ioctl_param);
-	
-	return SUCCESS;
+}
+
+
+#ifdef CONFIG_COMPAT
+// the parameter structs are laid out the same for 32-bit processes, so only the pointers passed as the ioctl parameter need converting
+static long device_compat_ioctl(struct file* file, unsigned int ioctl_command_id, unsigned long ioctl_param) {
+	switch (ioctl_command_id) {
+	case MSG_SLOT_CHANNEL:
+	case MSG_SLOT_SET_MAX_MSG_LEN:
+		return device_ioctl(file, ioctl_command_id, ioctl_param);
+	default:
+		return device_ioctl(file, ioctl_command_id, (unsigned long) compat_ptr(ioctl_param));
+	}
+}
+#endif
+
+
+static void message_slot_vma_open(struct vm_area_struct* vma) {
+	kref_get(&((struct message_channel_shm*) vma->vm_private_data)->kref);
+}
+
+
+static void message_slot_vma_close(struct vm_area_struct* vma) {
+	put_message_channel_shm((struct message_channel_shm*) vma->vm_private_data);
+}
+
+
+static const struct vm_operations_struct message_slot_vm_ops = {
+	.open  = message_slot_vma_open,
+	.close = message_slot_vma_close,
+};
+
+
+// map the shared ring of the channel set on the file descriptor
+static int device_mmap(struct file* file, struct vm_area_struct* vma) {
+	int rc;
+	struct message_channel_shm* shm;
+	struct message_slot_node* message_slot_node = get_message_slot_file(file)->message_slot_node;
+	struct message_channel_node* message_channel_node;
+	unsigned int channel_id = get_channel_id_of_file(file);
+	if (channel_id == 0) { // no channel has been set on the file descriptor
+		return -EINVAL;
+	}
+
+	mutex_lock(&message_slot_node->lock);
+	message_channel_node = find_message_channel_node_by_channel_id(message_slot_node, channel_id);
+	if (message_channel_node == NULL || message_channel_node->shm == NULL) { // the channel isn't shared
+		mutex_unlock(&message_slot_node->lock);
+		return -EINVAL;
+	}
+	shm = message_channel_node->shm;
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > shm->size) {
+		mutex_unlock(&message_slot_node->lock);
+		return -EINVAL;
+	}
+	rc = remap_vmalloc_range(vma, shm->header, 0);
+	if (rc == SUCCESS) {
+		vma->vm_ops = &message_slot_vm_ops;
+		vma->vm_private_data = shm;
+		kref_get(&shm->kref); // the reference of the mapping, dropped by message_slot_vma_close
+	}
+	mutex_unlock(&message_slot_node->lock);
+	return rc;
 }
 
 
 struct file_operations fops =
 {
-  .owner	  	  = THIS_MODULE, 
-  .read           = device_read,
-  .write          = device_write,
+  .owner	  	  = THIS_MODULE,
+  .read_iter      = device_read_iter,
+  .write_iter     = device_write_iter,
+  .poll           = device_poll,
+  .mmap           = device_mmap,
   .open           = device_open,
+  .release        = device_release,
   .unlocked_ioctl = device_ioctl,
+#ifdef CONFIG_COMPAT
+  .compat_ioctl   = device_compat_ioctl,
+#endif
 };
 
+static void show_message_slot_counters(struct seq_file* m, long long* counters) {
+	int i;
+	for (i = 0; i < N_MESSAGE_SLOT_COUNTERS; ++i) {
+		seq_printf(m, " %s=%lld", message_slot_counter_names[i], counters[i]);
+	}
+	seq_putc(m, '\n');
+}
+
+
+// the contents of <debugfs>/message_slot/stats: the memory held by the slots, then a line with the totals of every slot, followed by a line for each of its channels
+static int message_slot_stats_show(struct seq_file* m, void* unused) {
+	int i;
+	long long slot_counters[N_MESSAGE_SLOT_COUNTERS];
+	long long channel_counters[N_MESSAGE_SLOT_COUNTERS];
+	struct message_slot_node* message_slot_node;
+	struct message_channel_node* message_channel_node;
+
+	seq_printf(m, "memory_usage=%lld max_total_bytes=%llu\n", atomic64_read(&memory_usage), max_total_bytes);
+	mutex_lock(&message_slot_list_lock);
+	for (message_slot_node = message_slot_list->head; message_slot_node != NULL; message_slot_node = message_slot_node->next) {
+		mutex_lock(&message_slot_node->lock);
+		for (i = 0; i < N_MESSAGE_SLOT_COUNTERS; ++i) {
+			slot_counters[i] = atomic64_read(&message_slot_node->stats.counters[i]);
+		}
+		for (message_channel_node = message_slot_node->head_message_channel_node; message_channel_node != NULL; message_channel_node = message_channel_node->next) {
+			for (i = 0; i < N_MESSAGE_SLOT_COUNTERS; ++i) {
+				slot_counters[i] += atomic64_read(&message_channel_node->stats.counters[i]);
+			}
+		}
+		seq_printf(m, "slot %u:", message_slot_node->minor_num);
+		show_message_slot_counters(m, slot_counters);
+
+		for (message_channel_node = message_slot_node->head_message_channel_node; message_channel_node != NULL; message_channel_node = message_channel_node->next) {
+			for (i = 0; i < N_MESSAGE_SLOT_COUNTERS; ++i) {
+				channel_counters[i] = atomic64_read(&message_channel_node->stats.counters[i]);
+			}
+			seq_printf(m, "\tchannel %u:", message_channel_node->channel_id);
+			show_message_slot_counters(m, channel_counters);
+		}
+		mutex_unlock(&message_slot_node->lock);
+	}
+	mutex_unlock(&message_slot_list_lock);
+	return SUCCESS;
+}
+DEFINE_SHOW_ATTRIBUTE(message_slot_stats);
+
+static struct dentry* message_slot_debugfs_dir;
+
+
+// idle channels are looked for twice per idle_channel_timeout, so a channel is deleted at most 1.5 timeouts after its last access
+static unsigned long get_expiry_period(void) {
+	return (unsigned long) max(idle_channel_timeout / 2, 1U) * HZ;
+}
+
+
+static void expire_idle_channels(struct work_struct* work) {
+	struct message_slot_node* next_message_slot_node;
+	struct message_slot_node* message_slot_node;
+
+	mutex_lock(&message_slot_list_lock);
+	for (message_slot_node = message_slot_list->head; message_slot_node != NULL; message_slot_node = next_message_slot_node) {
+		next_message_slot_node = message_slot_node->next;
+		mutex_lock(&message_slot_node->lock);
+		reap_message_channel_nodes(message_slot_node, is_message_channel_idle);
+		mutex_unlock(&message_slot_node->lock);
+		reclaim_message_slot_node_if_unused(message_slot_node);
+	}
+	mutex_unlock(&message_slot_list_lock);
+	schedule_delayed_work(&expire_work, get_expiry_period());
+}
+
+
 static int initialize_message_slot_list(void) {
 	message_slot_list = kmalloc(sizeof(struct message_slot_list), GFP_KERNEL);
 	if (message_slot_list == NULL) {
@@ -236,15 +1127,14 @@ static void clear_message_slot_list(void) {
 	struct message_slot_node* message_slot_node = message_slot_list->head;
 	while (message_slot_node != NULL) {
 		struct message_channel_node* message_channel_node = message_slot_node->head_message_channel_node;
-		while (message_channel_node != NULL) {
-			kfree(message_channel_node->message);
-
+		while (message_channel_node != NULL) { // no file descriptor is open, so the list holds the only reference
 			next_message_channel_node = message_channel_node->next;
-			kfree(message_channel_node);
+			put_message_channel_node(message_channel_node);
 			message_channel_node = next_message_channel_node;
 		}
 
 		next_message_slot_node = message_slot_node->next;
+		mutex_destroy(&message_slot_node->lock);
 		kfree(message_slot_node);
 		message_slot_node = next_message_slot_node;
 	}
@@ -255,19 +1145,34 @@ static void clear_message_slot_list(void) {
 
 // Initialize the module - Register the character device
 int __init init_module(void) {
-	int rc = register_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME, &fops);
+	int rc;
+	if (max_msg_len == 0 || max_msg_len > MAX_MSG_LEN_LIMIT) {
+		printk(KERN_ERR "%s: max_msg_len must be between 1 and %d\n", DEVICE_RANGE_NAME, MAX_MSG_LEN_LIMIT);
+		return -EINVAL;
+	}
+	rc = register_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME, &fops);
 	if (rc < 0) { //module initialization failed
 		printk(KERN_ERR "%s registration failed for %d\n", DEVICE_RANGE_NAME, MAJOR_NUM);
 		return rc;
 	}
 	if (initialize_message_slot_list() == -1) {
+		unregister_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME);
 		return -ENOMEM;
 	}
+	// the statistics are a debugging aid, so the module works without them if debugfs is unavailable
+	message_slot_debugfs_dir = debugfs_create_dir(DEVICE_RANGE_NAME, NULL);
+	debugfs_create_file("stats", 0444, message_slot_debugfs_dir, NULL, &message_slot_stats_fops);
+	if (idle_channel_timeout != 0) {
+		schedule_delayed_work(&expire_work, get_expiry_period());
+	}
 	return 0;
 }
 
 
 void __exit cleanup_module(void) {
+	debugfs_remove_recursive(message_slot_debugfs_dir);
+	cancel_delayed_work_sync(&expire_work);
 	clear_message_slot_list();
+	rcu_barrier(); // the rings released above are freed by RCU callbacks, which must run before the module goes away
 	unregister_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME);
 }
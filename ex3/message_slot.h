@@ -6,7 +6,71 @@
 #define MAJOR_NUM 235
 #define DEVICE_RANGE_NAME "message_slot"
 #define MSG_SLOT_CHANNEL _IOW(MAJOR_NUM, 0, unsigned int)
-#define MAX_MSG_LEN 128
+#define MSG_SLOT_QUEUE_MODE _IOW(MAJOR_NUM, 1, struct msg_slot_queue_config)
+#define MSG_SLOT_SHM_SETUP _IOW(MAJOR_NUM, 2, struct msg_slot_shm_config)
+#define MSG_SLOT_WRITE_BATCH _IOW(MAJOR_NUM, 3, struct msg_slot_batch)
+#define MSG_SLOT_SET_MAX_MSG_LEN _IOW(MAJOR_NUM, 4, unsigned int)
+#define MSG_SLOT_DELETE_CHANNEL _IO(MAJOR_NUM, 5) // remove the channel set on the file descriptor with its messages and configuration
+#define MSG_SLOT_CLEAR_CHANNEL _IO(MAJOR_NUM, 6) // discard the messages of the channel set on the file descriptor
+#define MSG_SLOT_GET_MEMORY_USAGE _IOR(MAJOR_NUM, 7, unsigned long long) // the bytes held by all the slots, capped by the max_total_bytes module parameter
+#define MAX_MSG_LEN 128 // the default maximal message length of a channel (see MSG_SLOT_SET_MAX_MSG_LEN and the max_msg_len module parameter)
+#define MAX_MSG_LEN_LIMIT (4 << 20)
+#define MAX_QUEUE_DEPTH 4096
+#define MAX_BATCH_LEN 1024
+#define MAX_SHM_SIZE (64 << 20)
 #define SUCCESS 0
+#define MSG_SLOT_SHM_CACHE_LINE 64
 
-#endif
\ No newline at end of file
+// what a write does when the queue of the channel is full
+#define MSG_SLOT_OVERFLOW_DROP_OLDEST 0 // the oldest unread message is discarded
+#define MSG_SLOT_OVERFLOW_REJECT 1 // the write fails with ENOBUFS
+#define MSG_SLOT_OVERFLOW_BLOCK 2 // the write sleeps until a reader makes room (or fails with EWOULDBLOCK if non-blocking)
+
+// the parameter of MSG_SLOT_QUEUE_MODE, applied to the channel currently set on the file descriptor.
+// a depth of 0 switches the channel back to mailbox mode, in which it holds only the last message and reads don't consume it
+struct msg_slot_queue_config {
+	unsigned int depth;
+	unsigned int overflow_policy;
+};
+
+// the parameter of MSG_SLOT_SHM_SETUP, applied to the channel currently set on the file descriptor.
+// the channel's messages then live in a ring shared with userspace by mmap(), and an nr_entries of 0 makes the channel private again
+struct msg_slot_shm_config {
+	unsigned int nr_entries; // a power of 2, at most MAX_QUEUE_DEPTH
+	unsigned int entry_size; // the maximal length of a message in the ring, at most MAX_MSG_LEN_LIMIT, while the whole ring is at most MAX_SHM_SIZE bytes
+	int eventfd; // signalled whenever write() publishes a message to the ring, or -1
+};
+
+// a message of MSG_SLOT_WRITE_BATCH
+struct msg_slot_batch_entry {
+	unsigned int channel_id;
+	unsigned int length;
+	unsigned long long buffer; // a pointer to the message, as a 64-bit integer so the layout is the same for 32-bit processes
+};
+
+// the parameter of MSG_SLOT_WRITE_BATCH, which delivers up to MAX_BATCH_LEN messages to channels of the slot with a single syscall
+struct msg_slot_batch {
+	unsigned int count;
+	unsigned long long entries __attribute__((aligned(8))); // a pointer to an array of count struct msg_slot_batch_entry, aligned as in 64-bit processes
+};
+
+// the start of a shared ring, followed by nr_entries entries of MSG_SLOT_SHM_ENTRY_STRIDE(entry_size) bytes each.
+// the ring has a single producer and a single consumer: head is advanced only by the consumer and tail only by the producer,
+// and write()/read() on the channel act as a producer/consumer serialized with each other by the module
+struct msg_slot_shm_header {
+	unsigned int nr_entries;
+	unsigned int entry_size;
+	unsigned int head __attribute__((aligned(MSG_SLOT_SHM_CACHE_LINE))); // the index of the next entry to consume
+	unsigned int consumer_waiting; // set by a consumer which is about to sleep on the eventfd, so the producer knows to signal it
+	unsigned int tail __attribute__((aligned(MSG_SLOT_SHM_CACHE_LINE))); // the index of the next entry to publish
+} __attribute__((aligned(MSG_SLOT_SHM_CACHE_LINE)));
+
+struct msg_slot_shm_entry {
+	unsigned int len;
+	char data[];
+};
+
+#define MSG_SLOT_SHM_ENTRY_STRIDE(entry_size) ((sizeof(struct msg_slot_shm_entry) + (entry_size) + 7) & ~7UL)
+#define MSG_SLOT_SHM_SIZE(nr_entries, entry_size) (sizeof(struct msg_slot_shm_header) + (unsigned long) (nr_entries) * MSG_SLOT_SHM_ENTRY_STRIDE(entry_size))
+
+#endif
@@ -0,0 +1,392 @@
+/* a throughput and latency benchmark of message slots, in the spirit of message_sender and message_reader.
+producer threads write timestamped messages to queue-mode channels and consumer threads read them,
+for every combination of the given channel counts, message sizes and producer/consumer thread counts.
+by default it runs against the userspace channel store (message_slot_user.c), so no module has to be loaded;
+with -d it runs against a message slot device file instead.
+
+build: gcc -O2 -pthread message_slot_bench.c message_slot_user.c -o message_slot_bench */
+
+#include "message_slot.h"
+#include "message_slot_user.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+
+#define MAX_LIST_LEN 16
+#define DEFAULT_MESSAGES_PER_CHANNEL 10000
+#define DEFAULT_QUEUE_DEPTH 64
+
+
+struct int_list {
+	int values[MAX_LIST_LEN];
+	int len;
+};
+
+// a channel opened through either backend
+struct bench_fd {
+	int fd;
+	struct msg_slot_user_file* user_file;
+};
+
+struct bench_config {
+	int n_channels;
+	int message_size;
+	int n_producers;
+	int n_consumers;
+	unsigned int first_channel_id; // every run uses fresh channels
+};
+
+struct thread_arg {
+	struct bench_config* config;
+	int index;
+	uint64_t* latencies; // filled by consumers, in nanoseconds
+	int n_latencies;
+};
+
+char* device_path = NULL; // NULL means the userspace channel store
+unsigned int user_minor_num = 0;
+int messages_per_channel = DEFAULT_MESSAGES_PER_CHANNEL;
+int queue_depth = DEFAULT_QUEUE_DEPTH;
+pthread_barrier_t start_barrier;
+
+
+void print_error_message(const char* s) {
+	perror(s);
+}
+
+
+void print_error_message_and_exit(const char* s) {
+	print_error_message(s);
+	exit(1);
+}
+
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+struct bench_fd bench_open(unsigned int channel_id, int flags) {
+	struct bench_fd bench_fd = { .fd = -1, .user_file = NULL };
+	if (device_path != NULL) {
+		bench_fd.fd = open(device_path, O_RDWR | flags);
+		if (bench_fd.fd == -1) {
+			print_error_message_and_exit("Failed to open the file");
+		}
+		if (ioctl(bench_fd.fd, MSG_SLOT_CHANNEL, channel_id) == -1) {
+			print_error_message_and_exit("Failed to open the message channel");
+		}
+	} else {
+		bench_fd.user_file = msg_slot_user_open(user_minor_num, flags);
+		if (bench_fd.user_file == NULL) {
+			print_error_message_and_exit("Failed to open the userspace slot");
+		}
+		if (msg_slot_user_ioctl(bench_fd.user_file, MSG_SLOT_CHANNEL, channel_id) == -1) {
+			print_error_message_and_exit("Failed to open the message channel");
+		}
+	}
+	return bench_fd;
+}
+
+
+int bench_ioctl(struct bench_fd* bench_fd, unsigned int ioctl_command_id, unsigned long ioctl_param) {
+	if (bench_fd->user_file != NULL) {
+		return msg_slot_user_ioctl(bench_fd->user_file, ioctl_command_id, ioctl_param);
+	}
+	return ioctl(bench_fd->fd, ioctl_command_id, ioctl_param);
+}
+
+
+ssize_t bench_read(struct bench_fd* bench_fd, char* buf, size_t len) {
+	if (bench_fd->user_file != NULL) {
+		return msg_slot_user_read(bench_fd->user_file, buf, len);
+	}
+	return read(bench_fd->fd, buf, len);
+}
+
+
+ssize_t bench_write(struct bench_fd* bench_fd, const char* buf, size_t len) {
+	if (bench_fd->user_file != NULL) {
+		return msg_slot_user_write(bench_fd->user_file, buf, len);
+	}
+	return write(bench_fd->fd, buf, len);
+}
+
+
+void bench_close(struct bench_fd* bench_fd) {
+	if (bench_fd->user_file != NULL) {
+		msg_slot_user_close(bench_fd->user_file);
+	} else if (close(bench_fd->fd) == -1) {
+		print_error_message_and_exit("Failed to close the file");
+	}
+}
+
+
+// the channels of a thread are index, index + n_threads, ...
+int count_owned_channels(int n_channels, int n_threads, int index) {
+	return (n_channels - index + n_threads - 1) / n_threads;
+}
+
+
+// producer threads write every message with a blocking write, so a full queue holds them back instead of dropping messages
+void* producer_func(void* thread_param) {
+	struct thread_arg* arg = thread_param;
+	struct bench_config* config = arg->config;
+	int n_owned = count_owned_channels(config->n_channels, config->n_producers, arg->index);
+	struct bench_fd* fds = calloc(n_owned, sizeof(struct bench_fd));
+	char* message = calloc(config->message_size, sizeof(char));
+	if (fds == NULL || message == NULL) {
+		print_error_message_and_exit("Failed to allocate the producer's buffers");
+	}
+	for (int i = 0; i < n_owned; i++) {
+		fds[i] = bench_open(config->first_channel_id + arg->index + i * config->n_producers, 0);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	for (int m = 0; m < messages_per_channel; m++) {
+		for (int i = 0; i < n_owned; i++) {
+			uint64_t sent_ns = now_ns(); // the first bytes of the message carry the time it was sent
+			memcpy(message, &sent_ns, sizeof(sent_ns));
+			if (bench_write(&fds[i], message, config->message_size) != config->message_size) {
+				print_error_message_and_exit("Failed to write the message");
+			}
+		}
+	}
+
+	for (int i = 0; i < n_owned; i++) {
+		bench_close(&fds[i]);
+	}
+	free(message);
+	free(fds);
+	return NULL;
+}
+
+
+// consumer threads poll their channels with non-blocking reads, so one empty channel doesn't hold back the others
+void* consumer_func(void* thread_param) {
+	struct thread_arg* arg = thread_param;
+	struct bench_config* config = arg->config;
+	int n_owned = count_owned_channels(config->n_channels, config->n_consumers, arg->index);
+	struct bench_fd* fds = calloc(n_owned, sizeof(struct bench_fd));
+	int* remaining = calloc(n_owned, sizeof(int));
+	char* message = calloc(config->message_size, sizeof(char));
+	arg->latencies = calloc((size_t) n_owned * messages_per_channel, sizeof(uint64_t));
+	arg->n_latencies = 0;
+	if (fds == NULL || remaining == NULL || message == NULL || arg->latencies == NULL) {
+		print_error_message_and_exit("Failed to allocate the consumer's buffers");
+	}
+	for (int i = 0; i < n_owned; i++) {
+		fds[i] = bench_open(config->first_channel_id + arg->index + i * config->n_consumers, O_NONBLOCK);
+		remaining[i] = messages_per_channel;
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	int total_remaining = n_owned * messages_per_channel;
+	while (total_remaining > 0) {
+		int n_read = 0;
+		for (int i = 0; i < n_owned; i++) {
+			if (remaining[i] == 0) {
+				continue;
+			}
+			ssize_t bytes_read = bench_read(&fds[i], message, config->message_size);
+			if (bytes_read == -1) {
+				if (errno == EWOULDBLOCK) {
+					continue;
+				}
+				print_error_message_and_exit("Failed to read the message");
+			}
+			uint64_t sent_ns;
+			memcpy(&sent_ns, message, sizeof(sent_ns));
+			arg->latencies[arg->n_latencies++] = now_ns() - sent_ns;
+			remaining[i] -= 1;
+			total_remaining -= 1;
+			n_read += 1;
+		}
+		if (n_read == 0) { // all of our channels are empty, let the producers run
+			sched_yield();
+		}
+	}
+
+	for (int i = 0; i < n_owned; i++) {
+		bench_close(&fds[i]);
+	}
+	free(message);
+	free(remaining);
+	free(fds);
+	return NULL;
+}
+
+
+// put the channels in queue mode, sized for the messages of the run
+void setup_channels(struct bench_config* config) {
+	struct msg_slot_queue_config queue_config = {
+		.depth = queue_depth,
+		.overflow_policy = MSG_SLOT_OVERFLOW_BLOCK,
+	};
+	for (int i = 0; i < config->n_channels; i++) {
+		struct bench_fd bench_fd = bench_open(config->first_channel_id + i, 0);
+		if (bench_ioctl(&bench_fd, MSG_SLOT_SET_MAX_MSG_LEN, config->message_size) == -1) {
+			print_error_message_and_exit("Failed to set the maximal message length");
+		}
+		if (bench_ioctl(&bench_fd, MSG_SLOT_QUEUE_MODE, (unsigned long) &queue_config) == -1) {
+			print_error_message_and_exit("Failed to set the queue mode");
+		}
+		bench_close(&bench_fd);
+	}
+}
+
+
+int compare_uint64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+
+void run_benchmark(struct bench_config* config) {
+	int n_threads = config->n_producers + config->n_consumers;
+	pthread_t* threads = calloc(n_threads, sizeof(pthread_t));
+	struct thread_arg* args = calloc(n_threads, sizeof(struct thread_arg));
+	if (threads == NULL || args == NULL) {
+		print_error_message_and_exit("Failed to allocate the threads");
+	}
+	user_minor_num += 1; // a fresh userspace slot, so the channels of earlier runs don't lengthen its channel list
+	setup_channels(config);
+	pthread_barrier_init(&start_barrier, NULL, n_threads + 1);
+
+	for (int i = 0; i < n_threads; i++) {
+		args[i].config = config;
+		args[i].index = i < config->n_producers ? i : i - config->n_producers;
+		if (pthread_create(&threads[i], NULL, i < config->n_producers ? producer_func : consumer_func, &args[i]) != 0) {
+			print_error_message_and_exit("There has been an error while creating a thread");
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	uint64_t start_ns = now_ns();
+	for (int i = 0; i < n_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	uint64_t elapsed_ns = now_ns() - start_ns;
+	pthread_barrier_destroy(&start_barrier);
+
+	// merge the latencies of all the consumers
+	size_t n_messages = (size_t) config->n_channels * messages_per_channel;
+	uint64_t* latencies = calloc(n_messages, sizeof(uint64_t));
+	if (latencies == NULL) {
+		print_error_message_and_exit("Failed to allocate the latencies");
+	}
+	size_t n_latencies = 0;
+	for (int i = config->n_producers; i < n_threads; i++) {
+		memcpy(latencies + n_latencies, args[i].latencies, args[i].n_latencies * sizeof(uint64_t));
+		n_latencies += args[i].n_latencies;
+		free(args[i].latencies);
+	}
+	qsort(latencies, n_latencies, sizeof(uint64_t), compare_uint64);
+
+	printf("%8d %8d %9d %9d %14.0f %10.2f %10.2f\n", config->n_channels, config->message_size, config->n_producers, config->n_consumers,
+		n_messages / (elapsed_ns / 1e9), latencies[n_latencies / 2] / 1e3, latencies[n_latencies * 99 / 100] / 1e3);
+
+	free(latencies);
+	free(args);
+	free(threads);
+}
+
+
+void parse_int_list(char* s, struct int_list* list) {
+	list->len = 0;
+	for (char* token = strtok(s, ","); token != NULL; token = strtok(NULL, ",")) {
+		if (list->len == MAX_LIST_LEN) {
+			fprintf(stderr, "At most %d values can be given to an option\n", MAX_LIST_LEN);
+			exit(1);
+		}
+		list->values[list->len] = atoi(token);
+		if (list->values[list->len] <= 0) {
+			fprintf(stderr, "Invalid value '%s'\n", token);
+			exit(1);
+		}
+		list->len += 1;
+	}
+}
+
+
+void print_usage_and_exit(char* program) {
+	fprintf(stderr, "usage: %s [-d device_file] [-c channels,...] [-s message_sizes,...] [-p producers,...] [-r consumers,...] [-n messages_per_channel] [-q queue_depth]\n", program);
+	exit(1);
+}
+
+
+int main(int argc, char* argv[]) {
+	struct int_list channel_counts = { .values = { 1, 16, 256 }, .len = 3 };
+	struct int_list message_sizes = { .values = { 16, 128, 4096 }, .len = 3 };
+	struct int_list producer_counts = { .values = { 1, 4 }, .len = 2 };
+	struct int_list consumer_counts = { .values = { 1, 4 }, .len = 2 };
+	int opt;
+	while ((opt = getopt(argc, argv, "d:c:s:p:r:n:q:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device_path = optarg;
+			break;
+		case 'c':
+			parse_int_list(optarg, &channel_counts);
+			break;
+		case 's':
+			parse_int_list(optarg, &message_sizes);
+			break;
+		case 'p':
+			parse_int_list(optarg, &producer_counts);
+			break;
+		case 'r':
+			parse_int_list(optarg, &consumer_counts);
+			break;
+		case 'n':
+			messages_per_channel = atoi(optarg);
+			break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			break;
+		default:
+			print_usage_and_exit(argv[0]);
+		}
+	}
+	if (optind != argc || messages_per_channel <= 0 || queue_depth <= 0 || queue_depth > MAX_QUEUE_DEPTH) {
+		print_usage_and_exit(argv[0]);
+	}
+
+	printf("%8s %8s %9s %9s %14s %10s %10s\n", "channels", "size", "producers", "consumers", "msgs/sec", "p50_us", "p99_us");
+	unsigned int first_channel_id = 1;
+	for (int c = 0; c < channel_counts.len; c++) {
+		for (int s = 0; s < message_sizes.len; s++) {
+			for (int p = 0; p < producer_counts.len; p++) {
+				for (int r = 0; r < consumer_counts.len; r++) {
+					struct bench_config config = {
+						.n_channels = channel_counts.values[c],
+						.message_size = message_sizes.values[s],
+						.n_producers = producer_counts.values[p],
+						.n_consumers = consumer_counts.values[r],
+						.first_channel_id = first_channel_id,
+					};
+					// every thread needs a channel of its own, and every message has to carry its timestamp
+					if (config.n_producers > config.n_channels || config.n_consumers > config.n_channels || config.message_size < (int) sizeof(uint64_t)) {
+						continue;
+					}
+					run_benchmark(&config);
+					first_channel_id += config.n_channels;
+				}
+			}
+		}
+	}
+
+	exit(0); // success
+}
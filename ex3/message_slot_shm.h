@@ -0,0 +1,101 @@
+#ifndef MESSAGE_SLOT_SHM_H
+#define MESSAGE_SLOT_SHM_H
+
+#include "message_slot.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* userspace side of a shared channel (see MSG_SLOT_SHM_SETUP).
+a process maps the ring of the channel set on its file descriptor and then exchanges messages with no syscalls,
+unless the consumer has gone to sleep on the eventfd and needs to be woken up */
+
+
+static inline struct msg_slot_shm_header* msg_slot_shm_map(int fd, unsigned int nr_entries, unsigned int entry_size) {
+	void* area = mmap(NULL, MSG_SLOT_SHM_SIZE(nr_entries, entry_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (area == MAP_FAILED) {
+		return NULL;
+	}
+	return (struct msg_slot_shm_header*) area;
+}
+
+
+static inline int msg_slot_shm_unmap(struct msg_slot_shm_header* header) {
+	return munmap(header, MSG_SLOT_SHM_SIZE(header->nr_entries, header->entry_size));
+}
+
+
+static inline struct msg_slot_shm_entry* msg_slot_shm_get_entry(struct msg_slot_shm_header* header, unsigned int index) {
+	char* entries = (char*) (header + 1);
+	return (struct msg_slot_shm_entry*) (entries + (index & (header->nr_entries - 1)) * MSG_SLOT_SHM_ENTRY_STRIDE(header->entry_size));
+}
+
+
+// publish a message to the ring; fails with EWOULDBLOCK if the ring is full and with EMSGSIZE if the message doesn't fit in an entry
+static inline int msg_slot_shm_produce(struct msg_slot_shm_header* header, const char* message, unsigned int len, int eventfd) {
+	unsigned int tail = header->tail; // only the producer changes the tail
+	if (len == 0 || len > header->entry_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (tail - __atomic_load_n(&header->head, __ATOMIC_ACQUIRE) >= header->nr_entries) {
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+	struct msg_slot_shm_entry* entry = msg_slot_shm_get_entry(header, tail);
+	memcpy(entry->data, message, len);
+	entry->len = len;
+	/* the new tail must be visible before we look at consumer_waiting, otherwise a consumer which has just
+	gone to sleep could miss both the message and the wakeup */
+	__atomic_store_n(&header->tail, tail + 1, __ATOMIC_SEQ_CST);
+	if (eventfd != -1 && __atomic_exchange_n(&header->consumer_waiting, 0, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if (write(eventfd, &one, sizeof(one)) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+// consume the oldest message of the ring; fails with EWOULDBLOCK if the ring is empty and with ENOSPC if the buffer is too small
+static inline ssize_t msg_slot_shm_consume(struct msg_slot_shm_header* header, char* buffer, size_t length) {
+	unsigned int head = header->head; // only the consumer changes the head
+	if (head == __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE)) {
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+	struct msg_slot_shm_entry* entry = msg_slot_shm_get_entry(header, head);
+	unsigned int len = entry->len;
+	if (length < len) {
+		errno = ENOSPC;
+		return -1;
+	}
+	memcpy(buffer, entry->data, len);
+	__atomic_store_n(&header->head, head + 1, __ATOMIC_RELEASE);
+	return len;
+}
+
+
+// like msg_slot_shm_consume, but sleeps on the eventfd while the ring is empty
+static inline ssize_t msg_slot_shm_consume_wait(struct msg_slot_shm_header* header, char* buffer, size_t length, int eventfd) {
+	uint64_t counter;
+	while (1) {
+		ssize_t len = msg_slot_shm_consume(header, buffer, length);
+		if (len != -1 || errno != EWOULDBLOCK) {
+			return len;
+		}
+		__atomic_store_n(&header->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+		if (header->head != __atomic_load_n(&header->tail, __ATOMIC_SEQ_CST)) { // a message was published before the producer could see the flag
+			continue;
+		}
+		if (read(eventfd, &counter, sizeof(counter)) == -1 && errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,373 @@
+#ifndef MESSAGE_SLOT_STORE_H
+#define MESSAGE_SLOT_STORE_H
+
+/* the channel store of message slots: the channels of a slot and the rings of messages they hold.
+it is shared by the kernel module (message_slot.c) and by the userspace library (message_slot_user.c), which lets the store
+be profiled and benchmarked without loading the module. both include it into their single translation unit, so everything here is static inline.
+the store only keeps the data; blocking, waking up and copying from/to the caller are up to the including code, under the slot's lock */
+
+#include "message_slot.h"
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/kref.h>
+#include <linux/jiffies.h>
+
+#define message_slot_clock() jiffies
+#else
+#include <stddef.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+// the few kernel facilities the store relies on, implemented on top of libc and pthreads
+#define GFP_KERNEL 0
+#define kmalloc(size, flags) malloc(size)
+#define kmalloc_array(n, size, flags) calloc(n, size)
+#define kvmalloc(size, flags) malloc(size)
+#define kfree(p) free(p)
+#define kvfree(p) free(p)
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+typedef struct {
+	long long counter;
+} atomic64_t;
+
+static inline void atomic64_set(atomic64_t* v, long long i) {
+	__atomic_store_n(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline void atomic64_add(long long i, atomic64_t* v) {
+	__atomic_fetch_add(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline long long atomic64_add_return(long long i, atomic64_t* v) {
+	return __atomic_add_fetch(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline void atomic64_sub(long long i, atomic64_t* v) {
+	__atomic_fetch_sub(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline long long atomic64_read(const atomic64_t* v) {
+	return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
+}
+
+struct kref {
+	int refcount;
+};
+
+static inline void kref_init(struct kref* kref) {
+	kref->refcount = 1;
+}
+
+static inline void kref_get(struct kref* kref) {
+	__atomic_fetch_add(&kref->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int kref_read(const struct kref* kref) {
+	return __atomic_load_n(&kref->refcount, __ATOMIC_RELAXED);
+}
+
+static inline int kref_put(struct kref* kref, void (*release)(struct kref* kref)) {
+	if (__atomic_sub_fetch(&kref->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		release(kref);
+		return 1;
+	}
+	return 0;
+}
+
+#define container_of(ptr, type, member) ((type*) ((char*) (ptr) - offsetof(type, member)))
+#define message_slot_clock() ((unsigned long) time(NULL))
+
+struct mutex {
+	pthread_mutex_t m;
+};
+#define mutex_init(lock) pthread_mutex_init(&(lock)->m, NULL)
+#define mutex_lock(lock) pthread_mutex_lock(&(lock)->m)
+#define mutex_unlock(lock) pthread_mutex_unlock(&(lock)->m)
+#define mutex_destroy(lock) pthread_mutex_destroy(&(lock)->m)
+
+// waiters sleep with the slot's lock held, unlike in the kernel
+typedef pthread_cond_t wait_queue_head_t;
+#define init_waitqueue_head(wq) pthread_cond_init(wq, NULL)
+
+#endif
+
+static unsigned int max_msg_len = MAX_MSG_LEN; // the maximal message length of a new channel
+static unsigned long long max_total_bytes = 0; // the cap on the memory held by all the slots, or 0 for no cap
+static atomic64_t memory_usage; // the memory currently held by all the slots: channels, their rings and their messages
+
+enum message_slot_counter {
+	MESSAGES_WRITTEN,
+	BYTES_WRITTEN,
+	MESSAGES_READ,
+	BYTES_READ,
+	OVERWRITES, // unread messages discarded to make room for new ones
+	WOULD_BLOCKS, // EWOULDBLOCK returns of non-blocking reads and writes
+	ALLOC_FAILURES,
+	N_MESSAGE_SLOT_COUNTERS
+};
+
+// the counters are atomic since some events (such as EWOULDBLOCK returns) are counted outside of the slot's lock
+struct message_slot_stats {
+	atomic64_t counters[N_MESSAGE_SLOT_COUNTERS];
+};
+
+struct message_slot_node {
+	struct message_slot_node* next;
+	struct message_channel_node* head_message_channel_node;
+	unsigned int minor_num;
+	unsigned int open_count; // the open file descriptors of the slot, protected by the lock of the slot list
+	struct message_slot_stats stats; // the events which don't belong to a specific channel; the totals of the slot also add up its channels
+	struct mutex lock; // protects the channel list of the slot and the messages of its channels
+};
+
+struct message {
+	size_t len;
+	char* data;
+	unsigned long seq; // the message_seq of the channel when the message was written, which pairs the write and read tracepoints
+	int was_read;
+};
+
+struct message_channel_shm; // defined by the kernel module
+
+// the messages of a channel are kept in a ring of "depth" entries, from the oldest (at "head") to the newest.
+// in mailbox mode the ring has a single entry which is replaced by every write and isn't consumed by reads.
+// the slot's channel list holds a reference to the channel, and so does whoever sleeps on its wait queue, which outlives the channel's deletion
+struct message_channel_node {
+	struct message_channel_node* next;
+	unsigned int channel_id;
+	struct kref kref;
+	int is_deleted; // the channel has been removed from the slot, and its waiters should look the channel id up again
+	unsigned long last_access; // the message_slot_clock() of the last operation on the channel
+	struct message* messages;
+	unsigned int depth;
+	unsigned int head;
+	unsigned int count;
+	int is_queue_mode;
+	unsigned int overflow_policy;
+	unsigned int max_msg_len;
+	struct message_channel_shm* shm; // the shared ring which replaces the messages of the channel, or NULL if the channel is private (always, outside of the kernel)
+	struct message_slot_stats stats;
+	unsigned long message_seq; // incremented on every write, so a poller can tell whether a new message has landed
+	wait_queue_head_t wait_queue; // readers blocked on an empty channel, writers blocked on a full one and the poll relays of the files polling the channel wait here
+};
+
+
+static inline void count_event(struct message_slot_stats* stats, enum message_slot_counter counter, long long n) {
+	atomic64_add(n, &stats->counters[counter]);
+}
+
+
+static inline void init_message_slot_stats(struct message_slot_stats* stats) {
+	int i;
+	for (i = 0; i < N_MESSAGE_SLOT_COUNTERS; ++i) {
+		atomic64_set(&stats->counters[i], 0);
+	}
+}
+
+
+// account for memory held by the slots. only message data is refused once max_total_bytes is reached,
+// so a cap set too low can still be recovered from by reading or deleting channels
+static inline int charge_memory(size_t size, int is_capped) {
+	long long new_usage = atomic64_add_return(size, &memory_usage);
+	if (is_capped && max_total_bytes != 0 && new_usage > (long long) max_total_bytes) {
+		atomic64_sub(size, &memory_usage);
+		return 0;
+	}
+	return 1;
+}
+
+
+static inline void uncharge_memory(size_t size) {
+	atomic64_sub(size, &memory_usage);
+}
+
+
+static inline struct message_channel_node* find_message_channel_node_by_channel_id(struct message_slot_node* message_slot_node, unsigned int channel_id) {
+	struct message_channel_node* message_channel_node = message_slot_node->head_message_channel_node;
+	while (message_channel_node != NULL) {
+		if (message_channel_node->channel_id == channel_id) {
+			return message_channel_node;
+		}
+		message_channel_node = message_channel_node->next;
+	}
+	return NULL; // such message_channel_node doesn't exist
+}
+
+
+static inline struct message_channel_node* create_message_channel_node(struct message_slot_node* message_slot_node, unsigned int channel_id) {
+	struct message_channel_node* new_message_channel_node = kmalloc(sizeof(struct message_channel_node), GFP_KERNEL);
+	if (new_message_channel_node == NULL) {
+		return NULL;
+	}
+	new_message_channel_node->channel_id = channel_id;
+	new_message_channel_node->messages = kmalloc(sizeof(struct message), GFP_KERNEL); // a new channel is in mailbox mode
+	if (new_message_channel_node->messages == NULL) {
+		kfree(new_message_channel_node);
+		return NULL;
+	}
+	charge_memory(sizeof(struct message_channel_node) + sizeof(struct message), 0);
+	kref_init(&new_message_channel_node->kref); // the reference of the slot's channel list
+	new_message_channel_node->is_deleted = 0;
+	new_message_channel_node->last_access = message_slot_clock();
+	new_message_channel_node->depth = 1;
+	new_message_channel_node->head = 0;
+	new_message_channel_node->count = 0;
+	new_message_channel_node->is_queue_mode = 0;
+	new_message_channel_node->overflow_policy = MSG_SLOT_OVERFLOW_DROP_OLDEST;
+	new_message_channel_node->max_msg_len = max_msg_len;
+	new_message_channel_node->shm = NULL;
+	init_message_slot_stats(&new_message_channel_node->stats);
+	new_message_channel_node->message_seq = 0;
+	init_waitqueue_head(&new_message_channel_node->wait_queue);
+	// insert the new node as the head of the list
+	new_message_channel_node->next = message_slot_node->head_message_channel_node;
+	message_slot_node->head_message_channel_node = new_message_channel_node;
+	return new_message_channel_node;
+}
+
+
+// readers and pollers need the channel's wait queue even before anything has been written to it.
+// every operation on a channel goes through here, so it also marks the channel as accessed; requires the slot's lock
+static inline struct message_channel_node* get_or_create_message_channel_node(struct message_slot_node* message_slot_node, unsigned int channel_id) {
+	struct message_channel_node* message_channel_node = find_message_channel_node_by_channel_id(message_slot_node, channel_id);
+	if (message_channel_node == NULL) {
+		message_channel_node = create_message_channel_node(message_slot_node, channel_id);
+		if (message_channel_node == NULL) {
+			count_event(&message_slot_node->stats, ALLOC_FAILURES, 1);
+		}
+	} else {
+		message_channel_node->last_access = message_slot_clock();
+	}
+	return message_channel_node;
+}
+
+
+static inline int is_message_ring_empty(struct message_channel_node* message_channel_node) {
+	return READ_ONCE(message_channel_node->count) == 0;
+}
+
+
+static inline int is_message_ring_full(struct message_channel_node* message_channel_node) {
+	return READ_ONCE(message_channel_node->count) == READ_ONCE(message_channel_node->depth);
+}
+
+
+// small messages come from kmalloc as before, while large ones fall back to pages mapped by vmalloc when contiguous memory is scarce.
+// fails like an allocation failure once the slots hold max_total_bytes
+static inline char* alloc_message_data(size_t length) {
+	char* data;
+	if (!charge_memory(length, 1)) {
+		return NULL;
+	}
+	data = kvmalloc(length, GFP_KERNEL);
+	if (data == NULL) {
+		uncharge_memory(length);
+	}
+	return data;
+}
+
+
+static inline void free_message_data(char* data, size_t length) {
+	kvfree(data);
+	uncharge_memory(length);
+}
+
+
+static inline struct message* get_oldest_message(struct message_channel_node* message_channel_node) {
+	return &message_channel_node->messages[message_channel_node->head];
+}
+
+
+static inline void drop_oldest_message(struct message_channel_node* message_channel_node) {
+	struct message* message = get_oldest_message(message_channel_node);
+	free_message_data(message->data, message->len);
+	message_channel_node->head = (message_channel_node->head + 1) % message_channel_node->depth;
+	WRITE_ONCE(message_channel_node->count, message_channel_node->count - 1);
+}
+
+
+// append a message to the ring, discarding the oldest one if the ring is full; requires the slot's lock
+static inline void push_message(struct message_channel_node* message_channel_node, char* data, size_t len) {
+	struct message* message;
+	if (message_channel_node->count == message_channel_node->depth) {
+		if (!get_oldest_message(message_channel_node)->was_read) {
+			count_event(&message_channel_node->stats, OVERWRITES, 1);
+		}
+		drop_oldest_message(message_channel_node);
+	}
+	message_channel_node->message_seq += 1;
+	message = &message_channel_node->messages[(message_channel_node->head + message_channel_node->count) % message_channel_node->depth];
+	message->data = data;
+	message->len = len;
+	message->seq = message_channel_node->message_seq;
+	message->was_read = 0;
+	WRITE_ONCE(message_channel_node->count, message_channel_node->count + 1);
+}
+
+
+// resize the ring of the channel, keeping its newest messages which fit in the new depth; requires the slot's lock
+static inline int set_message_channel_mode(struct message_channel_node* message_channel_node, struct msg_slot_queue_config* config) {
+	unsigned int i;
+	unsigned int new_depth = config->depth == 0 ? 1 : config->depth;
+	struct message* new_messages = kmalloc_array(new_depth, sizeof(struct message), GFP_KERNEL);
+	if (new_messages == NULL) {
+		count_event(&message_channel_node->stats, ALLOC_FAILURES, 1);
+		return -ENOMEM;
+	}
+	while (message_channel_node->count > new_depth) {
+		drop_oldest_message(message_channel_node);
+	}
+	for (i = 0; i < message_channel_node->count; ++i) {
+		new_messages[i] = message_channel_node->messages[(message_channel_node->head + i) % message_channel_node->depth];
+	}
+	kfree(message_channel_node->messages);
+	charge_memory(new_depth * sizeof(struct message), 0);
+	uncharge_memory(message_channel_node->depth * sizeof(struct message));
+	message_channel_node->messages = new_messages;
+	message_channel_node->head = 0;
+	WRITE_ONCE(message_channel_node->depth, new_depth);
+	message_channel_node->is_queue_mode = config->depth != 0;
+	message_channel_node->overflow_policy = config->depth != 0 ? config->overflow_policy : MSG_SLOT_OVERFLOW_DROP_OLDEST;
+	return SUCCESS;
+}
+
+
+// discard the messages of the channel, keeping its configuration; requires the slot's lock
+static inline void clear_message_channel_node(struct message_channel_node* message_channel_node) {
+	while (message_channel_node->count > 0) {
+		drop_oldest_message(message_channel_node);
+	}
+}
+
+
+// remove the channel from the slot and discard its messages, leaving the reference of the channel list to the caller to drop
+// (after waking up the channel's waiters, so they find it deleted); requires the slot's lock
+static inline void unlink_message_channel_node(struct message_slot_node* message_slot_node, struct message_channel_node* message_channel_node) {
+	struct message_channel_node** link = &message_slot_node->head_message_channel_node;
+	while (*link != message_channel_node) {
+		link = &(*link)->next;
+	}
+	*link = message_channel_node->next;
+	WRITE_ONCE(message_channel_node->is_deleted, 1);
+	clear_message_channel_node(message_channel_node);
+}
+
+
+static inline void destroy_message_channel_node(struct message_channel_node* message_channel_node) {
+	clear_message_channel_node(message_channel_node);
+	uncharge_memory(sizeof(struct message_channel_node) + message_channel_node->depth * sizeof(struct message));
+	kfree(message_channel_node->messages);
+	kfree(message_channel_node);
+}
+
+#endif
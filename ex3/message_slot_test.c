@@ -0,0 +1,114 @@
+/* regression tests of the message slot module for cases which once lost messages. they run against a device file
+of the loaded module, which must have been loaded with a nonzero idle_channel_timeout (in seconds) for the expiry tests.
+
+usage: ./message_slot_test device_file
+build: gcc -O2 -Wall message_slot_test.c -o message_slot_test */
+
+#include "message_slot.h"
+#include "message_slot_shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define IDLE_CHANNEL_TIMEOUT_PARAMETER "/sys/module/message_slot/parameters/idle_channel_timeout"
+
+static int failures = 0;
+
+
+void print_error_message(const char* s) {
+	perror(s);
+}
+
+
+void print_error_message_and_exit(const char* s) {
+	print_error_message(s);
+	exit(1);
+}
+
+
+static void pass(const char* name) {
+	printf("ok   %s\n", name);
+}
+
+
+static void fail(const char* name) {
+	printf("FAIL %s\n", name);
+	failures += 1;
+}
+
+
+static unsigned int get_idle_channel_timeout(void) {
+	unsigned int timeout = 0;
+	FILE* f = fopen(IDLE_CHANNEL_TIMEOUT_PARAMETER, "r");
+	if (f == NULL) {
+		print_error_message_and_exit("Failed to read the idle_channel_timeout of the module");
+	}
+	if (fscanf(f, "%u", &timeout) != 1) {
+		timeout = 0;
+	}
+	fclose(f);
+	return timeout;
+}
+
+
+// a shared channel whose messages only go through its mapped ring outlives the idle timeout, and read() still consumes from the ring
+static void test_mapped_shared_channel_is_not_expired(const char* device_file, unsigned int timeout) {
+	const char* name = "mapped shared channel is not expired";
+	const char message[] = "through the ring";
+	char buf[64];
+	struct msg_slot_shm_config config = {.nr_entries = 4, .entry_size = sizeof(buf), .eventfd = -1};
+	int fd = open(device_file, O_RDWR | O_NONBLOCK);
+	if (fd == -1) {
+		print_error_message_and_exit("Failed to open the file");
+	}
+	if (ioctl(fd, MSG_SLOT_CHANNEL, 1000) == -1 || ioctl(fd, MSG_SLOT_SHM_SETUP, &config) == -1) {
+		print_error_message_and_exit("Failed to set up the shared channel");
+	}
+	struct msg_slot_shm_header* header = msg_slot_shm_map(fd, config.nr_entries, config.entry_size);
+	if (header == NULL) {
+		print_error_message_and_exit("Failed to map the ring");
+	}
+
+	for (unsigned int i = 0; i < 4 * timeout; i++) { // the channel is reaped at most 1.5 timeouts after its last access
+		if (msg_slot_shm_produce(header, message, sizeof(message), -1) == -1 || msg_slot_shm_consume(header, buf, sizeof(buf)) == -1) {
+			print_error_message_and_exit("Failed to pass a message through the ring");
+		}
+		usleep(500 * 1000);
+	}
+	if (msg_slot_shm_produce(header, message, sizeof(message), -1) == -1) {
+		print_error_message_and_exit("Failed to publish a message to the ring");
+	}
+	ssize_t bytes_read = read(fd, buf, sizeof(buf));
+	if (bytes_read == sizeof(message) && memcmp(buf, message, sizeof(message)) == 0) {
+		pass(name);
+	} else {
+		fail(name); // the channel was replaced by a private one, which knows nothing of the ring
+	}
+
+	msg_slot_shm_unmap(header);
+	config.nr_entries = 0;
+	ioctl(fd, MSG_SLOT_SHM_SETUP, &config);
+	ioctl(fd, MSG_SLOT_DELETE_CHANNEL);
+	close(fd);
+}
+
+
+int main(int argc, char* argv[]) {
+	if (argc != 2) {
+		printf("You must pass 1 argument\n");
+		exit(1);
+	}
+
+	unsigned int timeout = get_idle_channel_timeout();
+	if (timeout == 0) {
+		printf("The module must be loaded with idle_channel_timeout set\n");
+		exit(1);
+	}
+	test_mapped_shared_channel_is_not_expired(argv[1], timeout);
+
+	exit(failures == 0 ? 0 : 1);
+}
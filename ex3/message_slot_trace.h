@@ -0,0 +1,47 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM message_slot
+
+#if !defined(MESSAGE_SLOT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define MESSAGE_SLOT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* tracepoints on every read and write of a message slot (events message_slot:message_slot_read and message_slot:message_slot_write).
+rc is the length of the message or a negative error, and seq pairs the write of a message to a channel with its reads,
+so the latency of a message is the time between the two events with the same minor, channel and seq (seq is 0 on shared channels) */
+DECLARE_EVENT_CLASS(message_slot_io,
+	TP_PROTO(unsigned int minor_num, unsigned int channel_id, long rc, unsigned long seq),
+	TP_ARGS(minor_num, channel_id, rc, seq),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor_num)
+		__field(unsigned int, channel_id)
+		__field(long, rc)
+		__field(unsigned long, seq)
+	),
+	TP_fast_assign(
+		__entry->minor_num = minor_num;
+		__entry->channel_id = channel_id;
+		__entry->rc = rc;
+		__entry->seq = seq;
+	),
+	TP_printk("minor=%u channel=%u rc=%ld seq=%lu", __entry->minor_num, __entry->channel_id, __entry->rc, __entry->seq)
+);
+
+DEFINE_EVENT(message_slot_io, message_slot_read,
+	TP_PROTO(unsigned int minor_num, unsigned int channel_id, long rc, unsigned long seq),
+	TP_ARGS(minor_num, channel_id, rc, seq)
+);
+
+DEFINE_EVENT(message_slot_io, message_slot_write,
+	TP_PROTO(unsigned int minor_num, unsigned int channel_id, long rc, unsigned long seq),
+	TP_ARGS(minor_num, channel_id, rc, seq)
+);
+
+#endif
+
+// the trace header lives next to the module rather than in include/trace/events, so the build needs -I of this directory
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE message_slot_trace
+#include <trace/define_trace.h>
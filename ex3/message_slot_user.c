@@ -0,0 +1,329 @@
+#include "message_slot_user.h"
+#include "message_slot_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+// the state of an open "file", like struct message_slot_file of the kernel module
+struct msg_slot_user_file {
+	struct message_slot_node* message_slot_node;
+	unsigned int channel_id;
+	int flags;
+};
+
+static struct message_slot_node* message_slot_list_head = NULL;
+static pthread_mutex_t message_slot_list_lock = PTHREAD_MUTEX_INITIALIZER; // protects message_slot_list_head
+
+
+static int fail_with_errno(int error) {
+	errno = error;
+	return -1;
+}
+
+
+static struct message_slot_node* get_or_create_message_slot_node(unsigned int minor_num) {
+	struct message_slot_node* message_slot_node;
+	pthread_mutex_lock(&message_slot_list_lock);
+	for (message_slot_node = message_slot_list_head; message_slot_node != NULL; message_slot_node = message_slot_node->next) {
+		if (message_slot_node->minor_num == minor_num) {
+			pthread_mutex_unlock(&message_slot_list_lock);
+			return message_slot_node;
+		}
+	}
+	message_slot_node = malloc(sizeof(struct message_slot_node));
+	if (message_slot_node != NULL) {
+		message_slot_node->head_message_channel_node = NULL;
+		message_slot_node->minor_num = minor_num;
+		init_message_slot_stats(&message_slot_node->stats);
+		mutex_init(&message_slot_node->lock);
+		// insert the new node as the head of the list
+		message_slot_node->next = message_slot_list_head;
+		message_slot_list_head = message_slot_node;
+	}
+	pthread_mutex_unlock(&message_slot_list_lock);
+	return message_slot_node;
+}
+
+
+struct msg_slot_user_file* msg_slot_user_open(unsigned int minor_num, int flags) {
+	struct msg_slot_user_file* file = malloc(sizeof(struct msg_slot_user_file));
+	if (file == NULL) {
+		return NULL;
+	}
+	file->message_slot_node = get_or_create_message_slot_node(minor_num);
+	if (file->message_slot_node == NULL) {
+		free(file);
+		errno = ENOMEM;
+		return NULL;
+	}
+	file->channel_id = 0; // no channel has been set yet
+	file->flags = flags;
+	return file;
+}
+
+
+int msg_slot_user_close(struct msg_slot_user_file* file) {
+	free(file);
+	return SUCCESS;
+}
+
+
+static void release_message_channel_node(struct kref* kref) {
+	destroy_message_channel_node(container_of(kref, struct message_channel_node, kref));
+}
+
+
+static void put_message_channel_node(struct message_channel_node* message_channel_node) {
+	kref_put(&message_channel_node->kref, release_message_channel_node);
+}
+
+
+// sleep on the channel with the slot's lock held, and return the channel of its id once woken up:
+// a new one if the channel has been deleted meanwhile, or NULL if that can't be created
+static struct message_channel_node* wait_on_channel(struct message_slot_node* message_slot_node, struct message_channel_node* message_channel_node) {
+	unsigned int channel_id = message_channel_node->channel_id;
+	kref_get(&message_channel_node->kref); // keeps the condition variable alive even if the channel is deleted while we sleep
+	pthread_cond_wait(&message_channel_node->wait_queue, &message_slot_node->lock.m);
+	put_message_channel_node(message_channel_node);
+	return get_or_create_message_channel_node(message_slot_node, channel_id);
+}
+
+
+// the channel of the file with the slot's lock held, or NULL (with errno set and the lock released)
+static struct message_channel_node* lock_channel_of_file(struct msg_slot_user_file* file) {
+	struct message_channel_node* message_channel_node;
+	if (file->channel_id == 0) { // no channel has been set on the file
+		errno = EINVAL;
+		return NULL;
+	}
+	mutex_lock(&file->message_slot_node->lock);
+	message_channel_node = get_or_create_message_channel_node(file->message_slot_node, file->channel_id);
+	if (message_channel_node == NULL) { // creation failed
+		mutex_unlock(&file->message_slot_node->lock);
+		errno = ENOMEM;
+	}
+	return message_channel_node;
+}
+
+
+ssize_t msg_slot_user_read(struct msg_slot_user_file* file, char* buffer, size_t length) {
+	struct message* message;
+	size_t message_len;
+	struct message_slot_node* message_slot_node = file->message_slot_node;
+	struct message_channel_node* message_channel_node = lock_channel_of_file(file);
+	if (message_channel_node == NULL) {
+		return -1;
+	}
+	while (message_channel_node != NULL && is_message_ring_empty(message_channel_node)) {
+		if (file->flags & O_NONBLOCK) {
+			count_event(&message_channel_node->stats, WOULD_BLOCKS, 1);
+			mutex_unlock(&message_slot_node->lock);
+			return fail_with_errno(EWOULDBLOCK);
+		}
+		message_channel_node = wait_on_channel(message_slot_node, message_channel_node);
+	}
+	if (message_channel_node == NULL) { // the deleted channel couldn't be created again
+		mutex_unlock(&message_slot_node->lock);
+		return fail_with_errno(ENOMEM);
+	}
+
+	message = get_oldest_message(message_channel_node);
+	message_len = message->len;
+	if (length < message_len) { // the provided buffer is too small to hold the message
+		mutex_unlock(&message_slot_node->lock);
+		return fail_with_errno(ENOSPC);
+	}
+	memcpy(buffer, message->data, message_len);
+	message->was_read = 1;
+	count_event(&message_channel_node->stats, MESSAGES_READ, 1);
+	count_event(&message_channel_node->stats, BYTES_READ, message_len);
+	if (message_channel_node->is_queue_mode) {
+		drop_oldest_message(message_channel_node);
+		pthread_cond_broadcast(&message_channel_node->wait_queue); // wake up the writers blocked on a full queue
+	}
+	mutex_unlock(&message_slot_node->lock);
+	return message_len;
+}
+
+
+// deliver a message to a channel of the slot, taking ownership of the message buffer (which is freed on failure)
+static int write_message_to_channel(struct message_slot_node* message_slot_node, unsigned int channel_id, char* new_message, size_t length, int nonblocking) {
+	struct message_channel_node* message_channel_node;
+	mutex_lock(&message_slot_node->lock);
+	message_channel_node = get_or_create_message_channel_node(message_slot_node, channel_id);
+	while (message_channel_node != NULL && is_message_ring_full(message_channel_node) && message_channel_node->is_queue_mode && message_channel_node->overflow_policy != MSG_SLOT_OVERFLOW_DROP_OLDEST) {
+		if (message_channel_node->overflow_policy == MSG_SLOT_OVERFLOW_REJECT || nonblocking) {
+			int rc = message_channel_node->overflow_policy == MSG_SLOT_OVERFLOW_REJECT ? -ENOBUFS : -EWOULDBLOCK;
+			if (rc == -EWOULDBLOCK) {
+				count_event(&message_channel_node->stats, WOULD_BLOCKS, 1);
+			}
+			mutex_unlock(&message_slot_node->lock);
+			free_message_data(new_message, length);
+			return rc;
+		}
+		message_channel_node = wait_on_channel(message_slot_node, message_channel_node);
+	}
+	if (message_channel_node == NULL) { // creation failed
+		mutex_unlock(&message_slot_node->lock);
+		free_message_data(new_message, length);
+		return -ENOMEM;
+	}
+	if (length > message_channel_node->max_msg_len) {
+		mutex_unlock(&message_slot_node->lock);
+		free_message_data(new_message, length);
+		return -EMSGSIZE;
+	}
+
+	push_message(message_channel_node, new_message, length);
+	count_event(&message_channel_node->stats, MESSAGES_WRITTEN, 1);
+	count_event(&message_channel_node->stats, BYTES_WRITTEN, length);
+	pthread_cond_broadcast(&message_channel_node->wait_queue); // wake up the blocked readers of the channel
+	mutex_unlock(&message_slot_node->lock);
+	return SUCCESS;
+}
+
+
+static char* copy_new_message(const char* buffer, size_t length) {
+	char* new_message = alloc_message_data(length);
+	if (new_message != NULL) {
+		memcpy(new_message, buffer, length);
+	}
+	return new_message;
+}
+
+
+ssize_t msg_slot_user_write(struct msg_slot_user_file* file, const char* buffer, size_t length) {
+	int rc;
+	char* new_message;
+	if (file->channel_id == 0) { // no channel has been set on the file
+		return fail_with_errno(EINVAL);
+	}
+	if (length == 0 || length > MAX_MSG_LEN_LIMIT) {
+		return fail_with_errno(EMSGSIZE);
+	}
+	new_message = copy_new_message(buffer, length);
+	if (new_message == NULL) {
+		count_event(&file->message_slot_node->stats, ALLOC_FAILURES, 1);
+		return fail_with_errno(ENOMEM);
+	}
+	rc = write_message_to_channel(file->message_slot_node, file->channel_id, new_message, length, file->flags & O_NONBLOCK);
+	if (rc != SUCCESS) {
+		return fail_with_errno(-rc);
+	}
+	return length;
+}
+
+
+static int write_batch(struct msg_slot_user_file* file, const struct msg_slot_batch* batch) {
+	unsigned int i;
+	int rc = SUCCESS;
+	const struct msg_slot_batch_entry* entries = (const struct msg_slot_batch_entry*) (uintptr_t) batch->entries;
+	if (batch->count == 0 || batch->count > MAX_BATCH_LEN) {
+		return fail_with_errno(EINVAL);
+	}
+	for (i = 0; i < batch->count; ++i) {
+		char* new_message;
+		if (entries[i].channel_id == 0) {
+			rc = -EINVAL;
+			break;
+		}
+		if (entries[i].length == 0 || entries[i].length > MAX_MSG_LEN_LIMIT) {
+			rc = -EMSGSIZE;
+			break;
+		}
+		new_message = copy_new_message((const char*) (uintptr_t) entries[i].buffer, entries[i].length);
+		if (new_message == NULL) {
+			count_event(&file->message_slot_node->stats, ALLOC_FAILURES, 1);
+			rc = -ENOMEM;
+			break;
+		}
+		rc = write_message_to_channel(file->message_slot_node, entries[i].channel_id, new_message, entries[i].length, file->flags & O_NONBLOCK);
+		if (rc != SUCCESS) {
+			break;
+		}
+	}
+	if (i > 0) {
+		return i;
+	}
+	return fail_with_errno(-rc);
+}
+
+
+int msg_slot_user_ioctl(struct msg_slot_user_file* file, unsigned int ioctl_command_id, unsigned long ioctl_param) {
+	int rc;
+	struct message_channel_node* message_channel_node;
+	switch (ioctl_command_id) {
+	case MSG_SLOT_CHANNEL:
+		if (ioctl_param == 0) {
+			return fail_with_errno(EINVAL);
+		}
+		file->channel_id = (unsigned int) ioctl_param;
+		return SUCCESS;
+	case MSG_SLOT_QUEUE_MODE: {
+		struct msg_slot_queue_config* config = (struct msg_slot_queue_config*) ioctl_param;
+		if (config->depth > MAX_QUEUE_DEPTH || config->overflow_policy > MSG_SLOT_OVERFLOW_BLOCK) {
+			return fail_with_errno(EINVAL);
+		}
+		message_channel_node = lock_channel_of_file(file);
+		if (message_channel_node == NULL) {
+			return -1;
+		}
+		rc = set_message_channel_mode(message_channel_node, config);
+		pthread_cond_broadcast(&message_channel_node->wait_queue); // blocked writers may have room now
+		mutex_unlock(&file->message_slot_node->lock);
+		return rc == SUCCESS ? SUCCESS : fail_with_errno(-rc);
+	}
+	case MSG_SLOT_SET_MAX_MSG_LEN:
+		if (ioctl_param == 0 || ioctl_param > MAX_MSG_LEN_LIMIT) {
+			return fail_with_errno(EINVAL);
+		}
+		message_channel_node = lock_channel_of_file(file);
+		if (message_channel_node == NULL) {
+			return -1;
+		}
+		message_channel_node->max_msg_len = (unsigned int) ioctl_param;
+		mutex_unlock(&file->message_slot_node->lock);
+		return SUCCESS;
+	case MSG_SLOT_WRITE_BATCH:
+		return write_batch(file, (const struct msg_slot_batch*) ioctl_param);
+	case MSG_SLOT_DELETE_CHANNEL:
+		if (file->channel_id == 0) { // no channel has been set on the file
+			return fail_with_errno(EINVAL);
+		}
+		mutex_lock(&file->message_slot_node->lock);
+		message_channel_node = find_message_channel_node_by_channel_id(file->message_slot_node, file->channel_id);
+		if (message_channel_node == NULL) {
+			mutex_unlock(&file->message_slot_node->lock);
+			return fail_with_errno(ENOENT);
+		}
+		unlink_message_channel_node(file->message_slot_node, message_channel_node);
+		pthread_cond_broadcast(&message_channel_node->wait_queue); // blocked readers and writers look the channel id up again
+		put_message_channel_node(message_channel_node);
+		mutex_unlock(&file->message_slot_node->lock);
+		return SUCCESS;
+	case MSG_SLOT_CLEAR_CHANNEL: // clearing a channel which doesn't exist does nothing, so it isn't created
+		if (file->channel_id == 0) { // no channel has been set on the file
+			return fail_with_errno(EINVAL);
+		}
+		mutex_lock(&file->message_slot_node->lock);
+		message_channel_node = find_message_channel_node_by_channel_id(file->message_slot_node, file->channel_id);
+		if (message_channel_node != NULL) {
+			clear_message_channel_node(message_channel_node);
+			pthread_cond_broadcast(&message_channel_node->wait_queue); // blocked writers have room now
+		}
+		mutex_unlock(&file->message_slot_node->lock);
+		return SUCCESS;
+	case MSG_SLOT_GET_MEMORY_USAGE:
+		*(unsigned long long*) ioctl_param = atomic64_read(&memory_usage);
+		return SUCCESS;
+	case MSG_SLOT_SHM_SETUP:
+		return fail_with_errno(EOPNOTSUPP);
+	default:
+		return fail_with_errno(EINVAL);
+	}
+}
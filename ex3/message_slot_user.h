@@ -0,0 +1,20 @@
+#ifndef MESSAGE_SLOT_USER_H
+#define MESSAGE_SLOT_USER_H
+
+#include "message_slot.h"
+
+#include <sys/types.h>
+
+/* a userspace stand-in for the message slot device, backed by the same channel store as the kernel module.
+each function mirrors the syscall on the device file: it returns -1 and sets errno on failure.
+shared channels (MSG_SLOT_SHM_SETUP), idle channel expiry and the reclamation of unused slots exist only in the kernel */
+
+struct msg_slot_user_file;
+
+struct msg_slot_user_file* msg_slot_user_open(unsigned int minor_num, int flags); // the only supported flag is O_NONBLOCK
+int msg_slot_user_close(struct msg_slot_user_file* file);
+int msg_slot_user_ioctl(struct msg_slot_user_file* file, unsigned int ioctl_command_id, unsigned long ioctl_param);
+ssize_t msg_slot_user_read(struct msg_slot_user_file* file, char* buffer, size_t length);
+ssize_t msg_slot_user_write(struct msg_slot_user_file* file, const char* buffer, size_t length);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // for O_NOATIME, the d_type values and struct statx
 #include <threads.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,342 +6,2653 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#include <regex.h>
+#include <pwd.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 char* root_dir;
-char* search_term;
+char** search_terms; // a name matches if it matches any of the terms
+int num_search_terms = 0;
 int num_threads;
+int use_uring = 0; // whether to search with the io_uring engine (-u) rather than with blocking syscalls
+char* index_path = NULL; // the index of the tree to refresh and search (-x), or NULL to walk the tree
 atomic_int num_remaining_threads; // the number of threads which haven't exited as the result of an error
-atomic_int files_found = 0;
+int is_output_sorted = 0; // (-s)
+char output_separator = '\n'; // or '\0' (-0)
+
+// how the search terms are matched against the names of the entries
+enum match_mode {
+	MATCH_SUBSTRING, // the term appears anywhere in the name
+	MATCH_GLOB, // the whole name matches the term as a shell pattern (-g)
+	MATCH_REGEX, // the name matches the term as an extended regular expression (-e)
+};
+
+enum match_mode match_mode = MATCH_SUBSTRING;
+int ignore_case = 0; // (-i)
+char* content_term = NULL; // the literal to look for in the contents of the matching files (-c), or NULL to report the files themselves
+size_t content_term_len;
+
+// the search terms are compiled once, before the threads start, into a plan which is shared (read-only) by all of them:
+// a single substring is found with SIMD, several substrings with an Aho-Corasick automaton which scans a name once for all of them,
+// and globs (translated to regular expressions) and regular expressions are joined into a single alternation
+struct search_plan {
+	char* literal; // a single substring term (folded to lower case if ignore_case)
+	size_t literal_len;
+	unsigned int* transitions; // several substring terms: 256 transitions of each state of the automaton
+	unsigned char* is_accepting; // whether a state ends a term
+	regex_t regex;
+} search_plan;
+
+/* the metadata predicates, which an entry must satisfy as well as match a term. they are about the entry itself, so a symlink is not
+followed (unlike when pfind decides which entries are directories to search). they're checked only for the entries whose names match,
+with d_type first, and then with a single statx which asks only for the fields they need */
+struct predicates {
+	unsigned int types; // the allowed types, as a bit for each d_type (-T), or 0 for any type
+	unsigned int statx_mask; // the fields of statx the other predicates need, or 0 if there are none
+	unsigned long long min_size, max_size; // (-S)
+	long long min_mtime, max_mtime; // in seconds since the epoch (-M)
+	long long min_ctime, max_ctime; // (-C)
+	uid_t uid; // (-U)
+	mode_t mode; // the permission bits which must all be set (-P)
+} predicates;
+
+// directories are read with getdents64 straight into a large buffer of each thread, rather than through readdir's small one,
+// so a directory of 100k entries takes a handful of syscalls
+#define DIRENTS_BUFFER_SIZE (1 << 20)
+
+// the record layout of the kernel, which has 64-bit fields even where the ino_t and off_t of libc are 32-bit
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+thread_local char* dirents_buffer;
 
 mtx_t start_threads_mutex;
-mtx_t q_lock;
 cnd_t start_threads_cv;
 int start_threads_flag = 0; // whether all the threads are created 
-int num_threads_waiting_to_lock = 0; // the number of threads that have been already woken up but couldn't get the lock; requires q_lock
 
-// insert nodes to tail, extract from head; requires q_lock
-struct dir_queue {
-	struct dir_queue_node* head;
-	struct dir_queue_node* tail;
-	int len;
+/* every thread owns a deque of directories waiting for search (Chase-Lev): the owner pushes and pops directories at the bottom
+without taking a lock, while idle threads steal the oldest directories from the top of other threads' deques.
+the work is tracked by pending_dirs, the number of directories which have been pushed but not searched yet, so the search is over
+exactly when it drops to 0 */
+#define WORK_DEQUE_INITIAL_SIZE 256
+#define ENQUEUE_BATCH_SIZE 64 // subdirectories are pushed (and idle threads woken up) in batches of this many
+#define CACHE_LINE_SIZE 64
+
+/* a directory is kept as a reference to its parent and its own name, so paths are written out only to open a directory or print a match.
+the directories are allocated from arenas of their finding threads, and live until the program exits since their subdirectories
+(searched by any thread) keep referencing them */
+struct dir_node {
+	struct dir_node* parent; // NULL for the search root, whose name is the path given on the command line
+	size_t path_len; // the length of the full path of the directory
+	unsigned int name_len;
+	uint32_t old_index_dir; // with an index (-x): the directory in the previous index, or INDEX_NONE if it's new
+	struct dir_record* record; // with an index: the entries found in the directory, set once it's indexed
+	struct content_chunk* content_chunk; // if set, the node is a file (in the parent directory) whose chunk is to be searched (-c)
+	char name[];
+};
+
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define INDEX_NONE UINT32_MAX
+
+struct arena {
+	char* next;
+	char* end;
+};
+
+/* with -c, the threads read the files which match with large preads into their content buffers, and report every offset of the content term.
+a file larger than CONTENT_CHUNK_SIZE is split: its first chunk is searched right away, and the rest are pushed to the deque of the thread
+like directories, so idle threads steal them and a single huge file is searched by all of them */
+#define CONTENT_BUFFER_SIZE (1 << 20)
+#define CONTENT_CHUNK_SIZE (8 << 20)
+#define MAX_CONTENT_TERM_LEN (64 << 10)
+
+struct content_chunk {
+	off_t start; // the offsets at which a match may start
+	off_t end;
+};
+
+thread_local char* content_buffer;
+thread_local struct work_deque* own_work_deque; // where the chunks of large files are pushed, or NULL to search them whole
+
+/* the threads search depth-first: a thread pops the newest directory of its own deque, which is usually a subdirectory of the one it
+has just read, while the others steal the oldest ones. so each thread keeps the directories it has read with subdirectories open,
+in a small cache, and opens the subdirectories relative to them (openat) rather than by their full paths */
+#define DIRFD_CACHE_SIZE 8
+
+struct cached_dirfd {
+	struct dir_node* dir; // NULL if the entry is free
+	int fd;
+	unsigned long last_use;
+};
+
+thread_local struct cached_dirfd dirfd_cache[DIRFD_CACHE_SIZE];
+thread_local unsigned long dirfd_cache_clock = 0;
+atomic_int is_dirfd_cache_disabled = 0; // set once an open runs out of fds, after which every thread closes its directories once they're read
+
+thread_local struct arena dir_node_arena;
+thread_local char* path_buffer; // holds the path of the directory the thread is searching
+thread_local size_t path_buffer_size;
+
+// the subdirectories found by a thread which haven't been pushed to its deque yet
+struct subdir_batch {
+	struct dir_node* dirs[ENQUEUE_BATCH_SIZE];
+	int len;
+};
+
+struct work_array {
+	long size; // a power of 2
+	struct work_array* retired; // the array this one replaced when it grew, kept since a thief may still be reading from it
+	_Atomic(struct dir_node*) items[];
+};
+
+struct work_deque {
+	_Alignas(CACHE_LINE_SIZE) atomic_long top; // the next directory to steal, advanced by thieves (and by the owner taking the last one)
+	_Alignas(CACHE_LINE_SIZE) atomic_long bottom; // the next free slot, written only by the owner
+	_Atomic(struct work_array*) array;
+};
+
+struct work_deque* work_deques; // the deque of thread i is work_deques[i]
+atomic_long pending_dirs = 0;
+
+mtx_t idle_lock;
+cnd_t idle_cv; // idle threads sleep here until new directories are pushed or the search is over
+atomic_int num_idle_threads = 0;
+
+/* every thread collects its matches in its own buffer, which is written to stdout (under output_lock, so the lines of different threads
+don't interleave) only when it fills up and when the program exits. the matches are counted per thread as well, and summed at exit.
+if the output is sorted, the buffers just grow until the search is over, and then all the matches are sorted and written together.
+a name may contain the separator, so every match is recorded as it's appended rather than found again by splitting the buffer */
+#define OUTPUT_BUFFER_SIZE (64 << 10)
+
+struct output_record {
+	size_t offset; // in the data of the buffer, which moves as it grows
+	size_t len; // without the separator
+};
+
+struct output_buffer {
+	_Alignas(CACHE_LINE_SIZE) char* data;
+	size_t len;
+	size_t size;
+	long files_found;
+	struct output_record* records; // the matches in the data, kept only if the output is sorted
+	size_t records_size;
+};
+
+struct output_buffer* output_buffers; // the buffer of thread i is output_buffers[i]
+thread_local struct output_buffer* output;
+mtx_t output_lock;
+
+/* with -v, every thread counts what it does in its own struct (on its own cache lines), which the reporting thread reads when SIGUSR1
+arrives, every -p seconds, and at exit. only the owner writes the counters, so a plain load and store (relaxed, for the reader) do.
+without -v, own_stats is NULL and the counters cost a single test of a thread-local pointer */
+struct thread_stats {
+	_Alignas(CACHE_LINE_SIZE) atomic_long dirs;
+	atomic_long entries;
+	atomic_long stat_calls;
+	atomic_long matches;
+	atomic_long idle_ns; // sleeping until there's a directory to steal
+	atomic_long lock_wait_ns; // waiting for the locks of pfind (idle_lock and output_lock)
+	atomic_long max_deque_depth;
+	_Atomic(struct dir_node*) current_dir; // the directory being read, or NULL
+	atomic_long current_dir_start_ns;
+};
+
+#define ADD_STAT(field, n) do { \
+		if (own_stats != NULL) { \
+			atomic_store_explicit(&own_stats->field, atomic_load_explicit(&own_stats->field, memory_order_relaxed) + (n), memory_order_relaxed); \
+		} \
+	} while (0)
+
+int is_stats_enabled = 0; // (-v, or -p)
+struct thread_stats* thread_stats = NULL; // the stats of thread i are thread_stats[i], or NULL without -v
+thread_local struct thread_stats* own_stats = NULL;
+int stats_interval = 0; // the seconds between the periodic reports (-p), or 0 to report only on SIGUSR1
+long start_ns;
+
+
+void print_error_message(const char* s) {
+	perror(s);
+}
+
+
+void print_error_message_and_exit(const char* s) {
+	print_error_message(s);
+	exit(1);
+}
+
+
+long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// the clock is read only if the lock is contended
+void lock_and_count_wait(mtx_t* lock) {
+	if (own_stats == NULL || mtx_trylock(lock) == thrd_success) {
+		if (own_stats == NULL) {
+			mtx_lock(lock);
+		}
+		return;
+	}
+	long wait_start_ns = now_ns();
+	mtx_lock(lock);
+	ADD_STAT(lock_wait_ns, now_ns() - wait_start_ns);
+}
+
+
+void set_current_dir(struct dir_node* dir) {
+	if (own_stats != NULL) {
+		atomic_store_explicit(&own_stats->current_dir_start_ns, now_ns(), memory_order_relaxed);
+		atomic_store_explicit(&own_stats->current_dir, dir, memory_order_release);
+	}
+}
+
+
+// the nodes are never changed once they're pushed, so another thread's current directory can be printed safely
+void print_dir_path(struct dir_node* dir) {
+	if (dir->parent != NULL) {
+		print_dir_path(dir->parent);
+		fputc('/', stderr);
+	}
+	fputs(dir->name, stderr);
+}
+
+
+void print_stats(const char* title) {
+	long now = now_ns();
+	long total_dirs = 0, total_entries = 0, total_stat_calls = 0, total_matches = 0;
+	for (int i = 0; i < num_threads; i++) {
+		total_dirs += atomic_load_explicit(&thread_stats[i].dirs, memory_order_relaxed);
+		total_entries += atomic_load_explicit(&thread_stats[i].entries, memory_order_relaxed);
+		total_stat_calls += atomic_load_explicit(&thread_stats[i].stat_calls, memory_order_relaxed);
+		total_matches += atomic_load_explicit(&thread_stats[i].matches, memory_order_relaxed);
+	}
+	fprintf(stderr, "%s after %.1fs: %ld directories, %ld entries (%.0f/s), %ld stats, %ld matches, %ld directories pending\n", title,
+		(now - start_ns) / 1e9, total_dirs, total_entries, total_entries / ((now - start_ns) / 1e9 + 1e-9), total_stat_calls, total_matches,
+		atomic_load(&pending_dirs));
+	for (int i = 0; i < num_threads; i++) {
+		struct thread_stats* stats = &thread_stats[i];
+		struct dir_node* current_dir = atomic_load_explicit(&stats->current_dir, memory_order_acquire);
+		fprintf(stderr, "  thread %d: %ld directories, %ld entries, %ld stats, %ld matches, idle %.3fs, lock wait %.3fs, deque high-water %ld", i,
+			atomic_load_explicit(&stats->dirs, memory_order_relaxed), atomic_load_explicit(&stats->entries, memory_order_relaxed),
+			atomic_load_explicit(&stats->stat_calls, memory_order_relaxed), atomic_load_explicit(&stats->matches, memory_order_relaxed),
+			atomic_load_explicit(&stats->idle_ns, memory_order_relaxed) / 1e9, atomic_load_explicit(&stats->lock_wait_ns, memory_order_relaxed) / 1e9,
+			atomic_load_explicit(&stats->max_deque_depth, memory_order_relaxed));
+		if (current_dir != NULL) {
+			fprintf(stderr, ", reading ");
+			print_dir_path(current_dir);
+			fprintf(stderr, " for %.1fs", (now - atomic_load_explicit(&stats->current_dir_start_ns, memory_order_relaxed)) / 1e9);
+		}
+		fputc('\n', stderr);
+	}
+}
+
+
+// the reporting thread, which is the only one that takes SIGUSR1 (the others block it)
+int report_stats_thread_func(void *thread_param) {
+	sigset_t set;
+	struct timespec interval = { .tv_sec = stats_interval, .tv_nsec = 0 };
+	(void) thread_param;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	while (1) {
+		int sig = stats_interval > 0 ? sigtimedwait(&set, NULL, &interval) : sigwaitinfo(&set, NULL);
+		if (sig == -1 && errno != EAGAIN) { // EINTR
+			continue;
+		}
+		print_stats("progress");
+	}
+	return 0;
+}
+
+
+void start_stats_reporting() {
+	sigset_t set;
+	thrd_t report_thread;
+	thread_stats = aligned_alloc(CACHE_LINE_SIZE, num_threads * sizeof(struct thread_stats));
+	if (thread_stats == NULL) {
+		print_error_message_and_exit("Failed to allocate the stats");
+	}
+	memset(thread_stats, 0, num_threads * sizeof(struct thread_stats));
+	start_ns = now_ns();
+	// blocked before any other thread is created, so they all inherit the mask and SIGUSR1 can only be taken by sigwait
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if (thrd_create(&report_thread, report_stats_thread_func, NULL) != thrd_success) {
+		print_error_message_and_exit("There has been an error while creating a thread");
+	}
+	thrd_detach(report_thread);
+}
+
+
+void write_all(const char* data, size_t len) {
+	while (len > 0) {
+		ssize_t written = write(STDOUT_FILENO, data, len);
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			print_error_message_and_exit("Failed to write the results");
+		}
+		data += written;
+		len -= written;
+	}
+}
+
+
+void flush_output(struct output_buffer* output_buffer) {
+	lock_and_count_wait(&output_lock);
+	write_all(output_buffer->data, output_buffer->len);
+	mtx_unlock(&output_lock);
+	output_buffer->len = 0;
+}
+
+
+// make room for len more characters in a buffer, by writing it out (or by growing it if the output is sorted or the line is huge)
+void reserve_output(struct output_buffer* output_buffer, size_t len) {
+	if (output_buffer->len + len <= output_buffer->size) {
+		return;
+	}
+	if (!is_output_sorted) {
+		flush_output(output_buffer);
+	}
+	if (output_buffer->len + len > output_buffer->size) {
+		size_t new_size = output_buffer->size == 0 ? OUTPUT_BUFFER_SIZE : output_buffer->size;
+		while (new_size < output_buffer->len + len) {
+			new_size *= 2;
+		}
+		output_buffer->data = realloc(output_buffer->data, new_size);
+		if (output_buffer->data == NULL) {
+			print_error_message_and_exit("Failed to allocate the output buffer");
+		}
+		output_buffer->size = new_size;
+	}
+}
+
+
+// record a match which was just appended to the buffer of the thread, so it can be sorted at exit
+void add_output_record(struct output_buffer* output_buffer, size_t offset, size_t len) {
+	size_t num_records = output_buffer->files_found; // including this match, which was already counted
+	if (num_records > output_buffer->records_size) {
+		output_buffer->records_size = output_buffer->records_size == 0 ? OUTPUT_BUFFER_SIZE / 64 : 2 * output_buffer->records_size;
+		output_buffer->records = realloc(output_buffer->records, output_buffer->records_size * sizeof(struct output_record));
+		if (output_buffer->records == NULL) {
+			print_error_message_and_exit("Failed to allocate memory");
+		}
+	}
+	output_buffer->records[num_records - 1] = (struct output_record) { .offset = offset, .len = len };
+}
+
+
+// a match to sort, pointing into the buffer of its thread
+struct sorted_match {
+	const char* path;
+	size_t len;
+};
+
+// like strcmp, but the paths aren't terminated
+int compare_paths(const void* a, const void* b) {
+	const struct sorted_match* match_a = a;
+	const struct sorted_match* match_b = b;
+	int result = memcmp(match_a->path, match_b->path, match_a->len < match_b->len ? match_a->len : match_b->len);
+	if (result != 0) {
+		return result;
+	}
+	return (match_a->len > match_b->len) - (match_a->len < match_b->len);
+}
+
+
+// gather the recorded matches of all the threads, sort them and write them through a single buffer
+void write_sorted_output() {
+	size_t num_matches = 0;
+	for (int i = 0; i < num_threads; i++) {
+		num_matches += output_buffers[i].files_found;
+	}
+	struct sorted_match* matches = malloc(num_matches * sizeof(struct sorted_match) + 1); // "+1" so an empty result isn't mistaken for a failure
+	struct output_buffer sorted_output = { .data = NULL, .len = 0, .size = 0 };
+	if (matches == NULL) {
+		print_error_message_and_exit("Failed to allocate memory");
+	}
+	num_matches = 0;
+	for (int i = 0; i < num_threads; i++) {
+		for (long j = 0; j < output_buffers[i].files_found; j++) {
+			struct output_record* record = &output_buffers[i].records[j];
+			matches[num_matches++] = (struct sorted_match) { .path = output_buffers[i].data + record->offset, .len = record->len };
+		}
+	}
+	qsort(matches, num_matches, sizeof(struct sorted_match), compare_paths);
+	for (size_t i = 0; i < num_matches; i++) {
+		size_t len = matches[i].len;
+		reserve_output(&sorted_output, len + 1);
+		memcpy(sorted_output.data + sorted_output.len, matches[i].path, len);
+		sorted_output.data[sorted_output.len + len] = output_separator;
+		sorted_output.len += len + 1;
+		if (sorted_output.len >= OUTPUT_BUFFER_SIZE) {
+			flush_output(&sorted_output);
+		}
+	}
+	flush_output(&sorted_output);
+	free(sorted_output.data);
+	free(matches);
+}
+
+
+// called once the search is over (or every thread has exited), so no thread writes to its buffer anymore
+void exit_from_program() {
+	long files_found = 0;
+	if (is_output_sorted) {
+		write_sorted_output();
+	}
+	for (int i = 0; i < num_threads; i++) {
+		if (!is_output_sorted) {
+			flush_output(&output_buffers[i]);
+		}
+		files_found += output_buffers[i].files_found;
+	}
+	if (thread_stats != NULL) {
+		print_stats("done");
+	}
+	printf("Done searching, found %ld %s\n", files_found, content_term != NULL ? "matches" : "files");
+	// if there are less searching threads than in the beginning, it means that there was an error
+	exit(num_threads != num_remaining_threads); // this is "exit" and not "thrd_exit" on purpose
+}
+
+
+void wake_up_idle_threads() {
+	lock_and_count_wait(&idle_lock);
+	cnd_broadcast(&idle_cv);
+	mtx_unlock(&idle_lock);
+}
+
+
+// called once a directory taken from a deque has been searched (or abandoned); the thread finishing the last directory ends the search
+void finish_searching_dir() {
+	if (atomic_fetch_sub(&pending_dirs, 1) == 1) {
+		wake_up_idle_threads();
+		if (index_path == NULL) { // with an index, the main thread goes on once the threads have exited
+			exit_from_program();
+		}
+	}
+}
+
+
+// the errors which make a thread exit happen while it searches a directory, which the other threads won't wait for.
+// the directories in the deque of the thread are left there for the other threads to steal
+void print_error_message_and_exit_thread(const char* s) {
+	print_error_message(s);
+	if (--num_remaining_threads == 0) { // if there are no threads, we need to exit totally
+		exit_from_program();
+	}
+	finish_searching_dir();
+	thrd_exit(1);
+}
+
+
+// not a match, so it's written right away rather than buffered (or sorted) with the matches
+void print_permission_denied(char* path) {
+	lock_and_count_wait(&output_lock);
+	dprintf(STDOUT_FILENO, "Directory %s: Permission denied.\n", path);
+	mtx_unlock(&output_lock);
+}
+
+
+void* arena_alloc(struct arena* arena, size_t size) {
+	size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+	if ((size_t) (arena->end - arena->next) < size) { // the rest of the current chunk is abandoned
+		size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		arena->next = malloc(chunk_size);
+		if (arena->next == NULL) {
+			print_error_message_and_exit("Failed to allocate memory");
+		}
+		arena->end = arena->next + chunk_size;
+	}
+	void* p = arena->next;
+	arena->next += size;
+	return p;
+}
+
+
+struct dir_node* create_dir_node(struct arena* arena, struct dir_node* parent, char* name) {
+	size_t name_len = strlen(name);
+	struct dir_node* dir = arena_alloc(arena, sizeof(struct dir_node) + name_len + 1);
+	dir->parent = parent;
+	dir->path_len = parent == NULL ? name_len : parent->path_len + 1 + name_len; // "+1" for the "/" character
+	dir->name_len = name_len;
+	dir->old_index_dir = INDEX_NONE;
+	dir->record = NULL;
+	dir->content_chunk = NULL;
+	memcpy(dir->name, name, name_len + 1);
+	return dir;
+}
+
+
+// write the path of a directory, from its name back to the root, into a buffer of at least path_len + 1 characters
+void write_dir_path(struct dir_node* dir, char* dest) {
+	char* end = dest + dir->path_len;
+	*end = '\0';
+	for (; dir != NULL; dir = dir->parent) {
+		end -= dir->name_len;
+		memcpy(end, dir->name, dir->name_len);
+		if (dir->parent != NULL) {
+			*--end = '/';
+		}
+	}
+}
+
+
+// the path of a directory in the path buffer of the thread, which is valid until the next call
+char* get_dir_path(struct dir_node* dir) {
+	if (path_buffer_size < dir->path_len + 1) {
+		size_t new_size = path_buffer_size == 0 ? 4096 : path_buffer_size;
+		while (new_size < dir->path_len + 1) {
+			new_size *= 2;
+		}
+		path_buffer = realloc(path_buffer, new_size);
+		if (path_buffer == NULL) {
+			print_error_message_and_exit("Failed to allocate memory");
+		}
+		path_buffer_size = new_size;
+	}
+	write_dir_path(dir, path_buffer);
+	return path_buffer;
+}
+
+
+struct work_array* work_array_create(long size, struct work_array* retired) {
+	struct work_array* work_array = malloc(sizeof(struct work_array) + size * sizeof(_Atomic(struct dir_node*)));
+	if (work_array == NULL) {
+		print_error_message_and_exit("Failed to allocate a work deque");
+	}
+	work_array->size = size;
+	work_array->retired = retired;
+	return work_array;
+}
+
+
+void work_deque_init(struct work_deque* work_deque) {
+	atomic_init(&work_deque->top, 0);
+	atomic_init(&work_deque->bottom, 0);
+	atomic_init(&work_deque->array, work_array_create(WORK_DEQUE_INITIAL_SIZE, NULL));
+}
+
+
+// double the array of a full deque; only the owner calls it, and thieves keep reading the old array safely since it isn't freed
+struct work_array* work_deque_grow(struct work_deque* work_deque, struct work_array* work_array, long top, long bottom) {
+	struct work_array* new_work_array = work_array_create(2 * work_array->size, work_array);
+	for (long i = top; i < bottom; i++) {
+		atomic_store_explicit(&new_work_array->items[i & (new_work_array->size - 1)], atomic_load_explicit(&work_array->items[i & (work_array->size - 1)], memory_order_relaxed), memory_order_relaxed);
+	}
+	atomic_store_explicit(&work_deque->array, new_work_array, memory_order_release);
+	return new_work_array;
+}
+
+
+// push a directory to the bottom of the deque; only its owner may call it
+void work_deque_push(struct work_deque* work_deque, struct dir_node* dir) {
+	long bottom = atomic_load_explicit(&work_deque->bottom, memory_order_relaxed);
+	long top = atomic_load_explicit(&work_deque->top, memory_order_acquire);
+	struct work_array* work_array = atomic_load_explicit(&work_deque->array, memory_order_relaxed);
+	if (bottom - top > work_array->size - 1) { // the deque is full
+		work_array = work_deque_grow(work_deque, work_array, top, bottom);
+	}
+	atomic_store_explicit(&work_array->items[bottom & (work_array->size - 1)], dir, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&work_deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+
+// pop the newest directory from the bottom of the deque, or NULL if it's empty; only its owner may call it
+struct dir_node* work_deque_pop(struct work_deque* work_deque) {
+	struct dir_node* dir = NULL;
+	long bottom = atomic_load_explicit(&work_deque->bottom, memory_order_relaxed) - 1;
+	struct work_array* work_array = atomic_load_explicit(&work_deque->array, memory_order_relaxed);
+	atomic_store_explicit(&work_deque->bottom, bottom, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst); // the thieves must see the reserved slot before we read top
+	long top = atomic_load_explicit(&work_deque->top, memory_order_relaxed);
+	if (top <= bottom) {
+		dir = atomic_load_explicit(&work_array->items[bottom & (work_array->size - 1)], memory_order_relaxed);
+		if (top == bottom) { // the last directory in the deque, which a thief may be stealing right now
+			if (!atomic_compare_exchange_strong_explicit(&work_deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+				dir = NULL; // the thief won
+			}
+			atomic_store_explicit(&work_deque->bottom, bottom + 1, memory_order_relaxed);
+		}
+	} else { // the deque is empty
+		atomic_store_explicit(&work_deque->bottom, bottom + 1, memory_order_relaxed);
+	}
+	return dir;
+}
+
+
+// steal the oldest directory from the top of another thread's deque, or NULL if it's empty (or another thief took it first)
+struct dir_node* work_deque_steal(struct work_deque* work_deque) {
+	long top = atomic_load_explicit(&work_deque->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long bottom = atomic_load_explicit(&work_deque->bottom, memory_order_acquire);
+	if (top >= bottom) {
+		return NULL;
+	}
+	struct work_array* work_array = atomic_load_explicit(&work_deque->array, memory_order_acquire);
+	struct dir_node* dir = atomic_load_explicit(&work_array->items[top & (work_array->size - 1)], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&work_deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+		return NULL;
+	}
+	return dir;
+}
+
+
+int is_work_deque_empty(struct work_deque* work_deque) {
+	return atomic_load(&work_deque->top) >= atomic_load(&work_deque->bottom);
+}
+
+
+int is_there_work_to_steal() {
+	for (int i = 0; i < num_threads; i++) {
+		if (!is_work_deque_empty(&work_deques[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+// push the subdirectories found in a directory to the deque of the searching thread, and wake up idle threads to steal them
+void work_deque_push_batch(struct work_deque* work_deque, struct dir_node** dirs, int n) {
+	atomic_fetch_add(&pending_dirs, n); // before the directories can be taken, so pending_dirs never drops to 0 while they wait
+	for (int i = 0; i < n; i++) {
+		work_deque_push(work_deque, dirs[i]);
+	}
+	if (own_stats != NULL) {
+		long depth = atomic_load_explicit(&work_deque->bottom, memory_order_relaxed) - atomic_load_explicit(&work_deque->top, memory_order_relaxed);
+		if (depth > atomic_load_explicit(&own_stats->max_deque_depth, memory_order_relaxed)) {
+			atomic_store_explicit(&own_stats->max_deque_depth, depth, memory_order_relaxed);
+		}
+	}
+	atomic_thread_fence(memory_order_seq_cst); // pairs with the increment of num_idle_threads in wait_for_work, so no wake up is lost
+	if (atomic_load(&num_idle_threads) > 0) {
+		wake_up_idle_threads();
+	}
+}
+
+
+// try to steal a directory from each of the other threads, starting at a random one so the thieves spread over the victims
+struct dir_node* steal_dir(int thread_index, unsigned int* seed) {
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	int first_victim = *seed % num_threads;
+	for (int i = 0; i < num_threads; i++) {
+		int victim = (first_victim + i) % num_threads;
+		if (victim == thread_index) {
+			continue;
+		}
+		struct dir_node* dir = work_deque_steal(&work_deques[victim]);
+		if (dir != NULL) {
+			return dir;
+		}
+	}
+	return NULL;
+}
+
+
+// sleep until there may be a directory to steal; returns immediately if there already is one
+void wait_for_work() {
+	long idle_start_ns = own_stats != NULL ? now_ns() : 0;
+	lock_and_count_wait(&idle_lock);
+	atomic_fetch_add(&num_idle_threads, 1);
+	while (!is_there_work_to_steal() && atomic_load(&pending_dirs) != 0) {
+		cnd_wait(&idle_cv, &idle_lock);
+	}
+	atomic_fetch_sub(&num_idle_threads, 1);
+	mtx_unlock(&idle_lock);
+	ADD_STAT(idle_ns, own_stats != NULL ? now_ns() - idle_start_ns : 0);
+}
+
+
+// open a directory by a path relative to another one (or to the working directory with AT_FDCWD).
+// searching doesn't need to update the access times of the directories, which would turn every search into writes.
+// O_NOATIME is allowed only to the owner of the directory, so others open it the usual way
+int open_dir(int parent_fd, char* dir_path, int flags) {
+	int dir_fd = openat(parent_fd, dir_path, O_RDONLY | O_DIRECTORY | O_NOATIME | O_CLOEXEC | flags);
+	if (dir_fd == -1 && errno == EPERM) {
+		dir_fd = openat(parent_fd, dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | flags);
+	}
+	return dir_fd;
+}
+
+
+// the cached fd of a directory, or -1
+int lookup_dirfd(struct dir_node* dir) {
+	for (int i = 0; i < DIRFD_CACHE_SIZE; i++) {
+		if (dirfd_cache[i].dir == dir) {
+			dirfd_cache[i].last_use = ++dirfd_cache_clock;
+			return dirfd_cache[i].fd;
+		}
+	}
+	return -1;
+}
+
+
+// keep the fd of a directory open for its subdirectories, in place of the least recently used one
+void cache_dirfd(struct dir_node* dir, int fd) {
+	int victim = 0;
+	for (int i = 1; i < DIRFD_CACHE_SIZE; i++) {
+		if (dirfd_cache[i].last_use < dirfd_cache[victim].last_use) {
+			victim = i;
+		}
+	}
+	if (dirfd_cache[victim].dir != NULL && close(dirfd_cache[victim].fd) == -1) {
+		print_error_message_and_exit_thread("Failed to close a directory");
+	}
+	dirfd_cache[victim].dir = dir;
+	dirfd_cache[victim].fd = fd;
+	dirfd_cache[victim].last_use = ++dirfd_cache_clock;
+}
+
+
+int is_out_of_fds() {
+	return errno == EMFILE || errno == ENFILE;
+}
+
+
+void clear_dirfd_cache() {
+	for (int i = 0; i < DIRFD_CACHE_SIZE; i++) {
+		if (dirfd_cache[i].dir != NULL) {
+			close(dirfd_cache[i].fd);
+			dirfd_cache[i].dir = NULL;
+			dirfd_cache[i].last_use = 0;
+		}
+	}
+}
+
+
+// the cached fds of all the threads may be what used up the limit, so ours are closed right away and the others' as they read on
+void evict_dirfd_caches() {
+	atomic_store(&is_dirfd_cache_disabled, 1);
+	clear_dirfd_cache();
+}
+
+
+/* open a directory relative to its parent if the thread has the parent open, and by its full path otherwise.
+a symlink to a directory isn't opened relative to its parent (O_NOFOLLOW fails on it, with ENOTDIR because of O_DIRECTORY) but by its
+full path, which grows on every round of a symlink cycle, so the kernel ends the cycle with ELOOP or ENAMETOOLONG */
+int open_dir_node(struct dir_node* dir, char* dir_path) {
+	int parent_fd = dir->parent != NULL ? lookup_dirfd(dir->parent) : -1;
+	int dir_fd = parent_fd != -1 ? open_dir(parent_fd, dir->name, O_NOFOLLOW) : open_dir(AT_FDCWD, dir_path, 0);
+	if (dir_fd == -1 && parent_fd != -1 && (errno == ENOTDIR || errno == ELOOP)) {
+		dir_fd = open_dir(AT_FDCWD, dir_path, 0);
+	}
+	if (dir_fd == -1 && is_out_of_fds()) {
+		evict_dirfd_caches();
+		dir_fd = open_dir(AT_FDCWD, dir_path, 0);
+	}
+	return dir_fd;
+}
+
+
+// a directory is done with once it's read, unless some of its subdirectories were pushed (most likely to our own deque)
+void release_dir_fd(struct dir_node* dir, int dir_fd, int has_subdirs) {
+	if (atomic_load_explicit(&is_dirfd_cache_disabled, memory_order_relaxed)) {
+		clear_dirfd_cache();
+		has_subdirs = 0;
+	}
+	if (has_subdirs) {
+		cache_dirfd(dir, dir_fd);
+	} else if (close(dir_fd) == -1) {
+		print_error_message_and_exit_thread("Failed to close a directory");
+	}
+}
+
+
+// a directory is searchable iff we can open it
+int is_searchable_dir(char* dir_path) {
+	int dir_fd = open_dir(AT_FDCWD, dir_path, 0);
+	if (dir_fd == -1) {
+		return 0;
+	}
+	if (close(dir_fd) == -1) {
+		return 0;
+	}
+	return 1;
+}
+
+
+void wait_for_all_threads_to_be_created() {
+	mtx_lock(&start_threads_mutex);
+	while (!start_threads_flag) { // if the main thread marks that all the searching threads are already created, this thread doesn't need to wait
+		cnd_wait(&start_threads_cv, &start_threads_mutex);
+	}
+	mtx_unlock(&start_threads_mutex);
+}
+
+
+void notify_all_threads_are_created() {
+	mtx_lock(&start_threads_mutex);
+	start_threads_flag = 1; // mark that all the threads are created, so that searching threads which didn't go to sleep know that they can continue freely
+	cnd_broadcast(&start_threads_cv); // signal the searching threads to start searching (after all of them are created)
+	mtx_unlock(&start_threads_mutex);
+}
+
+
+unsigned char fold_case(unsigned char c) {
+	return (ignore_case && c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+
+int is_literal_at(const char* s, const char* literal, size_t len) {
+	if (!ignore_case) {
+		return memcmp(s, literal, len) == 0;
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (fold_case(s[i]) != (unsigned char) literal[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+#ifdef __SSE2__
+// the positions in a block of 16 bytes which hold c (in either case if ignore_case)
+__m128i match_byte(__m128i block, unsigned char c) {
+	__m128i eq = _mm_cmpeq_epi8(block, _mm_set1_epi8(c));
+	if (ignore_case && c >= 'a' && c <= 'z') {
+		eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, _mm_set1_epi8(c - ('a' - 'A'))));
+	}
+	return eq;
+}
+#endif
+
+
+// look for a literal 16 positions at a time: a position is a candidate only if both the first and the last byte of the literal
+// are where they should be, which filters out almost all of them before the literal is compared
+const char* find_literal(const char* s, size_t s_len, const char* literal, size_t len) {
+	size_t i = 0;
+	if (len == 0) {
+		return s;
+	}
+	if (s_len < len) {
+		return NULL;
+	}
+#ifdef __SSE2__
+	unsigned char first = literal[0], last = literal[len - 1];
+	for (; i + len - 1 + 16 <= s_len; i += 16) {
+		__m128i first_block = _mm_loadu_si128((const __m128i*) (s + i));
+		__m128i last_block = _mm_loadu_si128((const __m128i*) (s + i + len - 1));
+		unsigned int candidates = _mm_movemask_epi8(_mm_and_si128(match_byte(first_block, first), match_byte(last_block, last)));
+		while (candidates != 0) {
+			if (is_literal_at(s + i + __builtin_ctz(candidates), literal, len)) {
+				return s + i + __builtin_ctz(candidates);
+			}
+			candidates &= candidates - 1;
+		}
+	}
+#endif
+	for (; i + len <= s_len; i++) {
+		if (is_literal_at(s + i, literal, len)) {
+			return s + i;
+		}
+	}
+	return NULL;
+}
+
+
+int contains_any_literal(const char* name, size_t name_len) {
+	unsigned int state = 0;
+	if (search_plan.is_accepting[0]) { // an empty term
+		return 1;
+	}
+	for (size_t i = 0; i < name_len; i++) {
+		state = search_plan.transitions[state * 256 + fold_case(name[i])];
+		if (search_plan.is_accepting[state]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+int is_match(const char* name) {
+	size_t name_len = strlen(name);
+	if (search_plan.literal != NULL) {
+		return find_literal(name, name_len, search_plan.literal, search_plan.literal_len) != NULL;
+	}
+	if (search_plan.transitions != NULL) {
+		return contains_any_literal(name, name_len);
+	}
+	return regexec(&search_plan.regex, name, 0, NULL, 0) == 0;
+}
+
+
+// a copy of a term, folded to lower case if ignore_case
+char* compile_literal(char* term) {
+	char* literal = strdup(term);
+	if (literal == NULL) {
+		print_error_message_and_exit("Failed to allocate memory");
+	}
+	for (char* c = literal; *c != '\0'; c++) {
+		*c = fold_case(*c);
+	}
+	return literal;
+}
+
+
+// build the trie of the terms, then turn it into an automaton whose every state has a transition for every byte,
+// by following the failure links (the longest proper suffix of a state which is also in the trie) in breadth-first order
+void compile_literals() {
+	size_t max_states = 1;
+	for (int i = 0; i < num_search_terms; i++) {
+		max_states += strlen(search_terms[i]);
+	}
+	unsigned int* transitions = calloc(max_states * 256, sizeof(unsigned int)); // 0 (the root) is also "no transition" in the trie
+	unsigned int* failures = calloc(max_states, sizeof(unsigned int));
+	unsigned int* queue = malloc(max_states * sizeof(unsigned int));
+	unsigned char* is_accepting = calloc(max_states, sizeof(unsigned char));
+	if (transitions == NULL || failures == NULL || queue == NULL || is_accepting == NULL) {
+		print_error_message_and_exit("Failed to allocate memory");
+	}
+	unsigned int num_states = 1;
+	for (int i = 0; i < num_search_terms; i++) {
+		unsigned int state = 0;
+		for (char* c = search_terms[i]; *c != '\0'; c++) {
+			unsigned int* next = &transitions[state * 256 + fold_case(*c)];
+			if (*next == 0) {
+				*next = num_states++;
+			}
+			state = *next;
+		}
+		is_accepting[state] = 1;
+	}
+	size_t head = 0, tail = 0;
+	for (int c = 0; c < 256; c++) {
+		if (transitions[c] != 0) {
+			queue[tail++] = transitions[c]; // the failure of the states of depth 1 is the root
+		}
+	}
+	while (head < tail) {
+		unsigned int state = queue[head++];
+		is_accepting[state] |= is_accepting[failures[state]]; // a state also ends the terms which are suffixes of it
+		for (int c = 0; c < 256; c++) {
+			unsigned int* next = &transitions[state * 256 + c];
+			if (*next != 0) {
+				failures[*next] = transitions[failures[state] * 256 + c];
+				queue[tail++] = *next;
+			} else {
+				*next = transitions[failures[state] * 256 + c];
+			}
+		}
+	}
+	free(failures);
+	free(queue);
+	search_plan.transitions = transitions;
+	search_plan.is_accepting = is_accepting;
+}
+
+
+// the closing ']' of a bracket expression of a shell pattern (whose first character may be ']'), or NULL if it isn't closed
+const char* find_bracket_end(const char* bracket) {
+	const char* c = bracket + 1;
+	if (*c == '!') {
+		c++;
+	}
+	if (*c == '\0') {
+		return NULL;
+	}
+	return strchr(c + 1, ']');
+}
+
+
+// translate a shell pattern into an extended regular expression which matches whole names
+char* glob_to_regex(const char* glob) {
+	char* regex = malloc(2 * strlen(glob) + 3); // every character takes at most 2, and "^" and "$" are added
+	if (regex == NULL) {
+		print_error_message_and_exit("Failed to allocate memory");
+	}
+	char* out = regex;
+	*out++ = '^';
+	for (const char* c = glob; *c != '\0'; c++) {
+		if (*c == '*') {
+			*out++ = '.';
+			*out++ = '*';
+		} else if (*c == '?') {
+			*out++ = '.';
+		} else if (*c == '[' && find_bracket_end(c) != NULL) {
+			const char* end = find_bracket_end(c);
+			*out++ = *c++;
+			if (*c == '!') {
+				*out++ = '^';
+				c++;
+			}
+			while (c < end) {
+				*out++ = *c++;
+			}
+			*out++ = ']';
+		} else {
+			if (*c == '\\' && c[1] != '\0') {
+				c++;
+			}
+			if (strchr(".[]()|{}+^$*?\\", *c) != NULL) {
+				*out++ = '\\';
+			}
+			*out++ = *c;
+		}
+	}
+	*out++ = '$';
+	*out = '\0';
+	return regex;
+}
+
+
+void compile_regex(regex_t* regex, const char* pattern, const char* term) {
+	int error = regcomp(regex, pattern, REG_EXTENDED | REG_NOSUB | (ignore_case ? REG_ICASE : 0));
+	if (error != 0) {
+		char message[256];
+		regerror(error, regex, message, sizeof(message));
+		fprintf(stderr, "Invalid search term '%s': %s\n", term, message);
+		exit(1);
+	}
+}
+
+
+// every term is checked on its own first, so an error is reported for the term that has it (and a term like "a)|(b" can't
+// change the meaning of its neighbours), and then all of them are compiled into one expression which checks a name in a single pass
+void compile_regexes() {
+	size_t len = 0;
+	char** patterns = malloc(num_search_terms * sizeof(char*));
+	if (patterns == NULL) {
+		print_error_message_and_exit("Failed to allocate memory");
+	}
+	for (int i = 0; i < num_search_terms; i++) {
+		regex_t regex;
+		patterns[i] = match_mode == MATCH_GLOB ? glob_to_regex(search_terms[i]) : search_terms[i];
+		compile_regex(&regex, patterns[i], search_terms[i]);
+		regfree(&regex);
+		len += strlen(patterns[i]) + 3; // "(", ")" and "|"
+	}
+	char* joined = malloc(len + 1);
+	if (joined == NULL) {
+		print_error_message_and_exit("Failed to allocate memory");
+	}
+	char* out = joined;
+	for (int i = 0; i < num_search_terms; i++) {
+		out += sprintf(out, "%s(%s)", i == 0 ? "" : "|", patterns[i]);
+		if (match_mode == MATCH_GLOB) {
+			free(patterns[i]);
+		}
+	}
+	compile_regex(&search_plan.regex, joined, joined);
+	free(joined);
+	free(patterns);
+}
+
+
+void compile_search_plan() {
+	if (match_mode != MATCH_SUBSTRING) {
+		compile_regexes();
+	} else if (num_search_terms == 1) {
+		search_plan.literal = compile_literal(search_terms[0]);
+		search_plan.literal_len = strlen(search_plan.literal);
+	} else {
+		compile_literals();
+	}
+}
+
+
+void print_usage_and_exit(char* program) {
+	fprintf(stderr, "usage: %s [-u] [-i] [-g | -e] [-t search_term]... [-f terms_file] [-0] [-s] [-x index_file] [-T types] [-S size_range] [-M age_range] [-C age_range] [-U owner] [-P mode] [-c content] [-v] [-p seconds] root_dir search_term num_threads\n", program);
+	exit(1);
+}
+
+
+void add_search_term(char* term) {
+	search_terms = realloc(search_terms, (num_search_terms + 1) * sizeof(char*));
+	if (search_terms == NULL) {
+		print_error_message_and_exit("Failed to allocate memory");
+	}
+	search_terms[num_search_terms++] = term;
+}
+
+
+// a file of search terms, one per line
+void add_search_terms_from_file(char* path) {
+	FILE* file = fopen(path, "r");
+	char* line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	if (file == NULL) {
+		print_error_message_and_exit("Failed to open the search terms file");
+	}
+	while ((len = getline(&line, &size, file)) != -1) {
+		if (len > 0 && line[len - 1] == '\n') {
+			line[--len] = '\0';
+		}
+		if (len > 0) {
+			add_search_term(strdup(line));
+		}
+	}
+	free(line);
+	fclose(file);
+}
+
+
+// for the errors in the arguments themselves, which have no errno to describe them
+void print_argument_error_and_exit(const char* s) {
+	fprintf(stderr, "%s\n", s);
+	exit(1);
+}
+
+
+// a number with an optional unit, which is one of the characters of units and multiplies it by the matching multiplier
+unsigned long long parse_quantity(char* s, char** end, const char* units, const unsigned long long* multipliers) {
+	char* unit;
+	errno = 0;
+	unsigned long long value = strtoull(s, end, 10);
+	if (*end == s || errno != 0) {
+		print_argument_error_and_exit("Invalid predicate value");
+	}
+	if (**end != '\0' && **end != ':' && (unit = strchr(units, **end)) != NULL) {
+		unsigned long long multiplier = multipliers[unit - units];
+		if (value > ULLONG_MAX / multiplier) { // rather than wrapping around to a small bound
+			print_argument_error_and_exit("Predicate value out of range");
+		}
+		value *= multiplier;
+		(*end)++;
+	}
+	return value;
+}
+
+
+// a range "min:max" in which either bound may be omitted, or a single value meaning exactly that
+void parse_range(char* arg, const char* units, const unsigned long long* multipliers, unsigned long long* min, unsigned long long* max) {
+	char* end = arg;
+	*min = 0;
+	*max = ULLONG_MAX;
+	if (*arg != ':') {
+		*min = parse_quantity(arg, &end, units, multipliers);
+		if (*end == '\0') {
+			*max = *min;
+			return;
+		}
+	}
+	if (*end != ':') {
+		print_argument_error_and_exit("Invalid predicate range");
+	}
+	end++;
+	if (*end != '\0') {
+		*max = parse_quantity(end, &end, units, multipliers);
+	}
+	if (*end != '\0') {
+		print_argument_error_and_exit("Invalid predicate range");
+	}
+}
+
+
+void parse_size_range(char* arg) {
+	static const unsigned long long multipliers[] = { 1ULL << 10, 1ULL << 20, 1ULL << 30, 1ULL << 40 };
+	parse_range(arg, "kMGT", multipliers, &predicates.min_size, &predicates.max_size);
+	predicates.statx_mask |= STATX_SIZE;
+}
+
+
+// a range of ages (such as ":2h", modified in the last two hours), turned into a range of times
+void parse_age_range(char* arg, long long* min_time, long long* max_time) {
+	static const unsigned long long multipliers[] = { 1, 60, 60 * 60, 24 * 60 * 60 };
+	unsigned long long min_age, max_age;
+	long long now = time(NULL);
+	parse_range(arg, "smhd", multipliers, &min_age, &max_age);
+	*min_time = max_age > (unsigned long long) now ? LLONG_MIN : now - (long long) max_age;
+	*max_time = min_age > (unsigned long long) now ? LLONG_MIN : now - (long long) min_age;
+}
+
+
+void parse_types(char* arg) {
+	for (char* c = arg; *c != '\0'; c++) {
+		switch (*c) {
+		case 'f':
+			predicates.types |= 1u << DT_REG;
+			break;
+		case 'l':
+			predicates.types |= 1u << DT_LNK;
+			break;
+		case 'p':
+			predicates.types |= 1u << DT_FIFO;
+			break;
+		case 's':
+			predicates.types |= 1u << DT_SOCK;
+			break;
+		case 'c':
+			predicates.types |= 1u << DT_CHR;
+			break;
+		case 'b':
+			predicates.types |= 1u << DT_BLK;
+			break;
+		default:
+			print_argument_error_and_exit("The types must be some of 'f', 'l', 'p', 's', 'c' and 'b'");
+		}
+	}
+}
+
+
+void parse_owner(char* arg) {
+	char* end;
+	struct passwd* passwd = getpwnam(arg);
+	if (passwd != NULL) {
+		predicates.uid = passwd->pw_uid;
+	} else {
+		errno = 0;
+		predicates.uid = strtoul(arg, &end, 10);
+		if (*arg == '\0' || *end != '\0' || errno != 0) {
+			print_argument_error_and_exit("The owner must be a user name or id");
+		}
+	}
+	predicates.statx_mask |= STATX_UID;
+}
+
+
+void parse_mode(char* arg) {
+	char* end;
+	errno = 0;
+	predicates.mode = strtoul(arg, &end, 8);
+	if (*arg == '\0' || *end != '\0' || errno != 0 || predicates.mode > 07777) {
+		print_argument_error_and_exit("The permission bits must be an octal mode");
+	}
+	predicates.statx_mask |= STATX_MODE;
+}
+
+
+// the options come before the 3 positional arguments:
+// -u searches with the io_uring engine, or with the threaded one if io_uring isn't available
+// -i ignores case, -g and -e take the search terms as globs or regexes, and -t and -f add search terms to the positional one
+// -0 separates the results with null characters rather than newlines, and -s sorts them
+// -x keeps an index of the tree in a file, which later searches of the same root refresh rather than walk the whole tree
+// -T, -S, -M, -C, -U and -P filter the matches by type, size, modification and change age, owner and mode, and -c searches their content
+// -v reports what every thread did at exit and on SIGUSR1, and -p every that many seconds as well
+void validate_and_initialize_arguments(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "uiget:f:0sx:T:S:M:C:U:P:c:vp:")) != -1) {
+		switch (opt) {
+		case 'u':
+			use_uring = 1;
+			break;
+		case 'i':
+			ignore_case = 1;
+			break;
+		case 'g':
+			match_mode = MATCH_GLOB;
+			break;
+		case 'e':
+			match_mode = MATCH_REGEX;
+			break;
+		case 't':
+			add_search_term(optarg);
+			break;
+		case 'f':
+			add_search_terms_from_file(optarg);
+			break;
+		case '0':
+			output_separator = '\0';
+			break;
+		case 's':
+			is_output_sorted = 1;
+			break;
+		case 'x':
+			index_path = optarg;
+			break;
+		case 'T':
+			parse_types(optarg);
+			break;
+		case 'S':
+			parse_size_range(optarg);
+			break;
+		case 'M':
+			parse_age_range(optarg, &predicates.min_mtime, &predicates.max_mtime);
+			predicates.statx_mask |= STATX_MTIME;
+			break;
+		case 'C':
+			parse_age_range(optarg, &predicates.min_ctime, &predicates.max_ctime);
+			predicates.statx_mask |= STATX_CTIME;
+			break;
+		case 'U':
+			parse_owner(optarg);
+			break;
+		case 'P':
+			parse_mode(optarg);
+			break;
+		case 'c':
+			content_term = optarg;
+			break;
+		case 'v':
+			is_stats_enabled = 1;
+			break;
+		case 'p':
+			stats_interval = atoi(optarg);
+			if (stats_interval <= 0) {
+				print_argument_error_and_exit("The progress interval must be a number of seconds greater than 0");
+			}
+			is_stats_enabled = 1;
+			break;
+		default:
+			print_usage_and_exit(argv[0]);
+		}
+	}
+	if (argc - optind != 3) {
+		print_error_message_and_exit("You must pass 3 arguments");
+	}
+	root_dir = argv[optind];
+	if (!is_searchable_dir(root_dir)) {
+		print_error_message_and_exit("The search root directory must be searchable");
+	}
+	add_search_term(argv[optind + 1]);
+	compile_search_plan();
+	if (content_term != NULL) {
+		content_term = compile_literal(content_term);
+		content_term_len = strlen(content_term);
+		if (content_term_len == 0 || content_term_len > MAX_CONTENT_TERM_LEN) {
+			print_argument_error_and_exit("The content term must be between 1 and 65536 characters long");
+		}
+	}
+	num_threads = atoi(argv[optind + 2]);
+	if (num_threads == 0) {
+		print_error_message_and_exit("The number of searching threads must be a valid integet greater that 0");
+	}
+	num_remaining_threads = num_threads;
+}
+
+
+int is_ignored(struct linux_dirent64* dirent) {
+	return strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0;
+}
+
+
+// most filesystems report the type of an entry in d_type, so only symlinks (which are followed, like stat does)
+// and entries of filesystems which don't report types cost a syscall, relative to the directory we already have open
+int is_dir(int dir_fd, struct linux_dirent64* dirent) {
+	struct stat buf;
+	if (dirent->d_type != DT_UNKNOWN && dirent->d_type != DT_LNK) {
+		return dirent->d_type == DT_DIR;
+	}
+	ADD_STAT(stat_calls, 1);
+	if (fstatat(dir_fd, dirent->d_name, &buf, 0) == -1) {
+		if (errno != ENOENT) { // ENOENT means that we have a symlink which is not a directory
+			print_error_message_and_exit_thread("'stat' failed");
+		}
+		return 0;
+	}
+	return S_ISDIR(buf.st_mode);
+}
+
+
+int has_predicates() {
+	return predicates.types != 0 || predicates.statx_mask != 0;
+}
+
+
+// an entry is checked relative to the directory it's in, and d_type may be DT_UNKNOWN if the type isn't known yet
+int matches_predicates(int dir_fd, char* name, unsigned char d_type) {
+	unsigned int mask = predicates.statx_mask;
+	struct statx buf;
+	if (predicates.types != 0) {
+		if (d_type == DT_UNKNOWN) {
+			mask |= STATX_TYPE;
+		} else if (!(predicates.types & (1u << d_type))) {
+			return 0;
+		}
+	}
+	if (mask == 0) {
+		return 1;
+	}
+	ADD_STAT(stat_calls, 1);
+	if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask, &buf) == -1) {
+		return 0; // the entry is gone (or can't be examined), so it can't be shown to satisfy the predicates
+	}
+	if ((mask & STATX_TYPE) && !(predicates.types & (1u << IFTODT(buf.stx_mode)))) {
+		return 0;
+	}
+	if ((mask & STATX_SIZE) && (buf.stx_size < predicates.min_size || buf.stx_size > predicates.max_size)) {
+		return 0;
+	}
+	if ((mask & STATX_MTIME) && (buf.stx_mtime.tv_sec < predicates.min_mtime || buf.stx_mtime.tv_sec > predicates.max_mtime)) {
+		return 0;
+	}
+	if ((mask & STATX_CTIME) && (buf.stx_ctime.tv_sec < predicates.min_ctime || buf.stx_ctime.tv_sec > predicates.max_ctime)) {
+		return 0;
+	}
+	if ((mask & STATX_UID) && buf.stx_uid != predicates.uid) {
+		return 0;
+	}
+	if ((mask & STATX_MODE) && (buf.stx_mode & predicates.mode) != predicates.mode) {
+		return 0;
+	}
+	return 1;
+}
+
+
+// the full path of a match is written straight to the output, from the path of its directory
+// the suffix follows the path of the match, such as the offset of a content match
+void write_match(char* dir_path, char* dirent_name, const char* suffix) {
+	size_t dir_path_len = strlen(dir_path), name_len = strlen(dirent_name), suffix_len = strlen(suffix);
+	size_t line_len = dir_path_len + 1 + name_len + suffix_len + 1; // for the "/" character and the separator
+	char* line;
+	output->files_found++;
+	ADD_STAT(matches, 1);
+	reserve_output(output, line_len);
+	line = output->data + output->len;
+	memcpy(line, dir_path, dir_path_len);
+	line[dir_path_len] = '/';
+	memcpy(line + dir_path_len + 1, dirent_name, name_len);
+	memcpy(line + dir_path_len + 1 + name_len, suffix, suffix_len);
+	line[line_len - 1] = output_separator;
+	if (is_output_sorted) {
+		add_output_record(output, output->len, line_len - 1);
+	}
+	output->len += line_len;
+}
+
+
+// read as much of a range of a file as there is, despite short reads
+ssize_t pread_full(int fd, char* buf, size_t len, off_t offset) {
+	size_t total = 0;
+	while (total < len) {
+		ssize_t num_read = pread(fd, buf + total, len - total, offset + total);
+		if (num_read == -1 && errno == EINTR) {
+			continue;
+		}
+		if (num_read == -1) {
+			return -1;
+		}
+		if (num_read == 0) {
+			break;
+		}
+		total += num_read;
+	}
+	return total;
+}
+
+
+/* report the matches of the content term which start in [start, end) of a file, a buffer at a time. consecutive buffers overlap
+by content_term_len - 1 bytes, so a match which crosses the end of one is found in the next. overlapping matches are all reported */
+void search_file_range(int fd, char* dir_path, char* name, off_t start, off_t end, off_t file_size) {
+	off_t pos = start;
+	char suffix[32];
+	while (pos < end) {
+		size_t len = file_size - pos < CONTENT_BUFFER_SIZE ? file_size - pos : CONTENT_BUFFER_SIZE;
+		ssize_t num_read = pread_full(fd, content_buffer, len, pos);
+		if (num_read < (ssize_t) content_term_len) { // the end of the file (which may have shrunk), or an error reading it
+			return;
+		}
+		off_t num_starts = num_read - content_term_len + 1;
+		if (num_starts > end - pos) {
+			num_starts = end - pos;
+		}
+		const char* window_end = content_buffer + num_starts - 1 + content_term_len;
+		for (const char* match = content_buffer; (match = find_literal(match, window_end - match, content_term, content_term_len)) != NULL; match++) {
+			snprintf(suffix, sizeof(suffix), ":%lld", (long long) (pos + (match - content_buffer)));
+			write_match(dir_path, name, suffix);
+		}
+		pos += num_starts;
+	}
+}
+
+
+// a file we can't read is skipped, but running out of fds isn't a property of the file, so it's reported rather than skipped silently
+int open_file(int dir_fd, char* path) {
+	// non-blocking, so opening a FIFO doesn't wait for a writer before we see that it isn't a regular file
+	int fd = openat(dir_fd, path, O_RDONLY | O_NOATIME | O_CLOEXEC | O_NONBLOCK);
+	if (fd == -1 && errno == EPERM) {
+		fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	}
+	if (fd == -1 && is_out_of_fds()) { // dir_fd is never one of the cached fds, which are of directories already read
+		evict_dirfd_caches();
+		fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	}
+	if (fd == -1 && is_out_of_fds()) {
+		print_error_message("Failed to open a file to search its content");
+	}
+	return fd;
+}
+
+
+void push_content_chunks(struct dir_node* dir, char* name, off_t file_size) {
+	struct dir_node* chunks[ENQUEUE_BATCH_SIZE];
+	int num_chunks = 0;
+	for (off_t start = CONTENT_CHUNK_SIZE; start < file_size; start += CONTENT_CHUNK_SIZE) {
+		struct dir_node* chunk = create_dir_node(&dir_node_arena, dir, name);
+		chunk->content_chunk = arena_alloc(&dir_node_arena, sizeof(struct content_chunk));
+		chunk->content_chunk->start = start;
+		chunk->content_chunk->end = start + CONTENT_CHUNK_SIZE;
+		chunks[num_chunks++] = chunk;
+		if (num_chunks == ENQUEUE_BATCH_SIZE) {
+			work_deque_push_batch(own_work_deque, chunks, num_chunks);
+			num_chunks = 0;
+		}
+	}
+	if (num_chunks > 0) {
+		work_deque_push_batch(own_work_deque, chunks, num_chunks);
+	}
+}
+
+
+// files which can't be read, and entries which aren't regular files, are skipped. dir is NULL if the file can't be split
+void search_file_content(struct dir_node* dir, int dir_fd, char* dir_path, char* name) {
+	struct stat buf;
+	int fd = open_file(dir_fd, name);
+	if (fd == -1) {
+		return;
+	}
+	if (fstat(fd, &buf) == 0 && S_ISREG(buf.st_mode)) {
+		off_t end = buf.st_size;
+		if (dir != NULL && own_work_deque != NULL && buf.st_size > CONTENT_CHUNK_SIZE) {
+			push_content_chunks(dir, name, buf.st_size);
+			end = CONTENT_CHUNK_SIZE;
+		}
+		search_file_range(fd, dir_path, name, 0, end, buf.st_size);
+	}
+	close(fd);
+}
+
+
+// a chunk pushed by search_file_content, which is opened again by its path since it may be searched by another thread
+void search_content_chunk(struct dir_node* chunk) {
+	struct stat buf;
+	char* path = get_dir_path(chunk);
+	int fd = open_file(AT_FDCWD, path);
+	if (fd == -1) {
+		return;
+	}
+	path[chunk->parent->path_len] = '\0'; // the path of the directory of the file
+	if (fstat(fd, &buf) == 0) {
+		search_file_range(fd, path, chunk->name, chunk->content_chunk->start, chunk->content_chunk->end, buf.st_size);
+	}
+	close(fd);
+}
+
+
+void report_if_match(struct dir_node* dir, int dir_fd, char* dir_path, char* dirent_name, unsigned char d_type) {
+	if (!is_match(dirent_name) || !matches_predicates(dir_fd, dirent_name, d_type)) {
+		return;
+	}
+	if (content_term != NULL) {
+		search_file_content(dir, dir_fd, dir_path, dirent_name);
+	} else {
+		write_match(dir_path, dirent_name, "");
+	}
+}
+
+
+void flush_subdir_batch(struct subdir_batch* subdir_batch, struct work_deque* work_deque) {
+	if (subdir_batch->len > 0) {
+		work_deque_push_batch(work_deque, subdir_batch->dirs, subdir_batch->len);
+		subdir_batch->len = 0;
+	}
+}
+
+
+// append a directory to the batch, even if it turns out not to be searchable once it's opened
+void add_subdir(struct subdir_batch* subdir_batch, struct work_deque* work_deque, struct dir_node* subdir) {
+	subdir_batch->dirs[subdir_batch->len++] = subdir;
+	if (subdir_batch->len == ENQUEUE_BATCH_SIZE) {
+		flush_subdir_batch(subdir_batch, work_deque);
+	}
+}
+
+
+void search_in_dir(struct dir_node* dir, struct work_deque* work_deque) {
+	struct subdir_batch subdir_batch = { .len = 0 };
+	long num_read;
+	char* dir_path = get_dir_path(dir);
+	int has_subdirs = 0;
+	int dir_fd = open_dir_node(dir, dir_path); // a directory's permissions are checked only here, when it's searched, rather than when it's found
+	if (dir_fd == -1) {
+		print_permission_denied(dir_path);
+		return;
+	}
+	ADD_STAT(dirs, 1);
+	set_current_dir(dir);
+	while ((num_read = syscall(SYS_getdents64, dir_fd, dirents_buffer, DIRENTS_BUFFER_SIZE)) > 0) {
+		// walk the records of the buffer in place
+		for (long offset = 0; offset < num_read; offset += ((struct linux_dirent64*) (dirents_buffer + offset))->d_reclen) {
+			struct linux_dirent64* dirent = (struct linux_dirent64*) (dirents_buffer + offset);
+			if (is_ignored(dirent)) { // if the name is "." or ".."
+				continue;
+			}
+			ADD_STAT(entries, 1);
+			if (is_dir(dir_fd, dirent)) {
+				add_subdir(&subdir_batch, work_deque, create_dir_node(&dir_node_arena, dir, dirent->d_name));
+				has_subdirs = 1;
+			} else {
+				report_if_match(dir, dir_fd, dir_path, dirent->d_name, dirent->d_type);
+			}
+		}
+	}
+	flush_subdir_batch(&subdir_batch, work_deque);
+	if (num_read == -1) {
+		print_error_message_and_exit_thread("Failed to read a directory");
+	}
+	set_current_dir(NULL);
+	release_dir_fd(dir, dir_fd, has_subdirs);
+}
+
+
+// our own newest directory first, whose parent we've just searched, or else one stolen from another thread
+struct dir_node* get_dir_to_search(int thread_index, struct work_deque* work_deque, unsigned int* seed) {
+	struct dir_node* dir = work_deque_pop(work_deque);
+	if (dir == NULL) {
+		dir = steal_dir(thread_index, seed);
+	}
+	return dir;
+}
+
+
+/* the io_uring engine (-u): rather than blocking on every open and stat, each thread keeps up to URING_MAX_DIRS directories being opened,
+and the stats of their symlinks (and of the entries whose type the filesystem doesn't report), in flight at once.
+io_uring has no operation for reading a directory, so getdents64 is still called synchronously once a directory is open.
+the ring is driven through the raw syscalls, since liburing isn't installed everywhere */
+#define URING_ENTRIES 256
+#define URING_MAX_DIRS 32
+
+enum uring_request_type {
+	URING_OPEN_DIR,
+	URING_STAT_ENTRY,
 };
 
-struct dir_queue_node {
-	struct dir_queue_node* next;
-	char* path;
+// the common start of the requests, whose address is the user_data of their submission
+struct uring_request {
+	enum uring_request_type type;
 };
 
-// insert nodes to tail, extract from head; requires q_lock
-struct thread_queue {
-	struct thread_queue_node* head;
-	struct thread_queue_node* tail;
-	int len;
+struct uring_dir {
+	struct uring_request request;
+	struct dir_node* dir;
+	int fd; // or the negated errno of the open
+	int open_flags;
+	int is_read; // whether all of its entries have been read, so it's finished once its last stat completes
+	int num_pending_stats;
+	char path[]; // written out for the whole search of the directory, since several directories are searched at once
+};
+
+struct uring_stat {
+	struct uring_request request;
+	struct uring_dir* dir;
+	struct statx statx_buf;
+	char name[];
 };
 
-struct thread_queue_node {
-	struct thread_queue_node* next;
-	cnd_t* p_cv;
-}; 
+struct uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int cq_entries;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+	unsigned int num_to_submit;
+	unsigned int num_in_flight; // requests whose completions haven't been reaped yet, kept below cq_entries so no completion is dropped
+};
 
-struct dir_queue* dir_queue;
-struct thread_queue* thread_queue;
+struct uring_thread {
+	struct uring uring;
+	int thread_index;
+	struct work_deque* work_deque;
+	unsigned int seed;
+	struct subdir_batch subdir_batch;
+	int num_dirs; // the directories the thread has taken and not finished yet
+	struct uring_dir* opened_dirs[URING_MAX_DIRS]; // the directories whose open has completed, waiting to be read
+	int num_opened_dirs;
+};
 
 
-void exit_from_program() {
-	printf("Done searching, found %d files\n", files_found);
-	// if there are less searching threads than in the beginning, it means that there was an error
-	exit(num_threads != num_remaining_threads); // this is "exit" and not "thrd_exit" on purpose
+// create a ring, or return -1 if io_uring is unavailable (or too old to open and stat files)
+int uring_create(struct io_uring_params* params) {
+	memset(params, 0, sizeof(struct io_uring_params));
+	int uring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, params);
+	if (uring_fd == -1) {
+		return -1;
+	}
+	size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* probe = calloc(1, probe_size);
+	int is_supported = probe != NULL && syscall(__NR_io_uring_register, uring_fd, IORING_REGISTER_PROBE, probe, 256) == 0
+		&& probe->last_op >= IORING_OP_STATX
+		&& (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) && (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	if (!is_supported) {
+		close(uring_fd);
+		return -1;
+	}
+	return uring_fd;
 }
 
 
-void print_error_message(const char* s) {
-	perror(s);
+int is_uring_available() {
+	struct io_uring_params params;
+	int uring_fd = uring_create(&params);
+	if (uring_fd == -1) {
+		return 0;
+	}
+	close(uring_fd);
+	return 1;
 }
 
 
-void print_error_message_and_exit(const char* s) {
-	print_error_message(s);
-	exit(1);
+int uring_setup(struct uring* uring) {
+	struct io_uring_params params;
+	uring->fd = uring_create(&params);
+	if (uring->fd == -1) {
+		return -1;
+	}
+	size_t sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) { // both rings share a single mapping
+		sq_ring_size = cq_ring_size = sq_ring_size > cq_ring_size ? sq_ring_size : cq_ring_size;
+	}
+	char* sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	char* cq_ring = sq_ring;
+	if (sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+	}
+	uring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+		close(uring->fd); // the mappings which did succeed are left behind, which is harmless
+		return -1;
+	}
+	uring->sq_entries = params.sq_entries;
+	uring->cq_entries = params.cq_entries;
+	uring->sq_head = (unsigned int*) (sq_ring + params.sq_off.head);
+	uring->sq_tail = (unsigned int*) (sq_ring + params.sq_off.tail);
+	uring->sq_mask = (unsigned int*) (sq_ring + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned int*) (sq_ring + params.sq_off.array);
+	uring->cq_head = (unsigned int*) (cq_ring + params.cq_off.head);
+	uring->cq_tail = (unsigned int*) (cq_ring + params.cq_off.tail);
+	uring->cq_mask = (unsigned int*) (cq_ring + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe*) (cq_ring + params.cq_off.cqes);
+	uring->num_to_submit = 0;
+	uring->num_in_flight = 0;
+	return 0;
 }
 
 
-void print_error_message_and_exit_thread(const char* s) {
-	print_error_message(s);
-	if (--num_remaining_threads == 0) { // if there are no threads, we need to exit totally
-		exit_from_program();
+// like print_error_message_and_exit_thread, for a thread which may be in the middle of several directories
+void uring_abandon_thread(struct uring_thread* uring_thread, const char* s) {
+	flush_subdir_batch(&uring_thread->subdir_batch, uring_thread->work_deque);
+	for (int i = 1; i < uring_thread->num_dirs; i++) { // print_error_message_and_exit_thread finishes the last one
+		finish_searching_dir();
 	}
-	thrd_exit(1);
+	print_error_message_and_exit_thread(s);
 }
 
 
-void print_permission_denied(char* path) {
-	printf("Directory %s: Permission denied.\n", path);
+// submit the queued requests, and wait for min_complete completions
+void uring_enter(struct uring_thread* uring_thread, unsigned int min_complete) {
+	struct uring* uring = &uring_thread->uring;
+	int rc;
+	do {
+		rc = syscall(__NR_io_uring_enter, uring->fd, uring->num_to_submit, min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (rc == -1 && errno == EINTR);
+	if (rc == -1) {
+		uring_abandon_thread(uring_thread, "'io_uring_enter' failed");
+	}
+	uring->num_to_submit -= rc;
 }
 
 
-int is_dir_queue_empty() {
-	return dir_queue->len == 0;
+void uring_finish_dir(struct uring_thread* uring_thread, struct uring_dir* uring_dir) {
+	if (uring_dir->fd >= 0 && close(uring_dir->fd) == -1) {
+		uring_abandon_thread(uring_thread, "Failed to close a directory");
+	}
+	free(uring_dir);
+	uring_thread->num_dirs -= 1;
+	flush_subdir_batch(&uring_thread->subdir_batch, uring_thread->work_deque); // before finishing, so pending_dirs can't drop to 0 while the subdirectories wait here
+	finish_searching_dir();
 }
 
 
-void dir_queue_enqueue(char* dir_path) {
-	struct dir_queue_node* new_dir_queue_node = malloc(sizeof(struct dir_queue_node));
-	new_dir_queue_node->next = NULL;
-	new_dir_queue_node->path = dir_path;
-	if (is_dir_queue_empty()) {
-		dir_queue->head = new_dir_queue_node;
+void uring_complete_stat(struct uring_thread* uring_thread, struct uring_stat* uring_stat, int res) {
+	struct uring_dir* uring_dir = uring_stat->dir;
+	if (res < 0 && res != -ENOENT) { // ENOENT means that we have a symlink which is not a directory
+		errno = -res;
+		uring_abandon_thread(uring_thread, "'stat' failed");
+	}
+	if (res == 0 && S_ISDIR(uring_stat->statx_buf.stx_mode)) {
+		add_subdir(&uring_thread->subdir_batch, uring_thread->work_deque, create_dir_node(&dir_node_arena, uring_dir->dir, uring_stat->name));
 	} else {
-		dir_queue->tail->next = new_dir_queue_node;
+		report_if_match(uring_dir->dir, uring_dir->fd, uring_dir->path, uring_stat->name, DT_UNKNOWN); // a symlink, or an entry of unknown type
+	}
+	free(uring_stat);
+	uring_dir->num_pending_stats -= 1;
+	if (uring_dir->is_read && uring_dir->num_pending_stats == 0) {
+		uring_finish_dir(uring_thread, uring_dir);
+	}
+}
+
+
+// handle the completions in the ring. an open directory is only put aside to be read by the main loop, so reaping never nests a directory read
+void uring_reap_completions(struct uring_thread* uring_thread) {
+	struct uring* uring = &uring_thread->uring;
+	unsigned int head = *uring->cq_head;
+	while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe* cqe = &uring->cqes[head & *uring->cq_mask];
+		struct uring_request* request = (struct uring_request*) (uintptr_t) cqe->user_data;
+		int res = cqe->res;
+		head++;
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+		uring->num_in_flight -= 1;
+		if (request->type == URING_OPEN_DIR) {
+			struct uring_dir* uring_dir = (struct uring_dir*) request;
+			uring_dir->fd = res;
+			uring_thread->opened_dirs[uring_thread->num_opened_dirs++] = uring_dir;
+		} else {
+			uring_complete_stat(uring_thread, (struct uring_stat*) request, res);
+		}
 	}
-	dir_queue->tail = new_dir_queue_node;
-	dir_queue->len += 1;
 }
 
 
-char* dir_queue_dequeue() {
-	struct dir_queue_node* dir_queue_head_node = dir_queue->head;
-	dir_queue->head = dir_queue_head_node->next;
-	char* dir_path = dir_queue_head_node->path;
-	free(dir_queue_head_node);
-	dir_queue->len -= 1;
-	return dir_path;
+void uring_wait(struct uring_thread* uring_thread) {
+	uring_enter(uring_thread, 1);
+	uring_reap_completions(uring_thread);
 }
 
 
-char* dir_queue_remove(int i) {
-	if (i >= dir_queue->len) {
-		return NULL;
-	}
-	if (i == 0) {
-		return dir_queue_dequeue();
+// a zeroed submission queue entry, to be filled and then queued by uring_queue_sqe
+struct io_uring_sqe* uring_get_sqe(struct uring_thread* uring_thread) {
+	struct uring* uring = &uring_thread->uring;
+	while (uring->num_in_flight >= uring->cq_entries) {
+		uring_wait(uring_thread);
 	}
-	struct dir_queue_node* dir_queue_node = dir_queue->head;
-	for (int j = 0; j < i - 1; j++) { // arrive at the node right before the node to remove, so we can easily do the pointers' stuff
-		dir_queue_node = dir_queue_node->next;
+	while (uring->num_to_submit == uring->sq_entries) {
+		uring_enter(uring_thread, 0);
 	}
-	struct dir_queue_node* dir_queue_node_i = dir_queue_node->next;
-	dir_queue_node->next = dir_queue_node_i->next;
-	if (i == dir_queue->len - 1) { // if the node to remove is the tail
-		dir_queue->tail = dir_queue_node;
-	}
-	char* dir_path = dir_queue_node_i->path;
-	free(dir_queue_node_i);
-	dir_queue->len -= 1;
-	return dir_path;
+	unsigned int index = *uring->sq_tail & *uring->sq_mask;
+	struct io_uring_sqe* sqe = &uring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	uring->sq_array[index] = index;
+	return sqe;
 }
 
 
-int is_thread_queue_empty() {
-	return thread_queue->len == 0;
+void uring_queue_sqe(struct uring* uring) {
+	__atomic_store_n(uring->sq_tail, *uring->sq_tail + 1, __ATOMIC_RELEASE);
+	uring->num_to_submit += 1;
+	uring->num_in_flight += 1;
 }
 
 
-void thread_queue_enqueue(cnd_t* p_cv) {
-	struct thread_queue_node* new_thread_queue_node = malloc(sizeof(struct thread_queue_node));
-	new_thread_queue_node->p_cv = p_cv;
-	if (is_thread_queue_empty()) {
-		thread_queue->head = new_thread_queue_node;
-		thread_queue->tail = new_thread_queue_node;
-	} else {
-		thread_queue->tail->next = new_thread_queue_node;
-		thread_queue->tail = new_thread_queue_node;
+void uring_submit_open(struct uring_thread* uring_thread, struct uring_dir* uring_dir) {
+	struct io_uring_sqe* sqe = uring_get_sqe(uring_thread);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t) uring_dir->path;
+	sqe->open_flags = uring_dir->open_flags;
+	sqe->user_data = (uintptr_t) uring_dir;
+	uring_queue_sqe(&uring_thread->uring);
+}
+
+
+// stat an entry relative to its directory, following symlinks like is_dir does
+void uring_submit_stat(struct uring_thread* uring_thread, struct uring_dir* uring_dir, char* name) {
+	struct uring_stat* uring_stat = malloc(sizeof(struct uring_stat) + strlen(name) + 1);
+	if (uring_stat == NULL) {
+		uring_abandon_thread(uring_thread, "Failed to allocate a stat request");
 	}
-	thread_queue->len += 1;
+	uring_stat->request.type = URING_STAT_ENTRY;
+	uring_stat->dir = uring_dir;
+	strcpy(uring_stat->name, name); // the getdents buffer is overwritten before the stat completes
+	uring_dir->num_pending_stats += 1;
+	ADD_STAT(stat_calls, 1);
+	struct io_uring_sqe* sqe = uring_get_sqe(uring_thread);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = uring_dir->fd;
+	sqe->addr = (uintptr_t) uring_stat->name;
+	sqe->len = STATX_TYPE;
+	sqe->off = (uintptr_t) &uring_stat->statx_buf;
+	sqe->statx_flags = 0;
+	sqe->user_data = (uintptr_t) uring_stat;
+	uring_queue_sqe(&uring_thread->uring);
 }
 
 
-cnd_t* thread_queue_dequeue() {
-	struct thread_queue_node* thread_queue_head_node = thread_queue->head;
-	thread_queue->head = thread_queue_head_node->next;
-	cnd_t* p_cv = thread_queue_head_node->p_cv;
-	free(thread_queue_head_node);
-	thread_queue->len -= 1;
-	num_threads_waiting_to_lock += 1;
-	return p_cv;
+void uring_start_dir(struct uring_thread* uring_thread, struct dir_node* dir) {
+	uring_thread->num_dirs += 1; // counted from when it's taken from a deque, so abandoning the thread finishes it too
+	struct uring_dir* uring_dir = malloc(sizeof(struct uring_dir) + dir->path_len + 1);
+	if (uring_dir == NULL) {
+		uring_abandon_thread(uring_thread, "Failed to allocate an open request");
+	}
+	uring_dir->request.type = URING_OPEN_DIR;
+	uring_dir->dir = dir;
+	write_dir_path(dir, uring_dir->path);
+	uring_dir->fd = -1;
+	uring_dir->open_flags = O_RDONLY | O_DIRECTORY | O_NOATIME | O_CLOEXEC;
+	uring_dir->is_read = 0;
+	uring_dir->num_pending_stats = 0;
+	uring_submit_open(uring_thread, uring_dir);
 }
 
 
-// a directory is searchable iff we can open it
-int is_searchable_dir(char* dir_path) {
-	DIR* dir = opendir(dir_path);
-	if (dir == NULL) {
-		return 0;
+// read a directory whose open has completed; the entries whose type isn't known are stat-ed asynchronously
+void uring_read_dir(struct uring_thread* uring_thread, struct uring_dir* uring_dir) {
+	long num_read;
+	if (uring_dir->fd < 0) {
+		if (uring_dir->fd == -EPERM && (uring_dir->open_flags & O_NOATIME)) { // O_NOATIME is allowed only to the owner of the directory
+			uring_dir->open_flags &= ~O_NOATIME;
+			uring_submit_open(uring_thread, uring_dir);
+			return;
+		}
+		print_permission_denied(uring_dir->path);
+		uring_finish_dir(uring_thread, uring_dir);
+		return;
 	}
-	if (closedir(dir) == -1) {
-		return 0;
+	ADD_STAT(dirs, 1);
+	set_current_dir(uring_dir->dir);
+	while ((num_read = syscall(SYS_getdents64, uring_dir->fd, dirents_buffer, DIRENTS_BUFFER_SIZE)) > 0) {
+		for (long offset = 0; offset < num_read; offset += ((struct linux_dirent64*) (dirents_buffer + offset))->d_reclen) {
+			struct linux_dirent64* dirent = (struct linux_dirent64*) (dirents_buffer + offset);
+			if (is_ignored(dirent)) { // if the name is "." or ".."
+				continue;
+			}
+			ADD_STAT(entries, 1);
+			if (dirent->d_type == DT_UNKNOWN || dirent->d_type == DT_LNK) {
+				uring_submit_stat(uring_thread, uring_dir, dirent->d_name);
+			} else if (dirent->d_type == DT_DIR) {
+				add_subdir(&uring_thread->subdir_batch, uring_thread->work_deque, create_dir_node(&dir_node_arena, uring_dir->dir, dirent->d_name));
+			} else {
+				report_if_match(uring_dir->dir, uring_dir->fd, uring_dir->path, dirent->d_name, dirent->d_type);
+			}
+		}
+	}
+	if (num_read == -1) {
+		uring_abandon_thread(uring_thread, "Failed to read a directory");
+	}
+	set_current_dir(NULL);
+	uring_dir->is_read = 1;
+	if (uring_dir->num_pending_stats == 0) {
+		uring_finish_dir(uring_thread, uring_dir);
 	}
-	return 1;
 }
 
 
-void wait_for_all_threads_to_be_created() {
-	mtx_lock(&start_threads_mutex);
-	while (!start_threads_flag) { // if the main thread marks that all the searching threads are already created, this thread doesn't need to wait
-		cnd_wait(&start_threads_cv, &start_threads_mutex);
+void uring_search(struct uring_thread* uring_thread) {
+	while (1) { // the thread finishing the last directory exits the program
+		while (uring_thread->num_dirs < URING_MAX_DIRS) {
+			struct dir_node* dir = get_dir_to_search(uring_thread->thread_index, uring_thread->work_deque, &uring_thread->seed);
+			if (dir == NULL) {
+				break;
+			}
+			if (dir->content_chunk != NULL) { // searched right away, since the ring isn't used for reading files
+				search_content_chunk(dir);
+				finish_searching_dir();
+				continue;
+			}
+			uring_start_dir(uring_thread, dir);
+		}
+		if (uring_thread->num_opened_dirs > 0) {
+			uring_read_dir(uring_thread, uring_thread->opened_dirs[--uring_thread->num_opened_dirs]);
+			continue;
+		}
+		if (uring_thread->num_dirs == 0) {
+			wait_for_work();
+			continue;
+		}
+		flush_subdir_batch(&uring_thread->subdir_batch, uring_thread->work_deque); // let the other threads steal the subdirectories while we wait
+		uring_wait(uring_thread);
 	}
-	mtx_unlock(&start_threads_mutex);
 }
 
 
-void notify_all_threads_are_created() {
-	mtx_lock(&start_threads_mutex);
-	start_threads_flag = 1; // mark that all the threads are created, so that searching threads which didn't go to sleep know that they can continue freely
-	cnd_broadcast(&start_threads_cv); // signal the searching threads to start searching (after all of them are created)
-	mtx_unlock(&start_threads_mutex);
+/* the index (-x) is a file holding the tree under root_dir: every entry with its name and the directory containing it, and every
+directory with the range of its entries (which are contiguous and sorted by name) and its times as of when it was read.
+a search with an index first refreshes it with the threads walking the tree as usual, except that a directory whose times are unchanged
+costs a single stat, since its entries are taken from the previous index (which is mapped to memory) instead of being read again.
+then the new index is saved, and the names are matched by the threads scanning its directories in parallel.
+a directory's mtime and ctime change whenever an entry is added, removed or renamed in it (or its permissions change), but not when
+an entry of its subdirectories changes, so every directory is still checked. a symlink which is replaced in place is missed until
+its directory changes */
+#define INDEX_MAGIC "pfindidx"
+#define INDEX_VERSION 1
+#define INDEX_SCAN_CHUNK 64 // the scanning threads take this many directories at a time
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_entries;
+	uint32_t num_dirs;
+	uint32_t padding;
+	uint64_t names_size;
+	// followed by num_entries struct index_entry, num_dirs struct index_dir, and the names
+};
+
+struct index_entry {
+	uint64_t name; // the offset of its null-terminated name in the names (the name of the root entry is root_dir)
+	uint32_t parent; // the entry of the directory containing it, or INDEX_NONE for the root
+	uint32_t dir; // its directory if it's one, or INDEX_NONE
+};
+
+struct index_dir {
+	uint32_t entry;
+	uint32_t first_child; // the entries in the directory are first_child, ..., first_child + num_children - 1
+	uint32_t num_children;
+	uint32_t is_unreadable;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+};
+
+struct index {
+	uint32_t num_entries;
+	uint32_t num_dirs;
+	struct index_entry* entries;
+	struct index_dir* dirs;
+	char* names;
+	size_t names_size;
+};
+
+struct index old_index; // mapped from the file, or empty
+atomic_uint next_index_dir_to_scan = 0;
+
+// an entry found while refreshing the index. its name is in the previous index if the directory is unchanged, or in an arena otherwise
+struct dir_record_entry {
+	char* name;
+	struct dir_node* dir; // NULL if it isn't a directory
+};
+
+struct dir_record {
+	struct dir_record_entry* entries;
+	uint32_t num_entries;
+	int is_unreadable;
+	struct timespec mtime;
+	struct timespec ctime;
+};
+
+thread_local struct dir_record_entry* scanned_entries; // the entries of the directory the thread is reading
+thread_local size_t scanned_entries_size;
+
+
+/* whether every reference in an index stays inside it: the names are null-terminated within the names, the entries and directories
+reference each other both ways, and the entries of every directory are its children. a directory then has a single entry with
+a single parent, so the directories reachable from the root form a tree */
+int is_index_consistent(struct index* index) {
+	if (index->num_entries == 0 || index->names_size == 0 || index->names[index->names_size - 1] != '\0') {
+		return 0;
+	}
+	for (uint32_t i = 0; i < index->num_entries; i++) {
+		struct index_entry* entry = &index->entries[i];
+		if (entry->name >= index->names_size || (entry->parent != INDEX_NONE && entry->parent >= index->num_entries) ||
+			(entry->dir != INDEX_NONE && (entry->dir >= index->num_dirs || index->dirs[entry->dir].entry != i))) {
+			return 0;
+		}
+	}
+	for (uint32_t i = 0; i < index->num_dirs; i++) {
+		struct index_dir* dir = &index->dirs[i];
+		if (dir->entry >= index->num_entries || index->entries[dir->entry].dir != i ||
+			(uint64_t) dir->first_child + dir->num_children > index->num_entries) {
+			return 0;
+		}
+		for (uint32_t j = 0; j < dir->num_children; j++) {
+			if (index->entries[dir->first_child + j].parent != dir->entry) {
+				return 0;
+			}
+		}
+	}
+	return index->entries[0].parent == INDEX_NONE && index->entries[0].dir == 0;
 }
 
 
-void validate_and_initialize_arguments(int argc, char *argv[]) {
-	if (argc != 4) {
-		print_error_message_and_exit("You must pass 3 arguments");
+// map the previous index, if there is one for the same root; any index which isn't usable is just ignored and rebuilt
+void load_old_index() {
+	struct stat buf;
+	struct index_header* header;
+	int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return;
 	}
-	root_dir = argv[1];
-	if (!is_searchable_dir(root_dir)) {
-		print_error_message_and_exit("The search root directory must be searchable");
+	if (fstat(fd, &buf) == -1 || (size_t) buf.st_size < sizeof(struct index_header)) {
+		close(fd);
+		return;
 	}
-	search_term = argv[2];
-	num_threads = atoi(argv[3]);
-	if (num_threads == 0) {
-		print_error_message_and_exit("The number of searching threads must be a valid integet greater that 0");
+	header = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		return;
+	}
+	// computed in 64 bits, and without adding names_size (which comes from the file), so that no sum can wrap around to the file size
+	uint64_t tables_size = sizeof(struct index_header) + (uint64_t) header->num_entries * sizeof(struct index_entry) + (uint64_t) header->num_dirs * sizeof(struct index_dir);
+	if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != INDEX_VERSION || header->num_dirs == 0 ||
+		tables_size > (uint64_t) buf.st_size || header->names_size != (uint64_t) buf.st_size - tables_size) {
+		munmap(header, buf.st_size);
+		return;
+	}
+	old_index.num_entries = header->num_entries;
+	old_index.num_dirs = header->num_dirs;
+	old_index.entries = (struct index_entry*) (header + 1);
+	old_index.dirs = (struct index_dir*) (old_index.entries + old_index.num_entries);
+	old_index.names = (char*) (old_index.dirs + old_index.num_dirs);
+	old_index.names_size = header->names_size;
+	if (!is_index_consistent(&old_index) || strcmp(old_index.names + old_index.entries[0].name, root_dir) != 0) { // a corrupted index, or one of another tree
+		munmap(header, buf.st_size);
+		memset(&old_index, 0, sizeof(old_index));
 	}
-	num_remaining_threads = num_threads;
 }
 
 
-int is_ignored(struct dirent* dirent) {
-	return strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0;
+// the directory in the previous index with this name in a directory of the previous index, or INDEX_NONE
+uint32_t find_old_index_subdir(uint32_t old_dir, char* name) {
+	if (old_dir == INDEX_NONE) {
+		return INDEX_NONE;
+	}
+	struct index_dir* dir = &old_index.dirs[old_dir];
+	uint32_t low = dir->first_child, high = dir->first_child + dir->num_children;
+	while (low < high) { // binary search in the entries of the directory, which are sorted by name
+		uint32_t middle = low + (high - low) / 2;
+		int cmp = strcmp(old_index.names + old_index.entries[middle].name, name);
+		if (cmp == 0) {
+			return old_index.entries[middle].dir;
+		}
+		if (cmp < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return INDEX_NONE;
 }
 
 
-int is_dir(char* dir_path) {
-	struct stat buf;
-	if (stat(dir_path, &buf) == -1) {
-		if (errno != 2) { // if errno equals 2 it means that we have a symlink which is not a directory
-			print_error_message_and_exit_thread("'stat' failed");
+void add_scanned_entry(uint32_t num_entries, char* name, struct dir_node* dir) {
+	if (num_entries == scanned_entries_size) {
+		scanned_entries_size = scanned_entries_size == 0 ? 1024 : 2 * scanned_entries_size;
+		scanned_entries = realloc(scanned_entries, scanned_entries_size * sizeof(struct dir_record_entry));
+		if (scanned_entries == NULL) {
+			print_error_message_and_exit("Failed to allocate memory");
+		}
+	}
+	scanned_entries[num_entries].name = name;
+	scanned_entries[num_entries].dir = dir;
+}
+
+
+// take the entries of an unchanged directory from the previous index, and push its subdirectories to be checked in turn
+void reuse_old_index_dir(struct dir_node* dir, struct dir_record* record, struct work_deque* work_deque) {
+	struct subdir_batch subdir_batch = { .len = 0 };
+	struct index_dir* old_dir = &old_index.dirs[dir->old_index_dir];
+	record->num_entries = old_dir->num_children;
+	record->entries = arena_alloc(&dir_node_arena, record->num_entries * sizeof(struct dir_record_entry));
+	for (uint32_t i = 0; i < old_dir->num_children; i++) {
+		struct index_entry* old_entry = &old_index.entries[old_dir->first_child + i];
+		record->entries[i].name = old_index.names + old_entry->name;
+		record->entries[i].dir = NULL;
+		if (old_entry->dir != INDEX_NONE) {
+			struct dir_node* subdir = create_dir_node(&dir_node_arena, dir, record->entries[i].name);
+			subdir->old_index_dir = old_entry->dir;
+			record->entries[i].dir = subdir;
+			add_subdir(&subdir_batch, work_deque, subdir);
+		}
+	}
+	flush_subdir_batch(&subdir_batch, work_deque);
+}
+
+
+// read a new or changed directory like search_in_dir does, keeping its entries rather than matching them
+// returns whether the directory has subdirectories
+int read_dir_into_record(struct dir_node* dir, int dir_fd, struct dir_record* record, struct work_deque* work_deque) {
+	struct subdir_batch subdir_batch = { .len = 0 };
+	uint32_t num_entries = 0;
+	int has_subdirs = 0;
+	long num_read;
+	while ((num_read = syscall(SYS_getdents64, dir_fd, dirents_buffer, DIRENTS_BUFFER_SIZE)) > 0) {
+		for (long offset = 0; offset < num_read; offset += ((struct linux_dirent64*) (dirents_buffer + offset))->d_reclen) {
+			struct linux_dirent64* dirent = (struct linux_dirent64*) (dirents_buffer + offset);
+			struct dir_node* subdir = NULL;
+			char* name;
+			if (is_ignored(dirent)) {
+				continue;
+			}
+			ADD_STAT(entries, 1);
+			if (is_dir(dir_fd, dirent)) {
+				subdir = create_dir_node(&dir_node_arena, dir, dirent->d_name);
+				subdir->old_index_dir = find_old_index_subdir(dir->old_index_dir, dirent->d_name);
+				name = subdir->name;
+				add_subdir(&subdir_batch, work_deque, subdir);
+				has_subdirs = 1;
+			} else {
+				size_t name_len = strlen(dirent->d_name);
+				name = arena_alloc(&dir_node_arena, name_len + 1);
+				memcpy(name, dirent->d_name, name_len + 1);
+			}
+			add_scanned_entry(num_entries++, name, subdir);
 		}
+	}
+	flush_subdir_batch(&subdir_batch, work_deque);
+	if (num_read == -1) {
+		print_error_message_and_exit_thread("Failed to read a directory");
+	}
+	record->num_entries = num_entries;
+	record->entries = arena_alloc(&dir_node_arena, num_entries * sizeof(struct dir_record_entry));
+	memcpy(record->entries, scanned_entries, num_entries * sizeof(struct dir_record_entry));
+	return has_subdirs;
+}
+
+
+int is_old_index_dir_unchanged(struct dir_node* dir, struct stat* buf) {
+	if (dir->old_index_dir == INDEX_NONE) {
 		return 0;
 	}
-	return S_ISDIR(buf.st_mode);
+	struct index_dir* old_dir = &old_index.dirs[dir->old_index_dir];
+	return !old_dir->is_unreadable && old_dir->mtime_sec == buf->st_mtim.tv_sec && old_dir->mtime_nsec == buf->st_mtim.tv_nsec &&
+		old_dir->ctime_sec == buf->st_ctim.tv_sec && old_dir->ctime_nsec == buf->st_ctim.tv_nsec;
 }
 
 
-void search_in_dir(char* dir_path) {
-	char* new_path;
-	char* dirent_name;
-	int is_dir_new_path;
-	DIR* dir = opendir(dir_path);
-	if (dir == NULL) {
-		print_permission_denied(dir_path);
+void index_dir(struct dir_node* dir, struct work_deque* work_deque) {
+	struct dir_record* record = arena_alloc(&dir_node_arena, sizeof(struct dir_record));
+	struct stat buf;
+	char* dir_path = get_dir_path(dir);
+	record->entries = NULL;
+	record->num_entries = 0;
+	record->is_unreadable = 0;
+	dir->record = record;
+	// the times are taken before the directory is read, so a change made while reading it is seen by the next refresh
+	int parent_fd = dir->parent != NULL ? lookup_dirfd(dir->parent) : -1;
+	if (parent_fd != -1 ? fstatat(parent_fd, dir->name, &buf, 0) == -1 : stat(dir_path, &buf) == -1) {
+		record->is_unreadable = 1;
+		return;
+	}
+	record->mtime = buf.st_mtim;
+	record->ctime = buf.st_ctim;
+	if (is_old_index_dir_unchanged(dir, &buf)) {
+		reuse_old_index_dir(dir, record, work_deque);
+		return;
+	}
+	int dir_fd = open_dir_node(dir, dir_path);
+	if (dir_fd == -1) {
+		record->is_unreadable = 1; // reported when the index is scanned
 		return;
 	}
-	struct dirent* dirent;
-	while ((dirent = readdir(dir)) != NULL) {
-		if (is_ignored(dirent)) { // if the name is "." or ".."
+	ADD_STAT(dirs, 1);
+	set_current_dir(dir);
+	int has_subdirs = read_dir_into_record(dir, dir_fd, record, work_deque);
+	set_current_dir(NULL);
+	release_dir_fd(dir, dir_fd, has_subdirs);
+}
+
+
+int compare_dir_record_entries(const void* a, const void* b) {
+	return strcmp(((const struct dir_record_entry*) a)->name, ((const struct dir_record_entry*) b)->name);
+}
+
+
+void* grow_array(void* array, size_t* size, size_t needed, size_t element_size) {
+	if (needed <= *size) {
+		return array;
+	}
+	while (*size < needed) {
+		*size = *size == 0 ? 4096 : 2 * *size;
+	}
+	array = realloc(array, *size * element_size);
+	if (array == NULL) {
+		print_error_message_and_exit("Failed to allocate memory");
+	}
+	return array;
+}
+
+
+size_t add_index_name(struct index* index, size_t* names_capacity, char* name) {
+	size_t offset = index->names_size;
+	size_t len = strlen(name) + 1;
+	index->names = grow_array(index->names, names_capacity, offset + len, 1);
+	memcpy(index->names + offset, name, len);
+	index->names_size += len;
+	return offset;
+}
+
+
+/* lay the records of the directories out as an index, in breadth-first order so the entries of every directory are contiguous.
+dir_nodes[i] is the directory of entry i, if it's one */
+void build_index(struct index* index, struct dir_node* root) {
+	size_t entries_capacity = 0, dirs_capacity = 0, names_capacity = 0, dir_nodes_capacity = 0;
+	struct dir_node** dir_nodes = NULL;
+	memset(index, 0, sizeof(struct index));
+	index->entries = grow_array(NULL, &entries_capacity, 1, sizeof(struct index_entry));
+	dir_nodes = grow_array(NULL, &dir_nodes_capacity, 1, sizeof(struct dir_node*));
+	index->entries[0].name = add_index_name(index, &names_capacity, root_dir);
+	index->entries[0].parent = INDEX_NONE;
+	dir_nodes[0] = root;
+	index->num_entries = 1;
+	for (uint32_t i = 0; i < index->num_entries; i++) {
+		struct dir_node* dir = dir_nodes[i];
+		if (dir == NULL) {
+			index->entries[i].dir = INDEX_NONE;
 			continue;
 		}
-		dirent_name = dirent->d_name;
-		// construct the path of the current dir entry (using the "base" path and the name of the entry)
-		new_path = calloc(strlen(dir_path) + strlen(dirent_name) + 2, sizeof(char)); // "+2": 1 for the "/" character and 1 for the null terminator 
-		new_path = strcpy(new_path, dir_path);
-		new_path = strcat(new_path, "/");
-		new_path = strcat(new_path, dirent_name);
-		is_dir_new_path = is_dir(new_path);
-		if (is_dir_new_path == 1) { // if the entry is a directory
-			if (!is_searchable_dir(new_path)) { // if it isn't searchable we don't want to insert it to the dir queue
-				print_permission_denied(new_path);
-				free(new_path);
-			} else { // append the directory to the queue beacuse it's a valid one
-				mtx_lock(&q_lock);
-				dir_queue_enqueue(new_path);
-				if (!is_thread_queue_empty()) {
-					cnd_signal(thread_queue_dequeue());	// we need to signal the waiting thread that there is a new directory for searching
+		struct dir_record* record = dir->record;
+		index->dirs = grow_array(index->dirs, &dirs_capacity, index->num_dirs + 1, sizeof(struct index_dir));
+		struct index_dir* index_dir = &index->dirs[index->num_dirs];
+		index->entries[i].dir = index->num_dirs++;
+		memset(index_dir, 0, sizeof(struct index_dir));
+		index_dir->entry = i;
+		index_dir->first_child = index->num_entries;
+		if (record == NULL) { // the thread searching it exited with an error
+			index_dir->is_unreadable = 1;
+			continue;
+		}
+		index_dir->is_unreadable = record->is_unreadable;
+		index_dir->mtime_sec = record->mtime.tv_sec;
+		index_dir->mtime_nsec = record->mtime.tv_nsec;
+		index_dir->ctime_sec = record->ctime.tv_sec;
+		index_dir->ctime_nsec = record->ctime.tv_nsec;
+		index_dir->num_children = record->num_entries;
+		qsort(record->entries, record->num_entries, sizeof(struct dir_record_entry), compare_dir_record_entries);
+		index->entries = grow_array(index->entries, &entries_capacity, index->num_entries + record->num_entries, sizeof(struct index_entry));
+		dir_nodes = grow_array(dir_nodes, &dir_nodes_capacity, index->num_entries + record->num_entries, sizeof(struct dir_node*));
+		for (uint32_t j = 0; j < record->num_entries; j++) {
+			index->entries[index->num_entries].name = add_index_name(index, &names_capacity, record->entries[j].name);
+			index->entries[index->num_entries].parent = i;
+			dir_nodes[index->num_entries++] = record->entries[j].dir;
+		}
+	}
+	free(dir_nodes);
+}
+
+
+// the new index replaces the previous one atomically, so a search which fails midway (or a concurrent one) never sees half an index
+void save_index(struct index* index) {
+	struct index_header header = { .version = INDEX_VERSION, .num_entries = index->num_entries, .num_dirs = index->num_dirs,
+		.names_size = index->names_size };
+	size_t tmp_path_size = strlen(index_path) + 32;
+	char* tmp_path = malloc(tmp_path_size);
+	FILE* file;
+	if (tmp_path == NULL) {
+		print_error_message_and_exit("Failed to allocate memory");
+	}
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	snprintf(tmp_path, tmp_path_size, "%s.%ld.tmp", index_path, (long) getpid());
+	file = fopen(tmp_path, "w");
+	if (file == NULL) {
+		print_error_message_and_exit("Failed to create the index");
+	}
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+		fwrite(index->entries, sizeof(struct index_entry), index->num_entries, file) != index->num_entries ||
+		fwrite(index->dirs, sizeof(struct index_dir), index->num_dirs, file) != index->num_dirs ||
+		fwrite(index->names, 1, index->names_size, file) != index->names_size || fclose(file) != 0) {
+		unlink(tmp_path);
+		print_error_message_and_exit("Failed to write the index");
+	}
+	if (rename(tmp_path, index_path) == -1) {
+		unlink(tmp_path);
+		print_error_message_and_exit("Failed to replace the index");
+	}
+	free(tmp_path);
+}
+
+
+// the path of a directory of an index in the path buffer of the thread, which is valid until the next call
+char* get_index_dir_path(struct index* index, uint32_t entry) {
+	size_t path_len = 0;
+	for (uint32_t e = entry; e != INDEX_NONE; e = index->entries[e].parent) {
+		path_len += strlen(index->names + index->entries[e].name) + (e != entry); // and a "/" after every name but the last
+	}
+	if (path_buffer_size < path_len + 1) {
+		path_buffer = realloc(path_buffer, path_len + 1);
+		if (path_buffer == NULL) {
+			print_error_message_and_exit("Failed to allocate memory");
+		}
+		path_buffer_size = path_len + 1;
+	}
+	char* end = path_buffer + path_len;
+	*end = '\0';
+	for (uint32_t e = entry; e != INDEX_NONE; e = index->entries[e].parent) {
+		char* name = index->names + index->entries[e].name;
+		size_t name_len = strlen(name);
+		if (e != entry) {
+			*--end = '/';
+		}
+		end -= name_len;
+		memcpy(end, name, name_len);
+	}
+	return path_buffer;
+}
+
+
+// match the names in the directories of the index, a chunk of directories at a time
+void scan_index(struct index* index) {
+	uint32_t first;
+	while ((first = atomic_fetch_add(&next_index_dir_to_scan, INDEX_SCAN_CHUNK)) < index->num_dirs) {
+		uint32_t last = first + INDEX_SCAN_CHUNK < index->num_dirs ? first + INDEX_SCAN_CHUNK : index->num_dirs;
+		for (uint32_t d = first; d < last; d++) {
+			struct index_dir* dir = &index->dirs[d];
+			char* dir_path = NULL; // written out only once the directory has a match
+			int dir_fd = -1; // the index has no metadata or contents, so the directory is opened for the predicates and contents of its matches
+			if (dir->is_unreadable) {
+				print_permission_denied(get_index_dir_path(index, dir->entry));
+				continue;
+			}
+			for (uint32_t e = dir->first_child; e < dir->first_child + dir->num_children; e++) {
+				struct index_entry* entry = &index->entries[e];
+				char* name = index->names + entry->name;
+				if (entry->dir != INDEX_NONE || !is_match(name)) {
+					continue;
+				}
+				if (dir_path == NULL) {
+					dir_path = get_index_dir_path(index, dir->entry);
+					if (has_predicates() || content_term != NULL) {
+						dir_fd = open_dir(AT_FDCWD, dir_path, 0);
+					}
+				}
+				if (!matches_predicates(dir_fd, name, DT_UNKNOWN)) {
+					continue;
+				}
+				if (content_term != NULL) {
+					search_file_content(NULL, dir_fd, dir_path, name);
+				} else {
+					write_match(dir_path, name, "");
 				}
-				mtx_unlock(&q_lock);
 			}
-		} else {
-			if (strstr(dirent_name, search_term) != NULL) {
-				files_found++;
-				printf("%s\n", new_path);
+			if (dir_fd != -1 && close(dir_fd) == -1) {
+				print_error_message_and_exit("Failed to close a directory");
 			}
-			free(new_path);
 		}
 	}
-	if (closedir(dir) == -1) {
-		print_error_message_and_exit_thread("Failed to close a directory");
-	}
 }
 
 
-// if there is at least one directory waiting for search or there is at least one busy searching thread, we need to continue the searching
-int are_there_directories_to_search() {
-	return !is_dir_queue_empty() || thread_queue->len + 1 != num_remaining_threads; // thread_queue->len + 1 == num_remaining_threads iff all the remaning threads except this one are idle (in the queue). Also this thread is idle beacuse when it calls this function it doesn't search
+void allocate_content_buffer() {
+	if (content_term != NULL) {
+		content_buffer = malloc(CONTENT_BUFFER_SIZE);
+		if (content_buffer == NULL) {
+			print_error_message_and_exit("Failed to allocate a content buffer");
+		}
+	}
 }
 
 
 int thread_func(void *thread_param) {
+	int thread_index = (int) (intptr_t) thread_param;
+	struct work_deque* work_deque = &work_deques[thread_index];
+	unsigned int seed = thread_index + 1; // the seed of xorshift must not be 0
+	dirents_buffer = malloc(DIRENTS_BUFFER_SIZE);
+	if (dirents_buffer == NULL) {
+		print_error_message_and_exit("Failed to allocate a directory buffer");
+	}
+	output = &output_buffers[thread_index];
+	own_stats = thread_stats != NULL ? &thread_stats[thread_index] : NULL;
+	own_work_deque = work_deque;
+	allocate_content_buffer();
 	wait_for_all_threads_to_be_created(); // wait for all other searching threads to be created and for the main thread to signal that the searching should start
 
-	char* dir_path;
-	cnd_t* p_not_empty_q_and_my_turn_cv = malloc(sizeof(cnd_t)); // the cv of the current thread
-	cnd_init(p_not_empty_q_and_my_turn_cv);
-	while (1) { // we want to continue the searching if we can
-		mtx_lock(&q_lock);
-		if (!are_there_directories_to_search()) {
-			mtx_unlock(&q_lock);
-			break;
+	if (use_uring) {
+		struct uring_thread* uring_thread = malloc(sizeof(struct uring_thread));
+		if (uring_thread != NULL && uring_setup(&uring_thread->uring) == 0) {
+			uring_thread->thread_index = thread_index;
+			uring_thread->work_deque = work_deque;
+			uring_thread->seed = seed;
+			uring_thread->subdir_batch.len = 0;
+			uring_thread->num_dirs = 0;
+			uring_thread->num_opened_dirs = 0;
+			uring_search(uring_thread);
+		}
+		free(uring_thread); // the thread falls back to the threaded engine if it couldn't set up its own ring
+	}
+
+	while (1) { // the thread finishing the last directory exits the program
+		struct dir_node* dir = get_dir_to_search(thread_index, work_deque, &seed);
+		if (dir == NULL) {
+			wait_for_work();
+			continue;
 		}
-		/* in order to satisfy the requirement of not going to sleep when the dir queue isn't "logically" empty,
-		we need to check if there are less directories than threads which waiting for searching
-		(the number of them is equal to the number of threads sleeping waiting in the queue plus
-		the number of threads which are already woke up but didn't manage obtaining the lock yet)
-		If this is indeed the case, we want to sleep. Otherwise, we can "take" a directory from the "middle" of the dir queue,
-		the one that matches to the current thread.
-		*/
-		if (dir_queue->len <= thread_queue->len + num_threads_waiting_to_lock) {
-			thread_queue_enqueue(p_not_empty_q_and_my_turn_cv);
-			cnd_wait(p_not_empty_q_and_my_turn_cv, &q_lock);
-			num_threads_waiting_to_lock -= 1;
-			dir_path = dir_queue_dequeue();
+		if (dir->content_chunk != NULL) {
+			search_content_chunk(dir);
 		} else {
-			dir_path = dir_queue_remove(thread_queue->len + num_threads_waiting_to_lock); // remove the next directory in the queue, the one which is after all the directories that match to the already waiting threads
+			search_in_dir(dir, work_deque);
 		}
-		mtx_unlock(&q_lock);
-		search_in_dir(dir_path);
+		finish_searching_dir();
 	}
-	cnd_destroy(p_not_empty_q_and_my_turn_cv);
-	free(p_not_empty_q_and_my_turn_cv);
+	return 0;
+}
 
-	exit_from_program();
+
+// the threads refresh the index from the tree, rather than search it, and exit once every directory has been checked
+int index_thread_func(void *thread_param) {
+	int thread_index = (int) (intptr_t) thread_param;
+	struct work_deque* work_deque = &work_deques[thread_index];
+	unsigned int seed = thread_index + 1;
+	dirents_buffer = malloc(DIRENTS_BUFFER_SIZE);
+	if (dirents_buffer == NULL) {
+		print_error_message_and_exit("Failed to allocate a directory buffer");
+	}
+	output = &output_buffers[thread_index];
+	own_stats = thread_stats != NULL ? &thread_stats[thread_index] : NULL;
+	wait_for_all_threads_to_be_created();
+
+	while (1) {
+		struct dir_node* dir = get_dir_to_search(thread_index, work_deque, &seed);
+		if (dir == NULL) {
+			if (atomic_load(&pending_dirs) == 0) {
+				break;
+			}
+			wait_for_work();
+			continue;
+		}
+		index_dir(dir, work_deque);
+		finish_searching_dir();
+	}
+	clear_dirfd_cache(); // the threads which scan the index need the fds
+	return 0;
+}
+
+
+struct index new_index;
+
+int scan_index_thread_func(void *thread_param) {
+	output = &output_buffers[(intptr_t) thread_param];
+	own_stats = thread_stats != NULL ? &thread_stats[(intptr_t) thread_param] : NULL;
+	allocate_content_buffer();
+	scan_index(&new_index);
 	return 0;
 }
 
 
+void join_threads(thrd_t* threads) {
+	for (int i = 0; i < num_threads; i++) {
+		thrd_join(threads[i], NULL);
+	}
+}
+
+
+void search_with_index(thrd_t* threads, struct dir_node* root) {
+	for (int i = 0; i < num_threads; i++) {
+		if (thrd_create(&threads[i], index_thread_func, (void*) (intptr_t) i) != thrd_success) {
+			print_error_message_and_exit("There has been an error while creating a thread");
+		}
+	}
+	notify_all_threads_are_created();
+	join_threads(threads);
+	build_index(&new_index, root);
+	if (num_remaining_threads == num_threads) { // a thread which exited left its directories out of the index
+		save_index(&new_index);
+	}
+	for (int i = 0; i < num_threads; i++) {
+		if (thrd_create(&threads[i], scan_index_thread_func, (void*) (intptr_t) i) != thrd_success) {
+			print_error_message_and_exit("There has been an error while creating a thread");
+		}
+	}
+	join_threads(threads);
+	exit_from_program();
+}
+
+
 int main(int argc, char *argv[]) {
 	validate_and_initialize_arguments(argc, argv);
-	// a FIFO queue that holds directories
-	dir_queue = malloc(sizeof(struct dir_queue));
-	dir_queue->head = NULL;
-	dir_queue->tail = NULL;
-	dir_queue->len = 0;
-	// a FIFO queue that holds cv-s of threads to handle the signaling
-	thread_queue = malloc(sizeof(struct dir_queue));
-	thread_queue->head = NULL;
-	thread_queue->tail = NULL;
-	thread_queue->len = 0;
-
-	dir_queue_enqueue(root_dir); // put the seartch root directory in the queue
+	if (use_uring && index_path != NULL) {
+		fprintf(stderr, "The index is refreshed with the threaded engine\n");
+		use_uring = 0;
+	}
+	if (use_uring && !is_uring_available()) {
+		fprintf(stderr, "io_uring is unavailable, searching with the threaded engine\n");
+		use_uring = 0;
+	}
+	work_deques = aligned_alloc(CACHE_LINE_SIZE, num_threads * sizeof(struct work_deque));
+	if (work_deques == NULL) {
+		print_error_message_and_exit("Failed to allocate the work deques");
+	}
+	for (int i = 0; i < num_threads; i++) {
+		work_deque_init(&work_deques[i]);
+	}
+	output_buffers = aligned_alloc(CACHE_LINE_SIZE, num_threads * sizeof(struct output_buffer));
+	if (output_buffers == NULL) {
+		print_error_message_and_exit("Failed to allocate the output buffers");
+	}
+	memset(output_buffers, 0, num_threads * sizeof(struct output_buffer));
+	if (is_stats_enabled) {
+		start_stats_reporting();
+	}
+	struct dir_node* root = create_dir_node(&dir_node_arena, NULL, root_dir);
+	if (index_path != NULL) {
+		load_old_index();
+		if (old_index.num_dirs > 0) {
+			root->old_index_dir = 0; // the root is the first directory of an index
+		}
+	}
+	work_deque_push_batch(&work_deques[0], &root, 1); // put the search root directory in the deque of the first thread, where the others will steal from
 
 	thrd_t* threads = calloc(num_threads, sizeof(thrd_t));
 
 	// initialize mutex and condition variable objects
 	mtx_init(&start_threads_mutex, mtx_plain);
-	mtx_init(&q_lock, mtx_plain);
+	mtx_init(&idle_lock, mtx_plain);
+	mtx_init(&output_lock, mtx_plain);
 	cnd_init(&start_threads_cv);
+	cnd_init(&idle_cv);
 
+	if (index_path != NULL) {
+		search_with_index(threads, root);
+	}
 	for (int i = 0; i < num_threads; i++) {
-		if (thrd_create(&threads[i], thread_func, NULL) != thrd_success) {
+		if (thrd_create(&threads[i], thread_func, (void*) (intptr_t) i) != thrd_success) {
 			print_error_message_and_exit("There has been an error while creating a thread");
 		}
 	}
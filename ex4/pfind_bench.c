@@ -0,0 +1,427 @@
+/* a scaling benchmark of pfind. it generates reproducible synthetic trees of a few shapes (wide, deep, many small directories and a few
+huge ones, all with symlinks and unreadable directories), then runs a pfind binary over each of them with every given thread count,
+and reports entries/sec, the speedup over the first thread count, the syscalls per entry and the context switches of the run.
+the syscalls are counted with the raw_syscalls:sys_enter tracepoint (perf_event_open), so they're shown only if tracefs is mounted
+and perf events are allowed; the context switches (voluntary ones are mostly threads sleeping on pfind's locks and condition
+variables) come from getrusage.
+the trees are generated under /dev/shm by default, so the benchmark measures pfind rather than the disk; -d puts them anywhere else.
+runs after the first of every tree find its entries in the page cache.
+
+build: gcc -O2 pfind_bench.c -o pfind_bench */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+
+#define MAX_LIST_LEN 16
+#define MAX_PATH_LEN 4096
+#define SEARCH_TERM "needle"
+#define MATCH_PERCENT 2 // the share of the files whose names contain the search term
+#define SYSCALL_TRACEPOINT_ID_PATH "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id"
+#define OLD_SYSCALL_TRACEPOINT_ID_PATH "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+
+
+struct int_list {
+	int values[MAX_LIST_LEN];
+	int len;
+};
+
+// the shape of a tree: every directory down to depth has fanout subdirectories and files_per_dir files
+struct tree_shape {
+	const char* name;
+	int depth;
+	int fanout;
+	int files_per_dir;
+};
+
+// the shapes at scale 1; -s multiplies the number of files (and, for the wide shape, the fanout)
+const struct tree_shape shapes[] = {
+	{ "wide", 1, 2000, 10 }, // a single huge level of directories
+	{ "deep", 200, 1, 20 }, // a long chain, which gives the threads nothing to steal from each other
+	{ "small", 6, 5, 3 }, // many small directories
+	{ "huge", 1, 4, 20000 }, // a few directories with a huge number of entries each
+};
+
+#define NUM_SHAPES ((int) (sizeof(shapes) / sizeof(shapes[0])))
+
+// what was generated, which the results of pfind are checked against
+struct tree_stats {
+	long entries;
+	long expected_matches;
+	long dirs;
+};
+
+char* pfind_path = "./pfind";
+char* base_dir = "/dev/shm";
+int scale = 1;
+int repetitions = 3;
+uint64_t seed = 1;
+int keep_trees = 0;
+int uring_flag = 0; // pass -u to pfind
+
+
+void print_error_message(const char* s) {
+	perror(s);
+}
+
+
+void print_error_message_and_exit(const char* s) {
+	print_error_message(s);
+	exit(1);
+}
+
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// xorshift64*, so the same seed always generates the same tree
+uint64_t next_random() {
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545F4914F6CDD1DULL;
+}
+
+
+void create_file(const char* path) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd == -1 || close(fd) == -1) {
+		print_error_message_and_exit("Failed to create a file");
+	}
+}
+
+
+/* fill a directory with files (some of which match), a symlink to one of them, and subdirectories down to the depth of the shape.
+one directory out of every 50 is made unreadable, with a match in it which pfind reports only if it runs as root */
+void generate_dir(char* path, const struct tree_shape* shape, int depth, struct tree_stats* stats) {
+	size_t len = strlen(path);
+	int files_per_dir = shape->files_per_dir * scale;
+	int fanout = shape->fanout * (shape->depth == 1 && shape->fanout > 100 ? scale : 1);
+	stats->dirs += 1;
+	for (int i = 0; i < files_per_dir; i++) {
+		int is_match = next_random() % 100 < MATCH_PERCENT;
+		snprintf(path + len, MAX_PATH_LEN - len, "/f%d_%08llx%s.txt", i, (unsigned long long) (next_random() & 0xffffffff), is_match ? SEARCH_TERM : "");
+		create_file(path);
+		stats->entries += 1;
+		stats->expected_matches += is_match;
+	}
+	if (files_per_dir > 0) { // a symlink to a file is reported like a file
+		snprintf(path + len, MAX_PATH_LEN - len, "/link_" SEARCH_TERM);
+		if (symlink("f0_00000000.txt", path) == -1) { // dangling unless the name happens to exist, and a dangling symlink is still an entry
+			print_error_message_and_exit("Failed to create a symlink");
+		}
+		stats->entries += 1;
+		stats->expected_matches += 1;
+	}
+	if (depth == shape->depth) {
+		path[len] = '\0';
+		return;
+	}
+	for (int i = 0; i < fanout; i++) {
+		snprintf(path + len, MAX_PATH_LEN - len, "/d%d", i);
+		if (mkdir(path, 0755) == -1) {
+			print_error_message_and_exit("Failed to create a directory");
+		}
+		stats->entries += 1;
+		generate_dir(path, shape, depth + 1, stats);
+		if (next_random() % 50 == 0) {
+			size_t sub_len = strlen(path);
+			snprintf(path + sub_len, MAX_PATH_LEN - sub_len, "/locked");
+			if (mkdir(path, 0755) == -1) {
+				print_error_message_and_exit("Failed to create a directory");
+			}
+			snprintf(path + sub_len + strlen("/locked"), MAX_PATH_LEN - sub_len - strlen("/locked"), "/" SEARCH_TERM);
+			create_file(path);
+			path[sub_len + strlen("/locked")] = '\0';
+			if (chmod(path, 0) == -1) {
+				print_error_message_and_exit("Failed to lock a directory");
+			}
+			stats->entries += 2;
+			stats->dirs += 1;
+			stats->expected_matches += geteuid() == 0; // root can read any directory
+			path[sub_len] = '\0';
+		}
+	}
+	path[len] = '\0';
+}
+
+
+int unlock_and_remove(const char* path, const struct stat* buf, int type, struct FTW* ftw) {
+	(void) buf;
+	(void) ftw;
+	if (type == FTW_DNR) { // a locked directory, which was skipped since it couldn't be read
+		chmod(path, 0755);
+		nftw(path, unlock_and_remove, 16, FTW_DEPTH | FTW_PHYS);
+		return 0;
+	}
+	if (remove(path) == -1 && errno != ENOENT) {
+		print_error_message("Failed to remove the tree");
+	}
+	return 0;
+}
+
+
+void remove_tree(const char* path) {
+	// the locked directories are unlocked on the way down, so their contents can be removed before them
+	nftw(path, unlock_and_remove, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+
+// the id of the tracepoint of syscall entries, or -1 if tracefs isn't mounted
+long syscall_tracepoint_id() {
+	const char* paths[] = { SYSCALL_TRACEPOINT_ID_PATH, OLD_SYSCALL_TRACEPOINT_ID_PATH };
+	for (int i = 0; i < 2; i++) {
+		FILE* file = fopen(paths[i], "r");
+		long id;
+		if (file == NULL) {
+			continue;
+		}
+		if (fscanf(file, "%ld", &id) == 1) {
+			fclose(file);
+			return id;
+		}
+		fclose(file);
+	}
+	return -1;
+}
+
+
+// count the syscalls of a process and all of its threads from its exec on, or return -1 if it isn't allowed
+int open_syscall_counter(pid_t pid) {
+	struct perf_event_attr attr;
+	long id = syscall_tracepoint_id();
+	if (id == -1) {
+		return -1;
+	}
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.size = sizeof(attr);
+	attr.config = id;
+	attr.disabled = 1;
+	attr.enable_on_exec = 1;
+	attr.inherit = 1;
+	return syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+
+struct run_result {
+	uint64_t elapsed_ns;
+	long syscalls; // or -1 if they couldn't be counted
+	long context_switches;
+	long matches; // as reported by pfind
+};
+
+
+/* run pfind once with its output to a pipe, of which only the last line ("Done searching, found N files") is kept.
+the child waits on a pipe until the syscall counter is attached, and the counter starts at its exec */
+struct run_result run_pfind(char* root, int num_threads) {
+	struct run_result result = { .syscalls = -1, .matches = -1 };
+	char threads_arg[16];
+	int go_pipe[2], output_pipe[2];
+	snprintf(threads_arg, sizeof(threads_arg), "%d", num_threads);
+	if (pipe2(go_pipe, O_CLOEXEC) == -1 || pipe2(output_pipe, O_CLOEXEC) == -1) {
+		print_error_message_and_exit("Failed to create a pipe");
+	}
+	pid_t pid = fork();
+	if (pid == -1) {
+		print_error_message_and_exit("Failed to fork");
+	}
+	if (pid == 0) {
+		char go;
+		dup2(output_pipe[1], STDOUT_FILENO);
+		if (read(go_pipe[0], &go, 1) != 1) {
+			_exit(1);
+		}
+		if (uring_flag) {
+			execl(pfind_path, pfind_path, "-u", root, SEARCH_TERM, threads_arg, (char*) NULL);
+		} else {
+			execl(pfind_path, pfind_path, root, SEARCH_TERM, threads_arg, (char*) NULL);
+		}
+		print_error_message("Failed to run pfind");
+		_exit(1);
+	}
+	close(go_pipe[0]);
+	close(output_pipe[1]);
+	int counter_fd = open_syscall_counter(pid);
+	uint64_t start_ns = now_ns();
+	if (write(go_pipe[1], "g", 1) != 1) {
+		print_error_message_and_exit("Failed to start pfind");
+	}
+	close(go_pipe[1]);
+
+	char buf[1 << 16], last_line[256] = "";
+	size_t line_len = 0;
+	ssize_t num_read;
+	while ((num_read = read(output_pipe[0], buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < num_read; i++) {
+			if (buf[i] == '\n') {
+				last_line[line_len] = '\0';
+				line_len = 0;
+			} else if (line_len < sizeof(last_line) - 1) {
+				last_line[line_len++] = buf[i];
+			}
+		}
+	}
+	close(output_pipe[0]);
+
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) == -1) {
+		print_error_message_and_exit("Failed to wait for pfind");
+	}
+	result.elapsed_ns = now_ns() - start_ns;
+	result.context_switches = usage.ru_nvcsw + usage.ru_nivcsw;
+	if (counter_fd != -1) {
+		uint64_t count;
+		if (read(counter_fd, &count, sizeof(count)) == sizeof(count)) {
+			result.syscalls = count;
+		}
+		close(counter_fd);
+	}
+	if (sscanf(last_line, "Done searching, found %ld", &result.matches) != 1 || !WIFEXITED(status)) {
+		fprintf(stderr, "pfind failed on %s with %d threads\n", root, num_threads);
+		exit(1);
+	}
+	return result;
+}
+
+
+// the fastest of the repetitions, with its counters
+struct run_result best_run(char* root, int num_threads) {
+	struct run_result best = run_pfind(root, num_threads);
+	for (int i = 1; i < repetitions; i++) {
+		struct run_result result = run_pfind(root, num_threads);
+		if (result.elapsed_ns < best.elapsed_ns) {
+			best = result;
+		}
+	}
+	return best;
+}
+
+
+void run_benchmark(const struct tree_shape* shape, struct int_list* thread_counts) {
+	char root[MAX_PATH_LEN];
+	struct tree_stats stats = { 0 };
+	snprintf(root, sizeof(root), "%s/pfind_bench_%s_%d_%d", base_dir, shape->name, scale, (int) getpid());
+	if (mkdir(root, 0755) == -1) {
+		print_error_message_and_exit("Failed to create the root of a tree");
+	}
+	generate_dir(root, shape, 0, &stats);
+	run_pfind(root, 1); // warm up the page cache and the dentry cache
+
+	uint64_t first_ns = 0;
+	for (int t = 0; t < thread_counts->len; t++) {
+		struct run_result result = best_run(root, thread_counts->values[t]);
+		char syscalls_per_entry[32] = "-";
+		if (t == 0) {
+			first_ns = result.elapsed_ns;
+		}
+		if (result.syscalls != -1) {
+			snprintf(syscalls_per_entry, sizeof(syscalls_per_entry), "%.2f", (double) result.syscalls / stats.entries);
+		}
+		printf("%-6s %9ld %7d %10.2f %14.0f %8.2f %13s %10ld %s\n", shape->name, stats.entries, thread_counts->values[t],
+			result.elapsed_ns / 1e6, stats.entries / (result.elapsed_ns / 1e9), (double) first_ns / result.elapsed_ns,
+			syscalls_per_entry, result.context_switches, result.matches == stats.expected_matches ? "ok" : "WRONG");
+		fflush(stdout);
+	}
+	if (keep_trees) {
+		fprintf(stderr, "kept %s\n", root);
+	} else {
+		remove_tree(root);
+	}
+}
+
+
+void parse_int_list(char* s, struct int_list* list) {
+	list->len = 0;
+	for (char* token = strtok(s, ","); token != NULL; token = strtok(NULL, ",")) {
+		if (list->len == MAX_LIST_LEN) {
+			fprintf(stderr, "At most %d values can be given to an option\n", MAX_LIST_LEN);
+			exit(1);
+		}
+		list->values[list->len] = atoi(token);
+		if (list->values[list->len] <= 0) {
+			fprintf(stderr, "Invalid value '%s'\n", token);
+			exit(1);
+		}
+		list->len += 1;
+	}
+}
+
+
+void print_usage_and_exit(char* program) {
+	fprintf(stderr, "usage: %s [-p pfind_binary] [-d base_dir] [-k shapes,...] [-t threads,...] [-s scale] [-n repetitions] [-r seed] [-u] [-K]\n", program);
+	exit(1);
+}
+
+
+int main(int argc, char* argv[]) {
+	struct int_list thread_counts = { .values = { 1, 2, 4, 8 }, .len = 4 };
+	char* shape_names = NULL; // all the shapes
+	int opt;
+	while ((opt = getopt(argc, argv, "p:d:k:t:s:n:r:uK")) != -1) {
+		switch (opt) {
+		case 'p':
+			pfind_path = optarg;
+			break;
+		case 'd':
+			base_dir = optarg;
+			break;
+		case 'k':
+			shape_names = optarg;
+			break;
+		case 't':
+			parse_int_list(optarg, &thread_counts);
+			break;
+		case 's':
+			scale = atoi(optarg);
+			break;
+		case 'n':
+			repetitions = atoi(optarg);
+			break;
+		case 'r':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'u':
+			uring_flag = 1;
+			break;
+		case 'K':
+			keep_trees = 1;
+			break;
+		default:
+			print_usage_and_exit(argv[0]);
+		}
+	}
+	if (optind != argc || scale <= 0 || repetitions <= 0 || seed == 0) {
+		print_usage_and_exit(argv[0]);
+	}
+	if (access(pfind_path, X_OK) == -1) {
+		print_error_message_and_exit("Can't run the pfind binary");
+	}
+
+	printf("%-6s %9s %7s %10s %14s %8s %13s %10s %s\n", "shape", "entries", "threads", "time_ms", "entries/sec", "speedup", "syscalls/entry", "ctx_sw", "check");
+	for (int i = 0; i < NUM_SHAPES; i++) {
+		if (shape_names == NULL || strstr(shape_names, shapes[i].name) != NULL) {
+			run_benchmark(&shapes[i], &thread_counts);
+		}
+	}
+
+	exit(0); // success
+}
@@ -0,0 +1,98 @@
+#!/bin/sh
+# regression tests of pfind for inputs which once crashed it. each test builds a small tree under a temporary directory,
+# runs the pfind binary (./pfind by default) on it and compares what it printed with what it should have.
+#
+# usage: ./pfind_test.sh [pfind_binary]
+# build: gcc -O2 -pthread pfind.c -o pfind
+
+pfind=${1:-./pfind}
+root=$(mktemp -d) || exit 1
+trap 'rm -rf "$root"' EXIT
+failures=0
+
+pass() {
+	echo "ok   $1"
+}
+
+fail() {
+	echo "FAIL $1"
+	failures=$((failures + 1))
+}
+
+# a name containing the separator is still a single match when the output is sorted
+test_sorted_output_with_separator_in_name() {
+	dir=$root/sorted
+	mkdir -p "$dir/d"
+	touch "$dir/a
+foo" "$dir/foo" "$dir/d/x
+yfoo
+z" "$dir/d/foo2"
+	"$pfind" -s "$dir" foo 2 > "$root/out"
+	status=$?
+	printf '%s\n' "$dir/a
+foo" "$dir/d/foo2" "$dir/d/x
+yfoo
+z" "$dir/foo" "Done searching, found 4 files" > "$root/expected"
+	if [ $status -eq 0 ] && cmp -s "$root/out" "$root/expected"; then
+		pass "sorted output with a separator in a name"
+	else
+		fail "sorted output with a separator in a name (exit status $status)"
+	fi
+}
+
+# write count bytes of 0xff at an offset of a file, in place
+scribble() {
+	printf '\377\377\377\377\377\377\377\377' | dd of="$1" bs=1 seek="$2" count="$3" conv=notrunc 2> /dev/null
+}
+
+# write a 64-bit little-endian value (taken mod 2^64) at an offset of a file, in place
+set_uint64() {
+	value=$3
+	bytes=
+	for i in 1 2 3 4 5 6 7 8; do
+		bytes=$bytes$(printf '\\%03o' $((value & 255)))
+		value=$((value >> 8))
+	done
+	printf "$bytes" | dd of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null
+}
+
+# a corrupted or truncated index (-x) is ignored, and the tree is walked in full as if there were no index
+test_corrupted_index() {
+	dir=$root/indexed
+	mkdir -p "$dir/a/b" "$dir/c"
+	touch "$dir/foo" "$dir/a/foo1" "$dir/a/b/foo2" "$dir/c/bar"
+	"$pfind" -s "$dir" foo 2 > "$root/expected"
+	"$pfind" -x "$root/index" "$dir" foo 2 > /dev/null
+	num_entries=$(od -An -tu4 -j12 -N4 "$root/index" | tr -d ' ')
+	num_dirs=$(od -An -tu4 -j16 -N4 "$root/index" | tr -d ' ')
+	size=$(wc -c < "$root/index")
+	for corruption in truncated name_offset num_children parent num_entries; do
+		cp "$root/index" "$root/corrupted"
+		case $corruption in
+		truncated) truncate -s $((size / 2)) "$root/corrupted" ;;
+		name_offset) scribble "$root/corrupted" 36 4 ;; # the high half of the name offset of the root entry
+		num_children) scribble "$root/corrupted" $((32 + num_entries * 16 + 8)) 4 ;; # of the root directory
+		parent) scribble "$root/corrupted" $((32 + 16 + 8)) 4 ;; # of the second entry
+		num_entries) # the tables then end past the file, and names_size wraps around to make up the difference
+			printf '\100\102\017\000' | dd of="$root/corrupted" bs=1 seek=12 conv=notrunc 2> /dev/null # 1000000
+			set_uint64 "$root/corrupted" 24 $((size - 32 - 1000000 * 16 - num_dirs * 48)) ;;
+		esac
+		"$pfind" -s -x "$root/corrupted" "$dir" foo 2 > "$root/out"
+		status=$?
+		if [ $status -eq 0 ] && cmp -s "$root/out" "$root/expected"; then
+			pass "index with a corrupted $corruption"
+		else
+			fail "index with a corrupted $corruption (exit status $status)"
+		fi
+	done
+}
+
+if [ ! -x "$pfind" ]; then
+	echo "Can't run the pfind binary $pfind" >&2
+	exit 1
+fi
+
+test_sorted_output_with_separator_in_name
+test_corrupted_index
+
+[ $failures -eq 0 ]
@@ -0,0 +1,430 @@
+/* a throughput benchmark of pcc_server. it starts a pcc_server binary, and a sink server of its own which speaks the same protocol but
+only reads the payloads into a large buffer and replies 0, then uploads the same payloads to both of them from every given number of
+concurrent clients. the sink shows how fast loopback moves the bytes at all, so the ratio column shows how close pcc_server comes to
+saturating it. the replies of pcc_server are checked against the number of printable characters in the payloads.
+every client uploads -b MiB of reproducible random bytes, and every measurement is the fastest of -n repetitions.
+
+build: gcc -O2 -pthread pcc_bench.c -o pcc_bench */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+
+#define MAX_LIST_LEN 16
+#define PAYLOAD_CHUNK_SIZE (4 << 20) // every client sends this chunk over and over
+#define SINK_BUFFER_SIZE (256 << 10)
+#define BACKLOG 4096
+#define STARTUP_TIMEOUT_MS 5000
+#define LOWEST_PRINTABLE 32
+#define HIGHEST_PRINTABLE 126
+
+
+struct int_list {
+	int values[MAX_LIST_LEN];
+	int len;
+};
+
+struct client {
+	pthread_t thread;
+	uint16_t port;
+	uint64_t reply;
+	int failed;
+};
+
+char* server_path = "./pcc_server";
+uint16_t port = 7777; // of pcc_server, while the sink listens on the next port
+char* workers_arg = NULL; // passed to pcc_server if given
+uint64_t upload_size = 256ULL << 20;
+int repetitions = 3;
+uint64_t seed = 1;
+
+unsigned char* payload_chunk;
+uint64_t expected_reply; // the number of printable characters in an upload
+pthread_barrier_t start_barrier; // so all the clients start uploading together
+
+
+void print_error_message(const char* s) {
+	perror(s);
+}
+
+
+void print_error_message_and_exit(const char* s) {
+	print_error_message(s);
+	exit(1);
+}
+
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// xorshift64*, so the same seed always generates the same payload
+uint64_t next_random() {
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545F4914F6CDD1DULL;
+}
+
+
+uint64_t count_printable_characters(const unsigned char* buf, size_t len) {
+	uint64_t n_pc = 0;
+	for (size_t i = 0; i < len; i++) {
+		n_pc += LOWEST_PRINTABLE <= buf[i] && buf[i] <= HIGHEST_PRINTABLE;
+	}
+	return n_pc;
+}
+
+
+void generate_payload() {
+	if ((payload_chunk = malloc(PAYLOAD_CHUNK_SIZE)) == NULL) {
+		print_error_message_and_exit("Failed to allocate the payload");
+	}
+	for (size_t i = 0; i < PAYLOAD_CHUNK_SIZE; i += sizeof(uint64_t)) {
+		uint64_t r = next_random();
+		memcpy(payload_chunk + i, &r, sizeof(r));
+	}
+	expected_reply = count_printable_characters(payload_chunk, PAYLOAD_CHUNK_SIZE) * (upload_size / PAYLOAD_CHUNK_SIZE) +
+		count_printable_characters(payload_chunk, upload_size % PAYLOAD_CHUNK_SIZE);
+}
+
+
+struct sockaddr_in loopback_address(uint16_t port) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return addr;
+}
+
+
+int connect_to(uint16_t port) {
+	struct sockaddr_in addr = loopback_address(port);
+	int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sockfd == -1) {
+		print_error_message_and_exit("Failed to create a socket");
+	}
+	if (connect(sockfd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+
+int send_all(int sockfd, const void* buf, size_t len) {
+	for (size_t sent = 0; sent < len; ) {
+		ssize_t n = send(sockfd, (const char*) buf + sent, len - sent, MSG_NOSIGNAL);
+		if (n == -1) {
+			return -1;
+		}
+		sent += n;
+	}
+	return 0;
+}
+
+
+int recv_all(int sockfd, void* buf, size_t len) {
+	for (size_t received = 0; received < len; ) {
+		ssize_t n = recv(sockfd, (char*) buf + received, len - received, 0);
+		if (n <= 0) {
+			return -1;
+		}
+		received += n;
+	}
+	return 0;
+}
+
+
+// runs the protocol of pcc_client over a connected socket, and returns the reply or -1 if the upload failed
+int64_t upload(int sockfd, uint64_t size) {
+	uint64_t size_be = htobe64(size);
+	uint64_t reply_be;
+	if (send_all(sockfd, &size_be, sizeof(size_be)) == -1) {
+		return -1;
+	}
+	for (uint64_t sent = 0; sent < size; sent += PAYLOAD_CHUNK_SIZE) {
+		size_t len = size - sent < PAYLOAD_CHUNK_SIZE ? size - sent : PAYLOAD_CHUNK_SIZE;
+		if (send_all(sockfd, payload_chunk, len) == -1) {
+			return -1;
+		}
+	}
+	if (recv_all(sockfd, &reply_be, sizeof(reply_be)) == -1) {
+		return -1;
+	}
+	return be64toh(reply_be);
+}
+
+
+void* client_func(void* arg) {
+	struct client* client = arg;
+	int sockfd = connect_to(client->port);
+	pthread_barrier_wait(&start_barrier); // even a client which failed to connect waits, so the others aren't stuck
+	int64_t reply = sockfd == -1 ? -1 : upload(sockfd, upload_size);
+	client->failed = reply == -1;
+	client->reply = reply;
+	if (sockfd != -1) {
+		close(sockfd);
+	}
+	return NULL;
+}
+
+
+void* sink_connection_func(void* arg) {
+	int connfd = (int) (intptr_t) arg;
+	unsigned char* buf = malloc(SINK_BUFFER_SIZE);
+	uint64_t size_be;
+	if (buf == NULL) {
+		print_error_message_and_exit("Failed to allocate a sink buffer");
+	}
+	if (recv_all(connfd, &size_be, sizeof(size_be)) == 0) {
+		uint64_t size = be64toh(size_be);
+		ssize_t n = 1;
+		for (uint64_t received = 0; received < size && n > 0; received += n) {
+			n = recv(connfd, buf, size - received < SINK_BUFFER_SIZE ? size - received : SINK_BUFFER_SIZE, 0);
+		}
+		send_all(connfd, &(uint64_t){0}, sizeof(uint64_t));
+	}
+	close(connfd);
+	free(buf);
+	return NULL;
+}
+
+
+// the sink serves every connection on its own thread, so it never holds the clients back
+void* sink_func(void* arg) {
+	int listenfd = (int) (intptr_t) arg;
+	while (1) {
+		int connfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+		pthread_t thread;
+		if (connfd == -1) {
+			print_error_message_and_exit("Failed to accept a connection to the sink");
+		}
+		if ((errno = pthread_create(&thread, NULL, sink_connection_func, (void*) (intptr_t) connfd)) != 0 || (errno = pthread_detach(thread)) != 0) {
+			print_error_message_and_exit("Failed to create a sink thread");
+		}
+	}
+	return NULL;
+}
+
+
+void start_sink(uint16_t sink_port) {
+	struct sockaddr_in addr = loopback_address(sink_port);
+	int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	pthread_t thread;
+	if (listenfd == -1) {
+		print_error_message_and_exit("Failed to create a socket");
+	}
+	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) == -1) {
+		print_error_message_and_exit("Failed to set 'SO_REUSEADDR' option");
+	}
+	if (bind(listenfd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+		print_error_message_and_exit("Failed to bind the sink");
+	}
+	if (listen(listenfd, BACKLOG) == -1) {
+		print_error_message_and_exit("Failed to listen");
+	}
+	if ((errno = pthread_create(&thread, NULL, sink_func, (void*) (intptr_t) listenfd)) != 0) {
+		print_error_message_and_exit("Failed to create the sink thread");
+	}
+}
+
+
+// starts pcc_server and waits until it completes an empty upload, so we know it's listening
+pid_t start_server() {
+	char port_arg[16];
+	snprintf(port_arg, sizeof(port_arg), "%d", port);
+	pid_t pid = fork();
+	if (pid == -1) {
+		print_error_message_and_exit("Failed to fork");
+	}
+	if (pid == 0) {
+		if (freopen("/dev/null", "w", stdout) == NULL) { // the counts it prints on SIGINT
+			_exit(1);
+		}
+		execl(server_path, server_path, port_arg, workers_arg, (char*) NULL); // workers_arg may be NULL, which ends the arguments
+		print_error_message("Failed to run pcc_server");
+		_exit(1);
+	}
+	for (uint64_t start_ns = now_ns(); now_ns() - start_ns < STARTUP_TIMEOUT_MS * 1000000ULL; usleep(10000)) {
+		int sockfd = connect_to(port);
+		if (sockfd != -1) {
+			int64_t reply = upload(sockfd, 0);
+			close(sockfd);
+			if (reply == 0) {
+				return pid;
+			}
+		}
+	}
+	fprintf(stderr, "pcc_server didn't start listening on port %d\n", port);
+	kill(pid, SIGKILL);
+	exit(1);
+}
+
+
+void stop_server(pid_t pid) {
+	int status;
+	if (kill(pid, SIGINT) == -1) {
+		print_error_message_and_exit("Failed to send SIGINT to pcc_server");
+	}
+	if (waitpid(pid, &status, 0) == -1) {
+		print_error_message_and_exit("Failed to wait for pcc_server");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "pcc_server didn't exit cleanly\n");
+		exit(1);
+	}
+}
+
+
+// uploads from num_clients concurrent clients, and returns the time from their start until the last reply, or 0 if a client failed
+uint64_t run_clients(uint16_t target_port, int num_clients, int is_checked) {
+	struct client* clients = calloc(num_clients, sizeof(struct client));
+	uint64_t elapsed_ns = 0;
+	int ok = 1;
+	if (clients == NULL) {
+		print_error_message_and_exit("Failed to allocate the clients");
+	}
+	if ((errno = pthread_barrier_init(&start_barrier, NULL, num_clients + 1)) != 0) {
+		print_error_message_and_exit("Failed to create a barrier");
+	}
+	for (int i = 0; i < num_clients; i++) {
+		clients[i].port = target_port;
+		if ((errno = pthread_create(&clients[i].thread, NULL, client_func, &clients[i])) != 0) {
+			print_error_message_and_exit("Failed to create a client thread");
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	uint64_t start_ns = now_ns();
+	for (int i = 0; i < num_clients; i++) {
+		if ((errno = pthread_join(clients[i].thread, NULL)) != 0) {
+			print_error_message_and_exit("Failed to join a client thread");
+		}
+		ok &= !clients[i].failed && (!is_checked || clients[i].reply == expected_reply);
+	}
+	elapsed_ns = now_ns() - start_ns;
+	pthread_barrier_destroy(&start_barrier);
+	free(clients);
+	return ok ? elapsed_ns : 0;
+}
+
+
+// the fastest of the repetitions, or 0 if any of them failed
+uint64_t best_run(uint16_t target_port, int num_clients, int is_checked) {
+	uint64_t best_ns = 0;
+	for (int i = 0; i < repetitions; i++) {
+		uint64_t elapsed_ns = run_clients(target_port, num_clients, is_checked);
+		if (elapsed_ns == 0) {
+			return 0;
+		}
+		if (best_ns == 0 || elapsed_ns < best_ns) {
+			best_ns = elapsed_ns;
+		}
+	}
+	return best_ns;
+}
+
+
+void run_benchmark(int num_clients) {
+	double total_mib = (double) upload_size * num_clients / (1 << 20);
+	uint64_t sink_ns = best_run(port + 1, num_clients, 0);
+	uint64_t server_ns = best_run(port, num_clients, 1);
+	if (sink_ns == 0) {
+		fprintf(stderr, "An upload to the sink failed\n");
+		exit(1);
+	}
+	double sink_rate = total_mib / (sink_ns / 1e9);
+	double server_rate = server_ns == 0 ? 0 : total_mib / (server_ns / 1e9);
+	printf("%7d %10.0f %12.0f %12.0f %6.2f %s\n", num_clients, total_mib, sink_rate, server_rate, server_rate / sink_rate, server_ns != 0 ? "ok" : "WRONG");
+	fflush(stdout);
+}
+
+
+void parse_int_list(char* s, struct int_list* list) {
+	list->len = 0;
+	for (char* token = strtok(s, ","); token != NULL; token = strtok(NULL, ",")) {
+		if (list->len == MAX_LIST_LEN) {
+			fprintf(stderr, "At most %d values can be given to an option\n", MAX_LIST_LEN);
+			exit(1);
+		}
+		list->values[list->len] = atoi(token);
+		if (list->values[list->len] <= 0) {
+			fprintf(stderr, "Invalid value '%s'\n", token);
+			exit(1);
+		}
+		list->len += 1;
+	}
+}
+
+
+void print_usage_and_exit(char* program) {
+	fprintf(stderr, "usage: %s [-s pcc_server_binary] [-p port] [-w server_workers] [-c clients,...] [-b MiB_per_client] [-n repetitions] [-r seed]\n", program);
+	exit(1);
+}
+
+
+int main(int argc, char* argv[]) {
+	struct int_list client_counts = { .values = { 1, 4, 16, 64 }, .len = 4 };
+	int opt;
+	while ((opt = getopt(argc, argv, "s:p:w:c:b:n:r:")) != -1) {
+		switch (opt) {
+		case 's':
+			server_path = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'w':
+			workers_arg = optarg;
+			break;
+		case 'c':
+			parse_int_list(optarg, &client_counts);
+			break;
+		case 'b':
+			upload_size = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'n':
+			repetitions = atoi(optarg);
+			break;
+		case 'r':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			print_usage_and_exit(argv[0]);
+		}
+	}
+	if (optind != argc || port == 0 || port == UINT16_MAX || upload_size == 0 || repetitions <= 0 || seed == 0) {
+		print_usage_and_exit(argv[0]);
+	}
+	if (access(server_path, X_OK) == -1) {
+		print_error_message_and_exit("Can't run the pcc_server binary");
+	}
+
+	generate_payload();
+	start_sink(port + 1);
+	pid_t server_pid = start_server();
+
+	printf("%7s %10s %12s %12s %6s %s\n", "clients", "total_MiB", "sink_MiB/s", "pcc_MiB/s", "ratio", "check");
+	for (int i = 0; i < client_counts.len; i++) {
+		run_benchmark(client_counts.values[i]);
+	}
+
+	stop_server(server_pid);
+	exit(0); // success
+}
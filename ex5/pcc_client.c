@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <fcntl.h>
@@ -8,9 +9,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <endian.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
 
 
-#define MAX_BUF_LEN 1024
+#define MAX_BUF_LEN 1024 // used only to copy inputs which can't be spliced
+#define MAX_SPLICE_LEN (1 << 30)
 
 
 void print_error_message(const char* s) {
@@ -24,9 +29,43 @@ void print_error_message_and_exit(const char* s) {
 }
 
 
-uint64_t get_file_size(char* path) {
+/* the protocol sends the length before the content, so an input which isn't a regular file (a pipe or stdin, for example) is first
+moved to an anonymous in-memory file. a pipe is spliced into it by the kernel, and anything else is copied through a small buffer */
+int buffer_input(int fd) {
+	int memfd = memfd_create("pcc_client_input", MFD_CLOEXEC);
+	if (memfd == -1) {
+		print_error_message_and_exit("Failed to create an in-memory file for the input");
+	}
+	ssize_t bytes_moved;
+	while ((bytes_moved = splice(fd, NULL, memfd, NULL, MAX_SPLICE_LEN, SPLICE_F_MOVE)) > 0) {
+		continue;
+	}
+	if (bytes_moved == -1 && errno != EINVAL) { // EINVAL means the input isn't a pipe
+		print_error_message_and_exit("Failed to read the input");
+	}
+	if (bytes_moved == -1) {
+		char buf[MAX_BUF_LEN];
+		while ((bytes_moved = read(fd, buf, sizeof(buf))) > 0) {
+			for (ssize_t bytes_written = 0, n; bytes_written < bytes_moved; bytes_written += n) {
+				if ((n = write(memfd, buf + bytes_written, bytes_moved - bytes_written)) == -1) {
+					print_error_message_and_exit("Failed to buffer the input");
+				}
+			}
+		}
+		if (bytes_moved == -1) {
+			print_error_message_and_exit("Failed to read the input");
+		}
+	}
+	if (close(fd) == -1) {
+		print_error_message_and_exit("Failed to close the input file");
+	}
+	return memfd;
+}
+
+
+uint64_t get_file_size(int fd) {
 	struct stat buf;
-	if (stat(path, &buf) == -1) {
+	if (fstat(fd, &buf) == -1) {
 		print_error_message_and_exit("Failed to get information on the file");
 	}
 	return buf.st_size;
@@ -46,6 +85,13 @@ int main(int argc, char *argv[]) {
 	if (fd == -1) {
 		print_error_message_and_exit("Failed to open the input file");
 	}
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) == -1) {
+		print_error_message_and_exit("Failed to get information on the file");
+	}
+	if (!S_ISREG(file_stat.st_mode)) {
+		fd = buffer_input(fd);
+	}
 
 	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 	if (sockfd < 0) {
@@ -73,39 +119,41 @@ int main(int argc, char *argv[]) {
 	// part (a) of the proctocol
 	uint64_t bytes_sent = 0;
 	uint64_t bytes_written = 0;
-	uint64_t file_size = get_file_size(file_path);
+	uint64_t file_size = get_file_size(fd);
 	uint64_t file_size_be = htobe64(file_size);
 	while (bytes_sent < sizeof(file_size_be)) { // send the message length (file size in bytes) to server
-		if ((bytes_written = write(sockfd, &file_size_be + bytes_sent, sizeof(file_size_be) - bytes_sent)) == -1) {
+		if ((bytes_written = write(sockfd, (char*) &file_size_be + bytes_sent, sizeof(file_size_be) - bytes_sent)) == -1) {
 			print_error_message_and_exit("Failed to send data to the server");
 		}
 		bytes_sent += bytes_written;
 	}
 
 	// part (b) of the proctocol
-	char buf[MAX_BUF_LEN];
 	bytes_written = 0;
 	bytes_sent = 0;
-	uint64_t bytes_read = 0;
-	while (bytes_sent < file_size) { // send the message itself (the file's content) to server
-		if ((bytes_read = read(fd, buf, sizeof(buf))) == -1) {
-			print_error_message_and_exit("Failed to read the file content");
-		} else if (bytes_read == 0) {
+	off_t offset = 0;
+	while (bytes_sent < file_size) { // send the message itself (the file's content) to server, straight from the page cache
+		uint64_t bytes_left = file_size - bytes_sent;
+		/* sendfile may send less than it was asked to (a signal, or a socket buffer which filled up), and it advances offset by what
+		it sent, so we just ask again for the rest */
+		if ((bytes_written = sendfile(sockfd, fd, &offset, bytes_left < MAX_SPLICE_LEN ? bytes_left : MAX_SPLICE_LEN)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			print_error_message_and_exit("Failed to send data to the server");
+		} else if (bytes_written == 0) { // the file was truncated after we sent its size
 			fprintf(stderr, "EOF error");
 			exit(1);
 		}
-		if ((bytes_written = write(sockfd, buf, bytes_read)) == -1) {
-			print_error_message_and_exit("Failed to send data to the server");
-		}
 		bytes_sent += bytes_written;
 	}
 
 	// part (c) of the proctocol
 	uint64_t n_pc_be = 0;
 	uint64_t bytes_recv = 0;
-	bytes_read = 0;
+	uint64_t bytes_read = 0;
 	while (bytes_recv < sizeof(n_pc_be)) { // receive the amount of printable characters from server
-		if ((bytes_read = read(sockfd, &n_pc_be + bytes_recv, sizeof(n_pc_be) - bytes_recv)) == -1) {
+		if ((bytes_read = read(sockfd, (char*) &n_pc_be + bytes_recv, sizeof(n_pc_be) - bytes_recv)) == -1) {
 			print_error_message_and_exit("Failed to receive data from the server");
 		} else if (bytes_read == 0) {
 			fprintf(stderr, "EOF error");
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <fcntl.h>
@@ -5,22 +6,78 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <endian.h>
 #include <errno.h>
 #include <signal.h>
-#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 
-#define BACKLOG 10
+#define BACKLOG 4096
 #define LOWEST_PRINTABLE 32
 #define HIGHEST_PRINTABLE 126
 #define N_PRINTABLE HIGHEST_PRINTABLE - LOWEST_PRINTABLE + 1
-
-
-int listenfd;
-atomic_int sigint_flag = 0;
+#define MAX_EVENTS 256 // the events a worker handles per epoll_wait
+#define MAX_READS_PER_EVENT 16 // so a single fast uploader doesn't starve the other connections of its worker
+#define MIN_RECV_BUFFER_SIZE (64 << 10)
+#define MAX_RECV_BUFFER_SIZE (256 << 10)
+#define N_SUB_HISTOGRAMS 4
+#define ACCEPT_RETRY_MS 100 // how long a worker which ran out of file descriptors waits before it tries to accept again
+#define ACCEPT_ERROR_REPORT_INTERVAL 1 // the seconds between two reports of failing to accept, so running out of file descriptors doesn't flood stderr
+
+
+// the phases of a connection, one per part of the protocol
+enum connection_phase {
+	RECEIVING_LENGTH, // part (a)
+	RECEIVING_PAYLOAD, // part (b)
+	SENDING_REPLY, // part (c)
+};
+
+// what advance_connection did with a connection
+enum connection_status {
+	CONNECTION_PENDING, // it waits for the socket to become readable/writable again
+	CONNECTION_DONE, // the reply was sent
+	CONNECTION_FAILED, // a TCP error (or an early EOF) ended it, so its stats are discarded
+};
+
+struct connection {
+	int connfd;
+	enum connection_phase phase;
+	uint64_t bytes_done; // the bytes of the current phase which were already received/sent
+	uint64_t file_size_be;
+	uint64_t file_size;
+	uint64_t n_pc;
+	uint64_t n_pc_be;
+	uint64_t pcc_tmp[N_PRINTABLE]; // the pcc data structure which is relevant for this connection
+};
+
+/* each worker has its own listening socket (all of them are bound to the same port with SO_REUSEPORT, so the kernel spreads the
+incoming connections between them) and its own epoll instance, and serves its connections without sharing anything with the others */
+struct worker {
+	pthread_t thread;
+	int listenfd;
+	int epollfd;
+	int n_connections;
+	int is_accepting_paused; // the listening socket was removed from epoll after accept ran out of file descriptors (or memory)
+	time_t last_accept_error_report;
+	uint64_t pcc_total[N_PRINTABLE]; // the stats of the connections this worker completed
+	unsigned char* recv_buffer; // the payloads of all the connections of this worker are read into it, a buffer at a time
+	size_t recv_buffer_size;
+};
+
+
+int n_workers;
+struct worker* workers;
+int sigint_eventfd; // becomes readable when SIGINT occurs, and is watched by the epoll instances of all the workers
+uint64_t (*count_printable_characters)(const unsigned char* buf, size_t len); // the fastest implementation the CPU supports
 
 
 void print_error_message(const char* s) {
@@ -39,6 +96,97 @@ int is_printable_character(char c) {
 }
 
 
+/* adds the number of occurrences of each printable character of buf to pcc.
+consecutive bytes are counted in different sub-histograms, so a run of the same byte doesn't make every increment wait for the store
+of the previous one to the same counter. len is at most MAX_RECV_BUFFER_SIZE, so the 32-bit counters can't overflow */
+void update_histogram(const unsigned char* buf, size_t len, uint64_t* pcc) {
+	uint32_t sub_histograms[N_SUB_HISTOGRAMS][256] = {0};
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) { // a single load for 8 bytes
+		uint64_t word;
+		memcpy(&word, buf + i, sizeof(word));
+		sub_histograms[0][word & 0xff] += 1;
+		sub_histograms[1][(word >> 8) & 0xff] += 1;
+		sub_histograms[2][(word >> 16) & 0xff] += 1;
+		sub_histograms[3][(word >> 24) & 0xff] += 1;
+		sub_histograms[0][(word >> 32) & 0xff] += 1;
+		sub_histograms[1][(word >> 40) & 0xff] += 1;
+		sub_histograms[2][(word >> 48) & 0xff] += 1;
+		sub_histograms[3][word >> 56] += 1;
+	}
+	for (; i < len; i++) {
+		sub_histograms[0][buf[i]] += 1;
+	}
+	for (int c = LOWEST_PRINTABLE; c <= HIGHEST_PRINTABLE; c++) {
+		for (int j = 0; j < N_SUB_HISTOGRAMS; j++) {
+			pcc[c - LOWEST_PRINTABLE] += sub_histograms[j][c];
+		}
+	}
+}
+
+
+uint64_t count_printable_characters_scalar(const unsigned char* buf, size_t len) {
+	uint64_t n_pc = 0;
+	for (size_t i = 0; i < len; i++) {
+		n_pc += is_printable_character(buf[i]); // no branch, since the bytes of an upload are as likely to be printable as not
+	}
+	return n_pc;
+}
+
+
+#ifdef __x86_64__
+/* adding 128 - LOWEST_PRINTABLE maps the printable characters to the lowest signed bytes (-128 up to -128 + N_PRINTABLE - 1),
+so a single signed comparison tells whether a byte is printable */
+#define PRINTABLE_SHIFT (128 - LOWEST_PRINTABLE)
+#define PRINTABLE_BOUND (-128 + N_PRINTABLE)
+
+__attribute__((target("avx2")))
+uint64_t count_printable_characters_avx2(const unsigned char* buf, size_t len) {
+	const __m256i shift = _mm256_set1_epi8(PRINTABLE_SHIFT);
+	const __m256i bound = _mm256_set1_epi8(PRINTABLE_BOUND);
+	__m256i totals = _mm256_setzero_si256(); // 4 64-bit sums
+	size_t i = 0;
+	while (i + 32 <= len) {
+		__m256i counts = _mm256_setzero_si256(); // 32 byte-sized counts, which are added to totals before they can overflow
+		for (int round = 0; round < 255 && i + 32 <= len; round++, i += 32) {
+			__m256i bytes = _mm256_add_epi8(_mm256_loadu_si256((const __m256i*) (buf + i)), shift);
+			counts = _mm256_sub_epi8(counts, _mm256_cmpgt_epi8(bound, bytes)); // the comparison gives -1 for a printable byte
+		}
+		totals = _mm256_add_epi64(totals, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+	}
+	uint64_t n_pc = _mm256_extract_epi64(totals, 0) + _mm256_extract_epi64(totals, 1) + _mm256_extract_epi64(totals, 2) + _mm256_extract_epi64(totals, 3);
+	return n_pc + count_printable_characters_scalar(buf + i, len - i);
+}
+
+
+__attribute__((target("avx512bw,popcnt")))
+uint64_t count_printable_characters_avx512(const unsigned char* buf, size_t len) {
+	const __m512i shift = _mm512_set1_epi8(PRINTABLE_SHIFT);
+	const __m512i bound = _mm512_set1_epi8(PRINTABLE_BOUND);
+	uint64_t n_pc = 0;
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64) {
+		__m512i bytes = _mm512_add_epi8(_mm512_loadu_si512(buf + i), shift);
+		n_pc += _mm_popcnt_u64(_mm512_cmplt_epi8_mask(bytes, bound)); // a bit per printable byte
+	}
+	return n_pc + count_printable_characters_scalar(buf + i, len - i);
+}
+#endif
+
+
+void select_printable_characters_counter() {
+	count_printable_characters = count_printable_characters_scalar;
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt")) {
+		count_printable_characters = count_printable_characters_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		count_printable_characters = count_printable_characters_avx2;
+	}
+#endif
+}
+
+
 void print_pcc(uint64_t* pcc_total) {
 	for (int i = 0; i < N_PRINTABLE; i++) {
 		printf("char '%c' : %lu times\n", i + LOWEST_PRINTABLE, pcc_total[i]);
@@ -52,10 +200,10 @@ int is_tcp_error() {
 
 
 void SIGINTHandler() {
-	if (close(listenfd) == -1) { // we do this so a call to "accept" would fail and we will be able to identify that SIGINT occurred
-		print_error_message_and_exit("Failed to close the listening socket while handling SIGINT");
+	// the workers stop accepting connections once they see the eventfd, and exit after they finish the connections they already have
+	if (write(sigint_eventfd, &(uint64_t){1}, sizeof(uint64_t)) == -1) {
+		print_error_message_and_exit("Failed to notify the workers while handling SIGINT");
 	}
-	sigint_flag = 1;
 }
 
 
@@ -69,19 +217,8 @@ void register_SIGINT_handler() {
 }
 
 
-int main(int argc, char *argv[]) {
-	if (argc != 2) {
-		fprintf(stderr, "You must pass 1 argument\n");
-		exit(1);
-	}
-	uint16_t serv_port = atoi(argv[1]);
-	
-	uint64_t pcc_total[N_PRINTABLE];
-	memset(pcc_total, 0, sizeof(pcc_total));
-
-	register_SIGINT_handler();
-
-	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+int create_listening_socket(uint16_t serv_port) {
+	int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (listenfd < 0) {
 		print_error_message_and_exit("Failed to create a socket");
 	}
@@ -91,6 +228,11 @@ int main(int argc, char *argv[]) {
 		print_error_message_and_exit("Failed to set 'SO_REUSEADDR' option");
 	}
 
+	// using this every worker binds its own socket to the same port
+	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) == -1) {
+		print_error_message_and_exit("Failed to set 'SO_REUSEPORT' option");
+	}
+
 	//construct the server address data structure
 	struct sockaddr_in serv_addr; // where we want to get to
 	socklen_t addrsize = sizeof(struct sockaddr_in);
@@ -106,138 +248,331 @@ int main(int argc, char *argv[]) {
 	if (listen(listenfd, BACKLOG) == -1) {
 		print_error_message_and_exit("Failed to listen");
 	}
+	return listenfd;
+}
+
+
+// the epoll data of the listening socket is NULL and that of sigint_eventfd is &sigint_eventfd, while that of a connection is its struct
+void add_to_epoll(int epollfd, int fd, uint32_t events, void* ptr) {
+	struct epoll_event event = {.events = events, .data.ptr = ptr};
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		print_error_message_and_exit("Failed to add a file descriptor to epoll");
+	}
+}
+
+
+void report_accept_error(struct worker* worker) {
+	time_t now = time(NULL);
+	if (now - worker->last_accept_error_report >= ACCEPT_ERROR_REPORT_INTERVAL) {
+		print_error_message("Failed to accept a connection");
+		worker->last_accept_error_report = now;
+	}
+}
+
+
+/* the connection stays in the backlog, which keeps the level-triggered listening socket readable, so we stop watching it
+until one of our connections is closed or ACCEPT_RETRY_MS pass (the file descriptors may be freed by the other workers) */
+void pause_accepting(struct worker* worker) {
+	if (epoll_ctl(worker->epollfd, EPOLL_CTL_DEL, worker->listenfd, NULL) == -1) {
+		print_error_message_and_exit("Failed to remove a file descriptor from epoll");
+	}
+	worker->is_accepting_paused = 1;
+}
+
+
+void resume_accepting(struct worker* worker) {
+	if (worker->is_accepting_paused && worker->listenfd != -1) {
+		add_to_epoll(worker->epollfd, worker->listenfd, EPOLLIN, NULL);
+	}
+	worker->is_accepting_paused = 0;
+}
+
 
+void accept_connections(struct worker* worker) {
 	int connfd;
-	int tcp_error;
-	uint64_t pcc_tmp[N_PRINTABLE]; // the pcc data structure which is relevant for current connection
-	while (!sigint_flag) { // while we aren't getting SIGINT
-		/* in each stage we want to verify that we don't get a TCP error.
-		If we do, we want to continue to the next connection without updating the pcc data structure */
-		tcp_error = 0;
-		if ((connfd = accept(listenfd, NULL, NULL)) == -1) {
-			/* because of "close(listenfd)" in SIGINTHandler, a SIGINT will cause "accept" to return -1 (indicating an error),
-			and the sigint_flag is set */
-			if (sigint_flag) {
-				break;
+	while ((connfd = accept4(worker->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		struct connection* conn = calloc(1, sizeof(struct connection));
+		if (conn == NULL) {
+			print_error_message_and_exit("Failed to allocate a connection");
+		}
+		conn->connfd = connfd;
+		conn->phase = RECEIVING_LENGTH;
+		add_to_epoll(worker->epollfd, connfd, EPOLLIN, conn);
+		worker->n_connections++;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) { // we accepted all the pending connections
+		return;
+	}
+	if (errno == ECONNABORTED) { // the client gave up on the connection, and the next one is accepted on the next round
+		return;
+	}
+	if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+		report_accept_error(worker);
+		pause_accepting(worker);
+		return;
+	}
+	print_error_message_and_exit("Failed to accept a connection");
+}
+
+
+// returns the number of bytes read, 0 if the socket has no data right now, or -1 if the connection failed
+ssize_t read_from_connection(int connfd, void* buf, size_t len) {
+	ssize_t bytes_read = read(connfd, buf, len);
+	if (bytes_read == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+		if (is_tcp_error()) {
+			print_error_message("Failed to read due to a TCP error");
+			return -1;
+		}
+		print_error_message_and_exit("Failed to receive data from the client");
+	} else if (bytes_read == 0) {
+		fprintf(stderr, "EOF error\n");
+		return -1;
+	}
+	return bytes_read;
+}
+
+
+// returns the number of bytes written, 0 if the socket can't take data right now, or -1 if the connection failed
+ssize_t write_to_connection(int connfd, const void* buf, size_t len) {
+	ssize_t bytes_written = send(connfd, buf, len, MSG_NOSIGNAL); // a client which went away is a TCP error (EPIPE), not a SIGPIPE
+	if (bytes_written == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+		if (is_tcp_error()) {
+			print_error_message("Failed to write due to a TCP error");
+			return -1;
+		}
+		print_error_message_and_exit("Failed to send data to the client");
+	}
+	return bytes_written;
+}
+
+
+// moves the connection through the phases of the protocol as far as its socket allows without blocking
+enum connection_status advance_connection(struct worker* worker, struct connection* conn) {
+	ssize_t n;
+	int reads_left = MAX_READS_PER_EVENT;
+
+	if (conn->phase == RECEIVING_LENGTH) { // receive the message length (file size in bytes) from client
+		while (conn->bytes_done < sizeof(conn->file_size_be)) {
+			if ((n = read_from_connection(conn->connfd, (char*) &conn->file_size_be + conn->bytes_done, sizeof(conn->file_size_be) - conn->bytes_done)) <= 0) {
+				return n == 0 ? CONNECTION_PENDING : CONNECTION_FAILED;
 			}
-			print_error_message_and_exit("Failed to accept a connection");
-		}
-
-		memset(pcc_tmp, 0, sizeof(pcc_tmp));
-
-		// part (a) of the proctocol
-		uint64_t file_size_be;
-		uint64_t file_size;
-		uint64_t bytes_recv = 0;
-		uint64_t bytes_read = 0;
-		while (bytes_recv < sizeof(file_size_be)) { // receive the message length (file size in bytes) from client
-			if ((bytes_read = read(connfd, &file_size_be + bytes_recv, sizeof(file_size_be) - bytes_recv)) == -1) {
-				/* if we get a SIGINT while the syscall is being run,
-				the SIGINT handler executes and the return value of the syscall is -1 */
-				if (sigint_flag) {
-					/* we continue because we want to end the current session and
-					after that the outer while loop will end */
-					continue;
-				}
-				if (is_tcp_error()) {
-					print_error_message("Failed to read due to a TCP error");
-					tcp_error = 1;
-					/* break from the current while loop, and the check after it would recognize
-					the problem and move on to the next connection */
-					break;
-				}
-				print_error_message_and_exit("Failed to receive data from the server");
-			} else if (bytes_read == 0) {
-				fprintf(stderr, "EOF error\n");
-				tcp_error = 1;
-				break;
+			conn->bytes_done += n;
+			reads_left--;
+		}
+		conn->file_size = be64toh(conn->file_size_be);
+		conn->bytes_done = 0;
+		conn->phase = RECEIVING_PAYLOAD;
+	}
+
+	if (conn->phase == RECEIVING_PAYLOAD) { // receive the message itself (the file's content) from client
+		while (conn->bytes_done < conn->file_size) {
+			if (reads_left-- == 0) { // the socket is still readable, so epoll reports it again on the next round
+				return CONNECTION_PENDING;
 			}
-			bytes_recv += bytes_read;
-		}
-		
-		if (tcp_error) { // check for a tcp error
-			continue;
-		}
-
-		// part (b) of the proctocol
-		file_size = be64toh(file_size_be);
-		char c;
-		int n_pc = 0;
-		bytes_recv = 0;
-		bytes_read = 0;
-		while (bytes_recv < file_size) { // receive the message itself (the file's content) from client
-			if ((bytes_read = read(connfd, &c, sizeof(c))) == -1) {
-				/* if we get a SIGINT while the syscall is being run,
-				the SIGINT handler executes and the return value of the syscall is -1 */
-				if (sigint_flag) {
-					/* we continue because we want to end the current session and
-					after that the outer while loop will end */
-					continue;
-				}
-				if (is_tcp_error()) {
-					print_error_message("Failed to read due to a TCP error");
-					tcp_error = 1;
-					/* break from the current while loop, and the check after it would recognize
-					the problem and move on to the next connection */
-					break;
-				}
-				print_error_message_and_exit("Failed to receive data from the server");
-			} else if (bytes_read == 0) {
-				fprintf(stderr, "EOF error\n");
-				tcp_error = 1;
-				break;
+			uint64_t bytes_left = conn->file_size - conn->bytes_done;
+			size_t len = bytes_left < worker->recv_buffer_size ? bytes_left : worker->recv_buffer_size;
+			if ((n = read_from_connection(conn->connfd, worker->recv_buffer, len)) <= 0) {
+				return n == 0 ? CONNECTION_PENDING : CONNECTION_FAILED;
 			}
-			bytes_recv += bytes_read;
-			if (is_printable_character(c)) {
-				n_pc += 1;
-				pcc_tmp[c - LOWEST_PRINTABLE] += 1; // upadte the right cell of the current printable character
+			conn->bytes_done += n;
+			conn->n_pc += count_printable_characters(worker->recv_buffer, n);
+			update_histogram(worker->recv_buffer, n, conn->pcc_tmp);
+		}
+		conn->n_pc_be = htobe64(conn->n_pc);
+		conn->bytes_done = 0;
+		conn->phase = SENDING_REPLY;
+	}
+
+	// send the amount of printable characters to client
+	while (conn->bytes_done < sizeof(conn->n_pc_be)) {
+		if ((n = write_to_connection(conn->connfd, (char*) &conn->n_pc_be + conn->bytes_done, sizeof(conn->n_pc_be) - conn->bytes_done)) == -1) {
+			return CONNECTION_FAILED;
+		}
+		if (n == 0) { // wait until the socket is writable instead of readable
+			struct epoll_event event = {.events = EPOLLOUT, .data.ptr = conn};
+			if (epoll_ctl(worker->epollfd, EPOLL_CTL_MOD, conn->connfd, &event) == -1) {
+				print_error_message_and_exit("Failed to modify a file descriptor in epoll");
 			}
+			return CONNECTION_PENDING;
 		}
+		conn->bytes_done += n;
+	}
+	return CONNECTION_DONE;
+}
+
 
-		if (tcp_error) { // check for a tcp error
-			continue;
+void close_connection(struct worker* worker, struct connection* conn, enum connection_status status) {
+	if (close(conn->connfd) == -1) { // this also removes the socket from the epoll instance
+		print_error_message_and_exit("Failed to close the socket");
+	}
+	if (status == CONNECTION_DONE) { // update the pcc data structure with the stats from the connection
+		for (int i = 0; i < N_PRINTABLE; i++) {
+			worker->pcc_total[i] += conn->pcc_tmp[i];
 		}
+	}
+	free(conn);
+	worker->n_connections--;
+	resume_accepting(worker); // its file descriptor can take a pending connection
+}
+
+
+/* the buffer fits what the kernel may have queued on a socket (SO_RCVBUF, which the accepted sockets inherit from the listening one),
+so a single read usually drains it, and it's kept between MIN_RECV_BUFFER_SIZE and MAX_RECV_BUFFER_SIZE */
+void allocate_recv_buffer(struct worker* worker) {
+	int rcvbuf;
+	socklen_t optlen = sizeof(rcvbuf);
+	if (getsockopt(worker->listenfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen) == -1) {
+		print_error_message_and_exit("Failed to get 'SO_RCVBUF' option");
+	}
+	worker->recv_buffer_size = rcvbuf < MIN_RECV_BUFFER_SIZE ? MIN_RECV_BUFFER_SIZE : rcvbuf > MAX_RECV_BUFFER_SIZE ? MAX_RECV_BUFFER_SIZE : rcvbuf;
+	if ((worker->recv_buffer = malloc(worker->recv_buffer_size)) == NULL) {
+		print_error_message_and_exit("Failed to allocate a receive buffer");
+	}
+}
+
+
+void stop_accepting(struct worker* worker) {
+	if (epoll_ctl(worker->epollfd, EPOLL_CTL_DEL, sigint_eventfd, NULL) == -1) { // the eventfd stays readable, so we stop watching it
+		print_error_message_and_exit("Failed to remove a file descriptor from epoll");
+	}
+	if (close(worker->listenfd) == -1) { // this also removes the socket from the epoll instance, unless accepting is paused
+		print_error_message_and_exit("Failed to close the listening socket");
+	}
+	worker->listenfd = -1;
+	worker->is_accepting_paused = 0;
+}
+
+
+void* worker_func(void* arg) {
+	struct worker* worker = arg;
+	struct epoll_event events[MAX_EVENTS];
 
-		// part (c) of the proctocol
-		uint64_t n_pc_be = htobe64(n_pc);
-		uint64_t bytes_sent = 0;
-		uint64_t bytes_written = 0;
-		while (bytes_sent < sizeof(n_pc_be)) { // send the amount of printable characters to client
-			if ((bytes_written = write(connfd, &n_pc_be + bytes_sent, sizeof(n_pc_be) - bytes_sent)) == -1) {
-				/* if we get a SIGINT while the syscall is being run,
-				the SIGINT handler executes and the return value of the syscall is -1 */
-				if (sigint_flag) {
-					/* we continue because we want to end the current session and
-					after that the outer while loop will end */
-					continue;
+	while (worker->listenfd != -1 || worker->n_connections > 0) { // after SIGINT we only finish the connections we already have
+		int n_events = epoll_wait(worker->epollfd, events, MAX_EVENTS, worker->is_accepting_paused ? ACCEPT_RETRY_MS : -1);
+		if (n_events == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			print_error_message_and_exit("Failed to wait for events");
+		}
+		if (n_events == 0) { // only a paused worker times out
+			resume_accepting(worker);
+		}
+		for (int i = 0; i < n_events; i++) {
+			void* ptr = events[i].data.ptr;
+			if (ptr == &sigint_eventfd) {
+				stop_accepting(worker);
+			} else if (ptr == NULL) {
+				if (worker->listenfd != -1) { // the listening socket may have been closed by an earlier event of this round
+					accept_connections(worker);
 				}
-				if (is_tcp_error()) {
-					print_error_message("Failed to read due to a TCP error");
-					tcp_error = 1;
-					/* break from the current while loop, and the check after it would recognize
-					the problem and move on to the next connection */
-					break;
+			} else {
+				struct connection* conn = ptr;
+				enum connection_status status = advance_connection(worker, conn);
+				if (status != CONNECTION_PENDING) {
+					close_connection(worker, conn, status);
 				}
-				print_error_message_and_exit("Failed to send data to the server");
 			}
-			bytes_sent += bytes_written;
 		}
+	}
+	return NULL;
+}
 
-		if (tcp_error) { // check for a tcp error
-			continue;
-		}
 
-		if (close(connfd) == -1) {
-			print_error_message_and_exit("Failed to close the socket");
+void start_workers(uint16_t serv_port) {
+	workers = calloc(n_workers, sizeof(struct worker));
+	if (workers == NULL) {
+		print_error_message_and_exit("Failed to allocate the workers");
+	}
+
+	// the workers don't handle SIGINT, so it's delivered to the main thread (which is waiting for them to exit)
+	sigset_t sigint_set;
+	sigset_t old_set;
+	sigemptyset(&sigint_set);
+	sigaddset(&sigint_set, SIGINT);
+	if ((errno = pthread_sigmask(SIG_BLOCK, &sigint_set, &old_set)) != 0) {
+		print_error_message_and_exit("Failed to block SIGINT");
+	}
+
+	for (int i = 0; i < n_workers; i++) {
+		struct worker* worker = &workers[i];
+		worker->listenfd = create_listening_socket(serv_port);
+		allocate_recv_buffer(worker);
+		if ((worker->epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			print_error_message_and_exit("Failed to create an epoll instance");
+		}
+		add_to_epoll(worker->epollfd, worker->listenfd, EPOLLIN, NULL);
+		add_to_epoll(worker->epollfd, sigint_eventfd, EPOLLIN, &sigint_eventfd);
+		if ((errno = pthread_create(&worker->thread, NULL, worker_func, worker)) != 0) {
+			print_error_message_and_exit("Failed to create a worker thread");
 		}
+	}
 
-		// update the pcc data structure with the stats from the current connection
-		for (int i = 0; i < N_PRINTABLE; i++) {
-			pcc_total[i] += pcc_tmp[i];
+	if ((errno = pthread_sigmask(SIG_SETMASK, &old_set, NULL)) != 0) {
+		print_error_message_and_exit("Failed to unblock SIGINT");
+	}
+}
+
+
+// each connection takes a file descriptor, and the default soft limit (usually 1024) is far below the clients we serve at once
+void raise_open_files_limit() {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+		print_error_message_and_exit("Failed to get the limit on open files");
+	}
+	if (limit.rlim_cur == limit.rlim_max) {
+		return;
+	}
+	limit.rlim_cur = limit.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &limit) == -1) { // the server still works with the current limit, only with fewer clients at once
+		print_error_message("Failed to raise the limit on open files");
+	}
+}
+
+
+int main(int argc, char *argv[]) {
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "You must pass 1 or 2 arguments\n");
+		exit(1);
+	}
+	uint16_t serv_port = atoi(argv[1]);
+	n_workers = argc == 3 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN); // by default there is a worker per online CPU
+	if (n_workers < 1) {
+		fprintf(stderr, "The number of worker threads must be positive\n");
+		exit(1);
+	}
+
+	// created before the handler is registered, so a SIGINT always finds it
+	if ((sigint_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		print_error_message_and_exit("Failed to create an eventfd");
+	}
+
+	register_SIGINT_handler();
+
+	raise_open_files_limit();
+
+	select_printable_characters_counter();
+
+	start_workers(serv_port);
+
+	uint64_t pcc_total[N_PRINTABLE];
+	memset(pcc_total, 0, sizeof(pcc_total));
+	for (int i = 0; i < n_workers; i++) { // the workers exit only after SIGINT
+		if ((errno = pthread_join(workers[i].thread, NULL)) != 0) {
+			print_error_message_and_exit("Failed to join a worker thread");
+		}
+		for (int j = 0; j < N_PRINTABLE; j++) {
+			pcc_total[j] += workers[i].pcc_total[j];
 		}
 	}
 
 	print_pcc(pcc_total);
-	
+
 	return 0;
 }